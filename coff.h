@@ -13,6 +13,10 @@
 #define COFF_GET_S32( coff, field ) ( (int32_t)( coff ).field[ 0 ] | (uint32_t)( coff ).field[ 1 ] << 8 | (uint32_t)( coff ).field[ 2 ] << 16 | (uint32_t)( coff ).field[ 3 ] << 24 )
 #define COFF_GET_INT( coff, field ) ( sizeof( ( coff ).field ) == 1 ? COFF_GET_S8( coff, field ) : sizeof( ( coff ).field ) == 2 ? COFF_GET_S16( coff, field ) : COFF_GET_S32( coff, field ) )
 
+#define COFF_SET_U8( coff, field, v ) do { ( coff ).field[ 0 ] = (uint8_t)( v ); } while ( 0 )
+#define COFF_SET_U16( coff, field, v ) do { ( coff ).field[ 0 ] = (uint8_t)( v ); ( coff ).field[ 1 ] = (uint8_t)( ( v ) >> 8 ); } while ( 0 )
+#define COFF_SET_U32( coff, field, v ) do { ( coff ).field[ 0 ] = (uint8_t)( v ); ( coff ).field[ 1 ] = (uint8_t)( ( v ) >> 8 ); ( coff ).field[ 2 ] = (uint8_t)( ( v ) >> 16 ); ( coff ).field[ 3 ] = (uint8_t)( ( v ) >> 24 ); } while ( 0 )
+
 /*
 http://msdn.microsoft.com/en-us/windows/hardware/gg463119.aspx
 */
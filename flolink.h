@@ -0,0 +1,72 @@
+#ifndef FLOLINK_H
+#define FLOLINK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+libflolink links COFF objects held in memory straight into executable memory,
+without going through files: the objects are linked like flolink would do
+into a .flo, and the module is laid out in memory and relocated right away.
+The library is luacoff.c, libflolink.c, test/floload.c and the embedded
+main.lua.
+*/
+
+/* Errors */
+#define FLOLINK_OK                0 /* Yay! */
+#define FLOLINK_ERROR_LINK       -1 /* The link failed, the reason was written to stderr. */
+#define FLOLINK_ERROR_SCRIPT     -2 /* The link engine raised an error, see flolink_error. */
+#define FLOLINK_ERROR_MEMORY     -3 /* The module doesn't fit the memory given, or mapping memory failed. */
+#define FLOLINK_SYMBOL_NOT_FOUND -4 /* The import callback returned zero, see flolink_error. */
+#define FLOLINK_ERROR_EXPORT     -5 /* The export callback returned zero, see flolink_error. */
+#define FLOLINK_ERROR_MODULE     -6 /* The link engine handed back a module that can't be read or relocated, see flolink_error. */
+
+typedef struct flolink_t flolink_t;
+
+/* An object file in memory. */
+typedef struct
+{
+  const char* name; /* Unique name used in messages. */
+  const void* data;
+  size_t      size;
+}
+flolink_object_t;
+
+/* Returns the address of an imported symbol, zero if it's not defined. */
+typedef uintptr_t ( *flolink_import_t )( void* ud, const char* name );
+/* Defines an exported symbol, returns zero on errors. */
+typedef int ( *flolink_export_t )( void* ud, const char* name, void* address );
+
+typedef struct
+{
+  flolink_import_t   import;   /* Called for every imported symbol. */
+  flolink_export_t   export_;  /* Called for every exported symbol, can be NULL. */
+  void*              ud;       /* Passed to the callbacks. */
+  const char* const* exports;  /* NULL-terminated list of symbols to export, NULL to export all public symbols. */
+  void*              memory;   /* Executable memory to put the module in, NULL to map fresh memory. */
+  size_t             capacity; /* Size of memory. */
+  int                verbose;  /* Print what the link does like flolink -v. */
+}
+flolink_options_t;
+
+/* A linked module, ready to be called. */
+typedef struct
+{
+  void*  base;
+  size_t size;   /* Size of the module in memory, including .bss and the symbol table. */
+  int    mapped; /* Memory mapped by the library, freed by flolink_free_image. */
+}
+flolink_image_t;
+
+/* Create a linker, it keeps the link engine loaded between links. Returns NULL if out of memory. */
+flolink_t*  flolink_new( void );
+/* Destroy a linker, modules already linked stay valid. */
+void        flolink_delete( flolink_t* linker );
+/* Link objects into a module, returns one of the errors above. */
+int         flolink_link( flolink_t* linker, const flolink_object_t* objects, unsigned count, const flolink_options_t* options, flolink_image_t* image );
+/* Free a module, only unmaps the memory if the library mapped it. */
+void        flolink_free_image( flolink_image_t* image );
+/* The message of the last FLOLINK_ERROR_SCRIPT, FLOLINK_SYMBOL_NOT_FOUND, FLOLINK_ERROR_EXPORT or FLOLINK_ERROR_MODULE. */
+const char* flolink_error( flolink_t* linker );
+
+#endif /* FLOLINK_H */
@@ -0,0 +1,324 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#include "flolink.h"
+#include "test/floload.h"
+#include "main_lua.h"
+
+struct flolink_t
+{
+  lua_State* L;
+  int        main;        // Reference to the function returned by main.lua.
+  char       error[ 256 ];
+};
+
+static int flolink_trackAllocator( lua_State* L )
+{
+  (void)L;
+  return 0;
+}
+
+static int flolink_memory( lua_State* L )
+{
+  // The library uses the default allocator and keeps the collector running,
+  // only what Lua counts is known.
+  lua_Number inuse = lua_gc( L, LUA_GCCOUNT, 0 ) * 1024.0 + lua_gc( L, LUA_GCCOUNTB, 0 );
+  lua_pushnumber( L, inuse );
+  lua_pushnumber( L, inuse );
+  lua_pushnumber( L, inuse );
+  lua_pushnumber( L, 0 );
+  lua_pushnumber( L, 0 );
+  return 5;
+}
+
+static int luaopen_flolink( lua_State* L )
+{
+  static const luaL_Reg statics[] =
+  {
+    { "trackAllocator", flolink_trackAllocator },
+    { "memory",         flolink_memory },
+    { NULL, NULL }
+  };
+  
+  luaL_newlib( L, statics );
+  return 1;
+}
+
+static int traceback( lua_State* L )
+{
+  // Change the error into a detailed stack trace.
+  luaL_traceback( L, L, lua_tostring( L, -1 ), 1 );
+  return 1;
+}
+
+static int load_main( lua_State* L )
+{
+  int luaopen_coff( lua_State* L );
+  luaL_requiref( L, "coff", luaopen_coff, 1 );
+  luaL_requiref( L, "flolink", luaopen_flolink, 1 );
+  lua_pop( L, 2 );
+  
+  // main.lua returns the main function, which is kept for all the links.
+  if ( luaL_loadbuffer( L, main_lua, sizeof( main_lua ), "main.lua" ) != 0 )
+  {
+    return lua_error( L );
+  }
+  
+  lua_call( L, 0, 1 );
+  return 1;
+}
+
+flolink_t* flolink_new( void )
+{
+  flolink_t* linker = (flolink_t*)calloc( 1, sizeof( flolink_t ) );
+  
+  if ( linker == NULL )
+  {
+    return NULL;
+  }
+  
+  linker->L = luaL_newstate();
+  
+  if ( linker->L == NULL )
+  {
+    free( linker );
+    return NULL;
+  }
+  
+  luaL_openlibs( linker->L );
+  lua_pushcfunction( linker->L, traceback );
+  lua_pushcfunction( linker->L, load_main );
+  
+  if ( lua_pcall( linker->L, 0, 1, -2 ) != LUA_OK )
+  {
+    fprintf( stderr, "%s", lua_tostring( linker->L, -1 ) );
+    lua_close( linker->L );
+    free( linker );
+    return NULL;
+  }
+  
+  linker->main = luaL_ref( linker->L, LUA_REGISTRYINDEX );
+  lua_pop( linker->L, 1 );
+  return linker;
+}
+
+void flolink_delete( flolink_t* linker )
+{
+  lua_close( linker->L );
+  free( linker );
+}
+
+const char* flolink_error( flolink_t* linker )
+{
+  return linker->error;
+}
+
+static void* map_image( size_t size )
+{
+#ifdef _WIN32
+  return VirtualAlloc( NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE );
+#else
+  void* image = mmap( NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+  return image != MAP_FAILED ? image : NULL;
+#endif
+}
+
+void flolink_free_image( flolink_image_t* image )
+{
+  if ( image->mapped )
+  {
+#ifdef _WIN32
+    VirtualFree( image->base, 0, MEM_RELEASE );
+#else
+    munmap( image->base, image->size );
+#endif
+  }
+  
+  image->base = NULL;
+  image->size = 0;
+  image->mapped = 0;
+}
+
+// Adapts the callbacks of the options to the loader of floload.c, keeping the
+// name of the symbol that failed.
+typedef struct
+{
+  flolink_t*               linker;
+  const flolink_options_t* options;
+}
+loader_t;
+
+static uintptr_t loader_get_symbol( void* ud, flo_key_t name )
+{
+  loader_t* loader = (loader_t*)ud;
+  uintptr_t address = loader->options->import != NULL ? loader->options->import( loader->options->ud, name ) : 0;
+  
+  if ( address == 0 )
+  {
+    snprintf( loader->linker->error, sizeof( loader->linker->error ), "%s", name );
+  }
+  
+  return address;
+}
+
+static int loader_put_symbol( void* ud, flo_key_t name, uintptr_t address )
+{
+  loader_t* loader = (loader_t*)ud;
+  
+  if ( loader->options->export_ == NULL )
+  {
+    return 1;
+  }
+  
+  if ( !loader->options->export_( loader->options->ud, name, (void*)address ) )
+  {
+    snprintf( loader->linker->error, sizeof( loader->linker->error ), "%s", name );
+    return 0;
+  }
+  
+  return 1;
+}
+
+static int relocate( flolink_t* linker, uint8_t* image, size_t size, const flolink_options_t* options )
+{
+  // The module is always linked with plain names and eager binding.
+  loader_t ud = { linker, options };
+  flo_loader_t loader = { loader_get_symbol, loader_put_symbol, &ud };
+  
+  switch ( flo_relocate_ctx( &loader, image, (unsigned int)size ) )
+  {
+  case FLO_OK:                    return FLOLINK_OK;
+  case FLO_SYMBOL_NOT_FOUND:      return FLOLINK_SYMBOL_NOT_FOUND;
+  case FLO_ERROR_DEFINING_SYMBOL: return FLOLINK_ERROR_EXPORT;
+  default:                        snprintf( linker->error, sizeof( linker->error ), "invalid module" ); return FLOLINK_ERROR_MODULE;
+  }
+}
+
+int flolink_link( flolink_t* linker, const flolink_object_t* objects, unsigned count, const flolink_options_t* options, flolink_image_t* image )
+{
+  lua_State* L = linker->L;
+  int top = lua_gettop( L );
+  unsigned i;
+  
+  linker->error[ 0 ] = 0;
+  image->base = NULL;
+  image->size = 0;
+  image->mapped = 0;
+  
+  lua_pushcfunction( L, traceback );
+  lua_rawgeti( L, LUA_REGISTRYINDEX, linker->main );
+  
+  // The arguments, there are no input or output files.
+  lua_newtable( L );
+  
+  if ( options->verbose )
+  {
+    lua_pushliteral( L, "-v" );
+    lua_rawseti( L, -2, 1 );
+  }
+  
+  // No object cache, the objects are parsed from the buffers every time.
+  lua_pushnil( L );
+  
+  // The in-memory link.
+  lua_createtable( L, 0, 3 );
+  lua_createtable( L, count, 0 );
+  
+  for ( i = 0; i < count; i++ )
+  {
+    lua_createtable( L, 0, 2 );
+    lua_pushstring( L, objects[ i ].name );
+    lua_setfield( L, -2, "name" );
+    lua_pushlstring( L, (const char*)objects[ i ].data, objects[ i ].size );
+    lua_setfield( L, -2, "contents" );
+    lua_rawseti( L, -2, i + 1 );
+  }
+  
+  lua_setfield( L, -2, "objects" );
+  
+  if ( options->exports != NULL )
+  {
+    lua_newtable( L );
+    
+    for ( i = 0; options->exports[ i ] != NULL; i++ )
+    {
+      lua_pushstring( L, options->exports[ i ] );
+      lua_rawseti( L, -2, i + 1 );
+    }
+    
+    lua_setfield( L, -2, "exports" );
+  }
+  
+  // Keep the table to get the image from it.
+  lua_pushvalue( L, -1 );
+  lua_insert( L, top + 1 );
+  
+  if ( lua_pcall( L, 3, 1, top + 2 ) != LUA_OK )
+  {
+    snprintf( linker->error, sizeof( linker->error ), "%s", lua_tostring( L, -1 ) );
+    lua_settop( L, top );
+    return FLOLINK_ERROR_SCRIPT;
+  }
+  
+  if ( lua_tointeger( L, -1 ) != 0 )
+  {
+    lua_settop( L, top );
+    return FLOLINK_ERROR_LINK;
+  }
+  
+  size_t size;
+  lua_getfield( L, top + 1, "image" );
+  const char* flo = lua_tolstring( L, -1, &size );
+  
+  if ( flo == NULL || size < sizeof( flo_header_t ) )
+  {
+    snprintf( linker->error, sizeof( linker->error ), "no module in the result of the link" );
+    lua_settop( L, top );
+    return FLOLINK_ERROR_MODULE;
+  }
+  
+  if ( options->memory != NULL )
+  {
+    if ( size > options->capacity )
+    {
+      lua_settop( L, top );
+      return FLOLINK_ERROR_MEMORY;
+    }
+    
+    image->base = options->memory;
+  }
+  else if ( ( image->base = map_image( size ) ) == NULL )
+  {
+    lua_settop( L, top );
+    return FLOLINK_ERROR_MEMORY;
+  }
+  else
+  {
+    image->mapped = 1;
+  }
+  
+  // The image comes laid out with .bss already zeroed.
+  image->size = size;
+  memcpy( image->base, flo, size );
+  lua_settop( L, top );
+  
+  int res = relocate( linker, (uint8_t*)image->base, size, options );
+  
+  if ( res != FLOLINK_OK )
+  {
+    flolink_free_image( image );
+  }
+  
+  return res;
+}
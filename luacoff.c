@@ -1,5 +1,8 @@
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -14,6 +17,116 @@ static int countBits( unsigned int v )
   return ( ( v + ( v >> 4 ) & 0xF0F0F0FU ) * 0x1010101U ) >> 24; // count
 }
 
+/*
+LZ4-style compressor used by flolink -z, floload.c has the matching
+decompressor. The output is a list of sequences, each one a token byte with
+the number of literals in the high nibble and the match length minus 4 in
+the low nibble, the extra literal length bytes if the nibble is 15, the
+literals, a little-endian 16-bit match offset and the extra match length
+bytes if the nibble is 15. The last sequence has only literals.
+*/
+#define LZ_MINMATCH  4
+#define LZ_HASHBITS 14
+#define LZ_MAXOFFSET 65535
+#define LZ_LASTLITERALS 5
+#define LZ_BOUND( size ) ( ( size ) + ( size ) / 255 + 16 )
+
+static uint32_t lz_read32( const uint8_t* ptr )
+{
+  uint32_t u32;
+  memcpy( &u32, ptr, 4 );
+  return u32;
+}
+
+static uint8_t* lz_length( uint8_t* op, unsigned int length )
+{
+  length -= 15;
+  
+  while ( length >= 255 )
+  {
+    *op++ = 255;
+    length -= 255;
+  }
+  
+  *op++ = length;
+  return op;
+}
+
+static uint8_t* lz_sequence( uint8_t* op, const uint8_t* literals, unsigned int numliterals, unsigned int offset, unsigned int matchlen )
+{
+  uint8_t* token = op++;
+  
+  *token = ( numliterals < 15 ? numliterals : 15 ) << 4;
+  
+  if ( numliterals >= 15 )
+  {
+    op = lz_length( op, numliterals );
+  }
+  
+  memcpy( op, literals, numliterals );
+  op += numliterals;
+  
+  if ( matchlen != 0 )
+  {
+    matchlen -= LZ_MINMATCH;
+    *token |= matchlen < 15 ? matchlen : 15;
+    
+    *op++ = offset;
+    *op++ = offset >> 8;
+    
+    if ( matchlen >= 15 )
+    {
+      op = lz_length( op, matchlen );
+    }
+  }
+  
+  return op;
+}
+
+static unsigned int lz_compress( uint8_t* dest, const uint8_t* src, unsigned int size )
+{
+  uint32_t table[ 1 << LZ_HASHBITS ]; /* Position + 1 of the last occurrence of each hash. */
+  
+  const uint8_t* ip = src;
+  const uint8_t* anchor = src;
+  const uint8_t* end = src + size;
+  const uint8_t* limit = size > 12 ? end - 12 : src; /* Matches don't start in the last 12 bytes. */
+  uint8_t* op = dest;
+  
+  memset( table, 0, sizeof( table ) );
+  
+  while ( ip < limit )
+  {
+    uint32_t seq = lz_read32( ip );
+    uint32_t hash = ( seq * 2654435761U ) >> ( 32 - LZ_HASHBITS );
+    uint32_t pos = table[ hash ];
+    
+    table[ hash ] = ip - src + 1;
+    
+    if ( pos != 0 && ip - ( src + pos - 1 ) <= LZ_MAXOFFSET && lz_read32( src + pos - 1 ) == seq )
+    {
+      const uint8_t* ref = src + pos - 1;
+      const uint8_t* mp = ip + LZ_MINMATCH;
+      const uint8_t* rp = ref + LZ_MINMATCH;
+      
+      while ( mp < end - LZ_LASTLITERALS && *mp == *rp )
+      {
+        mp++, rp++;
+      }
+      
+      op = lz_sequence( op, anchor, ip - anchor, ip - ref, mp - ip );
+      ip = anchor = mp;
+    }
+    else
+    {
+      ip++;
+    }
+  }
+  
+  op = lz_sequence( op, anchor, end - anchor, 0, 0 );
+  return op - dest;
+}
+
 #define UD_RAWDATA "COFFRawData"
 
 typedef struct
@@ -49,6 +162,13 @@ static int rawdata_getByte( lua_State* L )
   return luaL_error( L, "Offset %d out of range [0, %d].", offset, ud->size - 1 );
 }
 
+static int rawdata_get( lua_State* L )
+{
+  rawdata_ud* ud = rawdata_check( L, 1 );
+  lua_pushlstring( L, (const char*)ud->data, ud->size );
+  return 1;
+}
+
 static int rawdata_tostring( lua_State* L )
 {
   rawdata_ud* ud = rawdata_check( L, 1 );
@@ -62,6 +182,7 @@ static int rawdata_push( lua_State* L, void* data, unsigned int size )
   {
     { "getSize",    rawdata_getSize },
     { "getByte",    rawdata_getByte },
+    { "get",        rawdata_get },
     { "__tostring", rawdata_tostring },
     { NULL, NULL }
   };
@@ -146,6 +267,8 @@ static int buffer_grow( lua_State* L )
   
   if ( _buffer_grow( ud, bytes ) )
   {
+    memset( ud->data + ud->size - bytes, 0, bytes );
+    
     lua_pushvalue( L, 1 );
     return 1;
   }
@@ -408,8 +531,38 @@ static int buffer_appendRaw( lua_State* L )
 static int buffer_get( lua_State* L )
 {
   buffer_ud* ud = buffer_check( L, 1 );
-  lua_pushlstring( L, (char*)ud->data, ud->size );
-  return 1;
+  unsigned int offset = luaL_optunsigned( L, 2, 0 );
+  
+  if ( offset <= ud->size )
+  {
+    unsigned int size = luaL_optunsigned( L, 3, ud->size - offset );
+    
+    if ( size <= ud->size - offset )
+    {
+      lua_pushlstring( L, (char*)ud->data + offset, size );
+      return 1;
+    }
+    
+    return luaL_error( L, "Size %d out of range [0, %d].", size, ud->size - offset );
+  }
+  
+  return luaL_error( L, "Offset %d out of range [0, %d].", offset, ud->size );
+}
+
+static int buffer_compress( lua_State* L )
+{
+  buffer_ud* ud = buffer_check( L, 1 );
+  unsigned int size = luaL_optunsigned( L, 2, ud->size );
+  
+  if ( size <= ud->size )
+  {
+    luaL_Buffer b;
+    uint8_t* dest = (uint8_t*)luaL_buffinitsize( L, &b, LZ_BOUND( size ) );
+    luaL_pushresultsize( &b, lz_compress( dest, ud->data, size ) );
+    return 1;
+  }
+  
+  return luaL_error( L, "Size %d out of range [0, %d].", size, ud->size );
 }
 
 static int buffer_tostring( lua_State* L )
@@ -439,6 +592,7 @@ static int buffer_new( lua_State* L )
     { "appendString", buffer_appendString },
     { "appendRaw",    buffer_appendRaw },
     { "get",          buffer_get },
+    { "compress",     buffer_compress },
     { "__tostring",   buffer_tostring },
     { NULL, NULL }
   };
@@ -1133,12 +1287,66 @@ static int coff_new( lua_State* L )
   return 1;
 }
 
+static int checksum( lua_State* L )
+{
+  /* 32-bit FNV-1a, same as flo_checksum in floload.c */
+  size_t length;
+  const uint8_t* data = (const uint8_t*)luaL_checklstring( L, 1, &length );
+  uint32_t hash = 2166136261U;
+  
+  while ( length-- != 0 )
+  {
+    hash = ( hash ^ *data++ ) * 16777619U;
+  }
+  
+  lua_pushunsigned( L, hash );
+  return 1;
+}
+
+static int fileStat( lua_State* L )
+{
+  /* Modification time, size and identity of a file, for the object cache of flolink --server */
+  const char* path = luaL_checkstring( L, 1 );
+  struct stat st;
+  char buffer[ 64 ];
+  
+  if ( stat( path, &st ) != 0 )
+  {
+    lua_pushnil( L );
+    lua_pushstring( L, strerror( errno ) );
+    return 2;
+  }
+  
+#ifdef __linux__
+  snprintf( buffer, sizeof( buffer ), "%lld.%09ld", (long long)st.st_mtime, (long)st.st_mtim.tv_nsec );
+#else
+  snprintf( buffer, sizeof( buffer ), "%lld", (long long)st.st_mtime );
+#endif
+  lua_pushstring( L, buffer );
+  lua_pushnumber( L, (lua_Number)st.st_size );
+  
+  /* Windows has no inode numbers, the caller falls back to the path */
+  if ( st.st_ino != 0 )
+  {
+    snprintf( buffer, sizeof( buffer ), "%llu:%llu", (unsigned long long)st.st_dev, (unsigned long long)st.st_ino );
+    lua_pushstring( L, buffer );
+  }
+  else
+  {
+    lua_pushnil( L );
+  }
+  
+  return 3;
+}
+
 int luaopen_coff( lua_State* L )
 {
   static const luaL_Reg statics[] =
   {
     { "newCoff", coff_new },
     { "newBuffer", buffer_new },
+    { "checksum", checksum },
+    { "stat", fileStat },
     { NULL, NULL }
   };
 
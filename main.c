@@ -1,11 +1,251 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
 #include "main_lua.h"
 
+/*
+Allocator of the Lua state. A link is a batch job that frees next to nothing
+before it ends, so small blocks are carved from big chunks and only recycled
+through free lists, one per size class, and the chunks go back to the system
+in arena_destroy. Bigger blocks go to realloc.
+*/
+#define ARENA_CHUNK_SIZE  ( 1024 * 1024 )
+#define ARENA_GRANULARITY 16
+#define ARENA_MAX_SMALL   512
+#define ARENA_CLASSES     ( ARENA_MAX_SMALL / ARENA_GRANULARITY )
+
+#define ARENA_CLASS( size ) ( ( ( size ) + ARENA_GRANULARITY - 1 ) / ARENA_GRANULARITY - 1 )
+
+typedef union arena_chunk_t
+{
+  union arena_chunk_t* next;
+  char                 align[ ARENA_GRANULARITY ];
+}
+arena_chunk_t;
+
+typedef struct
+{
+  arena_chunk_t* chunks;                  // All the chunks, to free them at the end.
+  char*          top;                     // Free space in the current chunk.
+  char*          end;
+  void*          free[ ARENA_CLASSES ];   // Free blocks of each size class.
+  size_t         inuse;                   // Bytes in use by Lua.
+  size_t         peak;                    // Peak of inuse.
+  size_t         reserved;                // Bytes in chunks and big blocks.
+  int            timed;                   // Measure the time spent in the allocator.
+  double         time;
+}
+arena_t;
+
+static arena_t arena;
+
+static double now( void )
+{
+#ifdef _WIN32
+  LARGE_INTEGER counter, frequency;
+  QueryPerformanceCounter( &counter );
+  QueryPerformanceFrequency( &frequency );
+  return (double)counter.QuadPart / frequency.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+static void* arena_malloc( arena_t* a, size_t size )
+{
+  if ( size > ARENA_MAX_SMALL )
+  {
+    void* block = malloc( size );
+    a->reserved += block ? size : 0;
+    return block;
+  }
+  
+  int sc = ARENA_CLASS( size );
+  void* block = a->free[ sc ];
+  
+  if ( block != NULL )
+  {
+    a->free[ sc ] = *(void**)block;
+    return block;
+  }
+  
+  size = ( sc + 1 ) * ARENA_GRANULARITY;
+  
+  if ( a->end - a->top < (ptrdiff_t)size )
+  {
+    // What's left of the current chunk is lost, it's less than ARENA_MAX_SMALL bytes.
+    arena_chunk_t* chunk = (arena_chunk_t*)malloc( ARENA_CHUNK_SIZE );
+    
+    if ( chunk == NULL )
+    {
+      return NULL;
+    }
+    
+    chunk->next = a->chunks;
+    a->chunks = chunk;
+    a->top = (char*)( chunk + 1 );
+    a->end = (char*)chunk + ARENA_CHUNK_SIZE;
+    a->reserved += ARENA_CHUNK_SIZE;
+  }
+  
+  block = a->top;
+  a->top += size;
+  return block;
+}
+
+static void arena_free( arena_t* a, void* block, size_t size )
+{
+  if ( size > ARENA_MAX_SMALL )
+  {
+    free( block );
+    a->reserved -= size;
+  }
+  else
+  {
+    int sc = ARENA_CLASS( size );
+    *(void**)block = a->free[ sc ];
+    a->free[ sc ] = block;
+  }
+}
+
+static void* arena_alloc( void* ud, void* ptr, size_t osize, size_t nsize )
+{
+  arena_t* a = (arena_t*)ud;
+  double start = a->timed ? now() : 0;
+  void* block;
+  
+  // osize is the type of the object when ptr is NULL.
+  if ( ptr == NULL )
+  {
+    osize = 0;
+  }
+  
+  if ( nsize == 0 )
+  {
+    if ( ptr != NULL )
+    {
+      arena_free( a, ptr, osize );
+    }
+    
+    block = NULL;
+  }
+  else if ( ptr == NULL )
+  {
+    block = arena_malloc( a, nsize );
+  }
+  else if ( osize <= ARENA_MAX_SMALL && nsize <= ARENA_MAX_SMALL && ARENA_CLASS( osize ) == ARENA_CLASS( nsize ) )
+  {
+    block = ptr;
+  }
+  else if ( osize > ARENA_MAX_SMALL && nsize > ARENA_MAX_SMALL )
+  {
+    block = realloc( ptr, nsize );
+    
+    if ( block != NULL )
+    {
+      a->reserved += nsize - osize;
+    }
+  }
+  else
+  {
+    block = arena_malloc( a, nsize );
+    
+    if ( block != NULL )
+    {
+      memcpy( block, ptr, osize < nsize ? osize : nsize );
+      arena_free( a, ptr, osize );
+    }
+    else if ( nsize < osize )
+    {
+      // Lua doesn't expect shrinking to fail, keep the big block.
+      block = ptr;
+    }
+  }
+  
+  if ( block != NULL || nsize == 0 )
+  {
+    a->inuse += nsize - osize;
+    a->peak = a->inuse > a->peak ? a->inuse : a->peak;
+  }
+  
+  if ( a->timed )
+  {
+    a->time += now() - start;
+  }
+  
+  return block;
+}
+
+static void arena_destroy( arena_t* a )
+{
+  while ( a->chunks != NULL )
+  {
+    arena_chunk_t* next = a->chunks->next;
+    free( a->chunks );
+    a->chunks = next;
+  }
+}
+
+static int flolink_trackAllocator( lua_State* L )
+{
+  arena.timed = lua_toboolean( L, 1 );
+  return 0;
+}
+
+static int flolink_memory( lua_State* L )
+{
+  // Bytes in use, peak bytes in use, bytes reserved, seconds spent in the allocator and peak RSS in KB.
+  double rss;
+  
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+  rss = GetProcessMemoryInfo( GetCurrentProcess(), &counters, sizeof( counters ) ) ? counters.PeakWorkingSetSize / 1024.0 : 0;
+#else
+  struct rusage usage;
+  rss = getrusage( RUSAGE_SELF, &usage ) == 0 ? usage.ru_maxrss : 0;
+#endif
+  
+  lua_pushnumber( L, (lua_Number)arena.inuse );
+  lua_pushnumber( L, (lua_Number)arena.peak );
+  lua_pushnumber( L, (lua_Number)arena.reserved );
+  lua_pushnumber( L, arena.time );
+  lua_pushnumber( L, rss );
+  return 5;
+}
+
+static int luaopen_flolink( lua_State* L )
+{
+  static const luaL_Reg statics[] =
+  {
+    { "trackAllocator", flolink_trackAllocator },
+    { "memory",         flolink_memory },
+    { NULL, NULL }
+  };
+  
+  luaL_newlib( L, statics );
+  return 1;
+}
+
 static int do_buffer( lua_State* L, const char* buffer, size_t buffer_size, const char* chunk_name, int ret_count )
 {
   if ( luaL_loadbuffer( L, buffer, buffer_size, chunk_name ) != 0 )
@@ -22,6 +262,7 @@ static int lua_main( lua_State* L )
   // Load coff library.
   int luaopen_coff( lua_State* L );
   luaL_requiref( L, "coff", luaopen_coff, 1 );
+  luaL_requiref( L, "flolink", luaopen_flolink, 1 );
   
   // Run required files, main.lua returns a function which will be the main function.
   do_buffer( L, main_lua, sizeof( main_lua ), "main.lua", 1 );
@@ -39,8 +280,11 @@ static int lua_main( lua_State* L )
     lua_rawseti( L, -2, i );
   }
   
+  // The object cache of the server, nil otherwise.
+  lua_pushvalue( L, lua_upvalueindex( 3 ) );
+  
   // Run the main function and return.
-  lua_call( L, 1, 1 );
+  lua_call( L, 2, 1 );
   luaL_checkinteger( L, -1 );
   return 1;
 }
@@ -52,23 +296,21 @@ static int traceback( lua_State* L )
   return 1;
 }
 
-int main( int argc, const char* argv[] )
+static int run( lua_State* L, int argc, const char** argv, int cache )
 {
-  // Create the state.
-  lua_State* L = luaL_newstate();
-  
-  // Open the standard libraries and clean the stack.
   int top = lua_gettop( L );
-  luaL_openlibs( L );
-  lua_settop( L, top );
   
   // Put the traceback function on the stack.
   lua_pushcfunction( L, traceback );
   
-  // Create a closure with argc and argv.
+  // Create a closure with argc, argv and the object cache.
   lua_pushnumber( L, argc );
   lua_pushlightuserdata( L, (void*)argv );
-  lua_pushcclosure( L, lua_main, 2 );
+  lua_rawgeti( L, LUA_REGISTRYINDEX, cache );
+  lua_pushcclosure( L, lua_main, 3 );
+  
+  // Nothing is collected during a link, the arena recycles what Lua frees.
+  lua_gc( L, LUA_GCSTOP, 0 );
   
   // Call main_lua.
   int ret = 0;
@@ -83,6 +325,308 @@ int main( int argc, const char* argv[] )
     ret = -1;
   }
   
+  lua_settop( L, top );
+  return ret;
+}
+
+#ifndef _WIN32
+/*
+Requests are the working directory of the client and the arguments, each one
+terminated by a NUL, and the client shuts down its side of the connection
+after sending them. The response is the output of the link, a NUL and the exit
+status in one byte.
+*/
+static int open_socket( const char* path, struct sockaddr_un* address )
+{
+  int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+  
+  if ( fd < 0 )
+  {
+    perror( "socket" );
+    return -1;
+  }
+  
+  if ( strlen( path ) >= sizeof( address->sun_path ) )
+  {
+    fprintf( stderr, "Error: Socket path too long: %s\n", path );
+    close( fd );
+    return -1;
+  }
+  
+  memset( address, 0, sizeof( *address ) );
+  address->sun_family = AF_UNIX;
+  strcpy( address->sun_path, path );
+  return fd;
+}
+
+static int write_all( int fd, const void* data, size_t size )
+{
+  const char* bytes = (const char*)data;
+  
+  while ( size != 0 )
+  {
+    ssize_t written = write( fd, bytes, size );
+    
+    if ( written <= 0 )
+    {
+      return -1;
+    }
+    
+    bytes += written;
+    size -= written;
+  }
+  
+  return 0;
+}
+
+static void serve_request( lua_State* L, int conn, int cache )
+{
+  size_t size = 0, capacity = 4096;
+  char* request = (char*)malloc( capacity );
+  ssize_t count;
+  
+  while ( request && ( count = read( conn, request + size, capacity - size ) ) > 0 )
+  {
+    size += count;
+    
+    if ( size == capacity )
+    {
+      char* grown = (char*)realloc( request, capacity * 2 );
+      
+      if ( grown == NULL )
+      {
+        free( request );
+        request = NULL;
+        break;
+      }
+      
+      request = grown;
+      capacity *= 2;
+    }
+  }
+  
+  // argv[ 0 ] is skipped by lua_main, the working directory takes its place.
+  const char** argv = request ? (const char**)malloc( ( size + 1 ) * sizeof( const char* ) ) : NULL;
+  
+  if ( argv == NULL )
+  {
+    static const char message[] = "Error: Out of memory\n";
+    static const char trailer[ 2 ] = { 0, (char)255 };
+    write_all( conn, message, sizeof( message ) - 1 );
+    write_all( conn, trailer, sizeof( trailer ) );
+    free( request );
+    return;
+  }
+  
+  if ( size == 0 || request[ size - 1 ] != 0 )
+  {
+    free( argv );
+    free( request );
+    return;
+  }
+  
+  int argc = 0;
+  char* arg;
+  
+  for ( arg = request; arg < request + size; arg += strlen( arg ) + 1 )
+  {
+    argv[ argc++ ] = arg;
+  }
+  
+  argv[ argc ] = NULL;
+  unsigned char status = 255;
+  
+  if ( chdir( argv[ 0 ] ) == 0 )
+  {
+    // The output of the link goes to the client.
+    int out = dup( 1 ), err = dup( 2 );
+    
+    fflush( stdout );
+    fflush( stderr );
+    dup2( conn, 1 );
+    dup2( conn, 2 );
+    
+    status = (unsigned char)run( L, argc, argv, cache );
+    
+    fflush( stdout );
+    fflush( stderr );
+    dup2( out, 1 );
+    dup2( err, 2 );
+    close( out );
+    close( err );
+  }
+  else
+  {
+    static const char message[] = "Error: Could not change to the working directory of the client\n";
+    write_all( conn, message, sizeof( message ) - 1 );
+  }
+  
+  char trailer[ 2 ] = { 0, (char)status };
+  write_all( conn, trailer, sizeof( trailer ) );
+  
+  free( argv );
+  free( request );
+}
+
+static int server( lua_State* L, const char* path )
+{
+  struct sockaddr_un address;
+  int fd = open_socket( path, &address );
+  
+  if ( fd < 0 )
+  {
+    return -1;
+  }
+  
+  // Only a socket left behind by a previous server is replaced, a mistyped
+  // path must not delete a file.
+  struct stat status;
+  
+  if ( lstat( path, &status ) == 0 )
+  {
+    if ( !S_ISSOCK( status.st_mode ) )
+    {
+      fprintf( stderr, "Error: %s exists and isn't a socket\n", path );
+      close( fd );
+      return -1;
+    }
+    
+    unlink( path );
+  }
+  
+  if ( bind( fd, (struct sockaddr*)&address, sizeof( address ) ) != 0 || listen( fd, 16 ) != 0 )
+  {
+    perror( path );
+    close( fd );
+    return -1;
+  }
+  
+  // Clients going away mid-response must not take the server down.
+  signal( SIGPIPE, SIG_IGN );
+  
+  // Parsed objects are kept here between links.
+  lua_newtable( L );
+  int cache = luaL_ref( L, LUA_REGISTRYINDEX );
+  
+  for ( ;; )
+  {
+    int conn = accept( fd, NULL, NULL );
+    
+    if ( conn >= 0 )
+    {
+      serve_request( L, conn, cache );
+      close( conn );
+      
+      // Objects from the previous link that aren't in the cache can go now.
+      lua_gc( L, LUA_GCCOLLECT, 0 );
+    }
+  }
+}
+
+static int client( const char* path, int argc, const char* argv[] )
+{
+  struct sockaddr_un address;
+  int fd = open_socket( path, &address );
+  char buffer[ 4096 ];
+  int i;
+  
+  if ( fd < 0 )
+  {
+    return -1;
+  }
+  
+  if ( connect( fd, (struct sockaddr*)&address, sizeof( address ) ) != 0 )
+  {
+    perror( path );
+    close( fd );
+    return -1;
+  }
+  
+  if ( getcwd( buffer, sizeof( buffer ) ) == NULL || write_all( fd, buffer, strlen( buffer ) + 1 ) != 0 )
+  {
+    perror( "flolink" );
+    close( fd );
+    return -1;
+  }
+  
+  for ( i = 0; i < argc; i++ )
+  {
+    if ( write_all( fd, argv[ i ], strlen( argv[ i ] ) + 1 ) != 0 )
+    {
+      perror( "flolink" );
+      close( fd );
+      return -1;
+    }
+  }
+  
+  shutdown( fd, SHUT_WR );
+  
+  // Copy the output until the NUL, the status comes right after it.
+  int status = -1, done = 0;
+  ssize_t count;
+  
+  while ( ( count = read( fd, buffer, sizeof( buffer ) ) ) > 0 )
+  {
+    ssize_t offset = 0;
+    
+    if ( !done )
+    {
+      char* end = (char*)memchr( buffer, 0, count );
+      offset = end ? end - buffer : count;
+      fwrite( buffer, 1, offset, stdout );
+      
+      if ( end )
+      {
+        done = 1;
+        offset++;
+      }
+    }
+    
+    if ( done && offset < count )
+    {
+      status = (unsigned char)buffer[ offset ];
+      break;
+    }
+  }
+  
+  close( fd );
+  
+  if ( status == -1 )
+  {
+    fprintf( stderr, "Error: Connection to %s closed before the link finished\n", path );
+  }
+  
+  return status;
+}
+#endif
+
+int main( int argc, const char* argv[] )
+{
+#ifndef _WIN32
+  if ( argc >= 3 && !strcmp( argv[ 1 ], "--connect" ) )
+  {
+    return client( argv[ 2 ], argc - 3, argv + 3 );
+  }
+#endif
+  
+  // Create the state.
+  lua_State* L = lua_newstate( arena_alloc, &arena );
+  
+  // Open the standard libraries and clean the stack.
+  int top = lua_gettop( L );
+  luaL_openlibs( L );
+  lua_settop( L, top );
+
+#ifndef _WIN32
+  if ( argc == 3 && !strcmp( argv[ 1 ], "--server" ) )
+  {
+    return server( L, argv[ 2 ] );
+  }
+#endif
+  
+  int ret = run( L, argc, argv, LUA_REFNIL );
+  
   lua_close( L );
+  arena_destroy( &arena );
   return ret;
 }
@@ -2,13 +2,90 @@ local FLO_UNUSED   =  0
 local FLO_EXPORTED =  1
 local FLO_ADDR64   = 16
 
+-- Version of the .flo format, written in the last field of the header
+local FLO_MAGIC   = 0x004f4c46
+local FLO_VERSION = 13
+
+-- Header flags
+local FLO_FLAG_LAZY       = 1
+local FLO_FLAG_FRONTCODED = 2
+local FLO_FLAG_HUGEPAGE   = 4
+local FLO_FLAG_HOTSWAP    = 32
+
+-- The code of --hugepage-align modules is padded to whole huge pages
+local HUGE_PAGE_SIZE = 0x200000
+-- What the module writes to starts at a page boundary, see textsize
+local PAGE_SIZE = 0x1000
+
+-- Size of the header, twenty 32-bit fields
+local FLO_HEADER_SIZE = 80
+
+-- Size of an entry of the --function-table table, name, address and size
+local FLO_FUNCTION_SIZE = 12
+
+-- Magic and version of --bundle files, in their first two fields
+local FLO_BUNDLE_MAGIC   = 0x424f4c46
+local FLO_BUNDLE_VERSION = 1
+-- Size of the bundle header, and of a directory entry
+local FLO_BUNDLE_HEADER_SIZE = 12
+local FLO_BUNDLE_ENTRY_SIZE  = 16
+-- Alignment of the modules in a bundle
+local FLO_BUNDLE_ALIGNMENT = 16
+
+-- A base fixup bitmap word covers the BITMAP_BITS 64-bit words after the
+-- last fixup
+local BITMAP_BITS = 31
+
+-- Front-coded names restart every NAMES_PER_BLOCK names, and must fit in
+-- MAX_NAME_SIZE bytes including the terminator
+local NAMES_PER_BLOCK = 16
+local MAX_NAME_SIZE   = 1024
+
+-- Size of a trampoline, mov rax, imm64 + jmp rax
+local TRAMPOLINE_SIZE = 12
+-- Size of a lazy binding stub, jmp [rip+slot] + push index + jmp resolver
+local LAZY_STUB_SIZE = 16
+-- Size of the resolver shared by the lazy binding stubs
+local RESOLVER_SIZE = 176
+-- Size of an entry stub of --hotswap, jmp [rip+slot] + 2 int3
+local ENTRY_STUB_SIZE = 8
+
+-- Kinds of sections, the .flo has code, then data, then .bss
+local KIND_CODE = 1
+local KIND_DATA = 2
+local KIND_BSS  = 3
+
 -- Command line arguments
 local inputFiles = {}
 local outputFile
 local exportFile
 local exportSymbol
 local verbose = false
+local timing = false
+local compress = false
+local lazy = false
 local hashfunc
+local prebindFile
+local sizeReport = false
+local frontCode = false
+local pack = false
+local partial = false
+local buildId = false
+local hugepageAlign = false
+local hotswap = false
+local bundle = false
+local functionTable = false
+
+-- File identity => { mtime, size, hash, object } kept by flolink --server
+-- across links, nil otherwise
+local objectCache
+
+-- { objects = list of { name, contents }, exports = list of names or nil }
+-- given by libflolink, which gets the image in its image field, nil when
+-- linking files
+local memoryLink
+-- Name (string) => contents (string) of the objects of memoryLink
+local memoryObjects
 
 -- List of objects in the order they appear on the command line
 local objectList
@@ -18,6 +95,8 @@ local objectMap
 local objectSections
 -- Section (ud) => section name + section number + file name (string)
 local sectionNameMap
+-- Section (ud) => position in the command line order (number)
+local sectionOrderMap
 -- Name (string) => symbol (ud)
 local exportMap
 -- The machine (from coff.machines)
@@ -38,12 +117,63 @@ local bssoffset
 local bsssize
 -- The .flo buffer
 local flo
--- Trampolines for far calls to undefined symbols
-local trampolines
--- Fixups
-local fixups
--- Symbol name (string) => offset
+-- The offset of the trampolines for far calls to undefined symbols
+local trampolineoffset
+-- The size of the sections, trampolines and .bss
+local layoutsize
+-- The offset of the resolver for lazy imports
+local resolveroffset
+-- The offset of the { bind function, header, loader } block used by the resolver
+local bindoffset
+-- Name (string) => offset of the slot of a lazy import
+local slotMap
+-- Name (string) => offset of the entry stub of an exported function with
+-- --hotswap, the export points to it
+local entryMap
+-- Name (string) => offset of the slot an entry stub jumps through
+local entrySlotMap
+-- The offset of the first entry stub, and the number of entry stubs
+local entryoffset
+local numentries
+-- List of { name, offset, size } of the functions in the code, sorted by
+-- offset, with --function-table
+local functions
+-- The offset of the function table, and the size of the table and its names
+local functionoffset
+local functionsize
+-- Name (string) => host address ({ low, high }) from the prebind manifest
+local prebindMap
+-- Checksum of the prebind manifest
+local prebindChecksum
+-- Number of imports bound at link time, they're last in the imports list
+local numprebound
+-- The size of the .flo file
+local filesize
+-- Imported symbols, patched by the loader
+local imports
+-- Offsets of the absolute addresses in the image, the loader adds the base
+-- address to them
+local baseFixups
+-- The base fixups, encoded
+local fixupWords
+-- Exported symbols, registered by the loader
+local exports
+-- Symbol name (string) => offset, or index when front-coded
 local strtable
+-- The size of the symbol names
+local stringsize
+-- The offset of the block index of front-coded names
+local namesoffset
+-- Size of the image, everything in the .flo before .bss
+local imagesize
+-- Size of the start of the image that the module only reads and runs once
+-- relocated, the first byte it writes to is right after it. A multiple of
+-- PAGE_SIZE unless the module writes to nothing
+local textsize
+-- Section => identical read-only section it was merged into
+local mergeMap
+-- Bytes saved by merging read-only sections
+local mergedsize
 
 local function sectionIsAllowed( section )
   local name = section:getName()
@@ -56,6 +186,31 @@ local function sectionIsAllowed( section )
     )
 end
 
+local function sectionKind( section )
+  local name = section:getName()
+  
+  if name:sub( 1, 5 ) == '.text' then
+    return KIND_CODE
+  elseif name:sub( 1, 4 ) == '.bss' then
+    return KIND_BSS
+  else
+    return KIND_DATA
+  end
+end
+
+local function sortedKeys( map )
+  -- pairs goes through the keys in a different order on each run, so names
+  -- are sorted to make the output depend only on the inputs
+  local keys = {}
+  
+  for key in pairs( map ) do
+    keys[ #keys + 1 ] = key
+  end
+  
+  table.sort( keys )
+  return keys
+end
+
 local function info( ... )
     if verbose then
     local args = { ... }
@@ -80,22 +235,49 @@ end
 local function usage( out )
   out:write[[
 flolink [-?]
-flolink [-v] [-e exportfile ] [-s exportsymbol] [-h hashfile]
+flolink --server socket
+flolink --connect socket [options] inputfile...
+flolink -r [-v] [-t] [-e exportfile ] [-s exportsymbol] -o outputfile inputfile...
+flolink --bundle [-v] [-t] -o outputfile module.flo...
+flolink [-v] [-t] [-z] [-l] [-e exportfile ] [-s exportsymbol] [-h hashfile]
+        [--prebind manifest] [--size-report] [--front-code] [--pack]
+        [--build-id] [--hugepage-align] [--hotswap] [--function-table]
         -o outputfile inputfile...
 
 -? Help page
+-r Partial link into a relocatable COFF object
+--bundle Pack linked modules into one file (load with flo_bundle_open)
 -v Be verbose
+-t Print the time spent in each link phase
+-z Compress the image (load with flo_load_compressed)
+-l Bind imports lazily, on their first call
 -e Read list of symbols to export from file (one per line)
 -s Symbol to export
 -h Use hash function in file instead of strings
+--prebind Bind imports to the host addresses in manifest (name address lines)
+--size-report Print the size of each part of the output, and of each input object
+--front-code Front-code the symbol names, sorted and in blocks
+--pack Reorder sections to minimize alignment padding
+--build-id Store a hash of the contents in the header
+--hugepage-align Pad the code to 2 MB so the loader can map it with huge pages
+--hotswap Call exported functions through stubs that flo_swap can redirect
+--function-table Keep the names, addresses and sizes of the functions for profilers
 -o Output file
+
+--server Link requests sent to the Unix socket, reusing parsed objects
+--connect Send the link to a flolink --server and print its output
 ]]
 end
 
 local function parseArguments( args )
   inputFileList = {}
   
-  if #args == 0 then
+  -- The state is reused by flolink --server and libflolink, options don't
+  -- carry over from the previous link
+  outputFile, exportFile, exportSymbol, hashfunc, prebindFile = nil, nil, nil, nil, nil
+  verbose, timing, compress, lazy, sizeReport, frontCode, pack, partial, buildId, hugepageAlign, hotswap, bundle, functionTable = false, false, false, false, false, false, false, false, false, false, false, false, false
+  
+  if #args == 0 and not memoryLink then
     usage( io.stderr )
     return -1
   end
@@ -129,6 +311,14 @@ local function parseArguments( args )
       exportSymbol = args[ i ]
     elseif args[ i ] == '-v' then
       verbose = true
+    elseif args[ i ] == '-t' then
+      timing = true
+    elseif args[ i ] == '-z' then
+      compress = true
+    elseif args[ i ] == '-r' then
+      partial = true
+    elseif args[ i ] == '-l' then
+      lazy = true
     elseif args[ i ] == '-h' then
       if ( i + 1 ) > #args then
         io.stderr:write( 'Error: Missing argumento to -h\n' )
@@ -137,6 +327,30 @@ local function parseArguments( args )
       
       i = i + 1
       hashfunc = args[ i ]
+    elseif args[ i ] == '--prebind' then
+      if ( i + 1 ) > #args then
+        io.stderr:write( 'Error: Missing argumento to --prebind\n' )
+        return -1
+      end
+      
+      i = i + 1
+      prebindFile = args[ i ]
+    elseif args[ i ] == '--size-report' then
+      sizeReport = true
+    elseif args[ i ] == '--front-code' then
+      frontCode = true
+    elseif args[ i ] == '--pack' then
+      pack = true
+    elseif args[ i ] == '--build-id' then
+      buildId = true
+    elseif args[ i ] == '--hugepage-align' then
+      hugepageAlign = true
+    elseif args[ i ] == '--hotswap' then
+      hotswap = true
+    elseif args[ i ] == '--bundle' then
+      bundle = true
+    elseif args[ i ] == '--function-table' then
+      functionTable = true
     elseif args[ i ] == '-?' then
       usage( io.stdout )
       return 0
@@ -147,6 +361,28 @@ local function parseArguments( args )
     i = i + 1
   end
   
+  if memoryLink then
+    -- Only options that don't change the format the library relocates
+    if outputFile or #inputFileList ~= 0 or partial or bundle or compress or lazy or hashfunc or prebindFile or frontCode or hugepageAlign or hotswap or functionTable then
+      io.stderr:write( 'Error: Invalid option for an in-memory link\n' )
+      return -1
+    end
+    
+    memoryObjects = {}
+    
+    for _, object in ipairs( memoryLink.objects ) do
+      if memoryObjects[ object.name ] then
+        io.stderr:write( 'Error: Duplicate object name ', object.name, '\n' )
+        return -1
+      end
+      
+      memoryObjects[ object.name ] = object.contents
+      inputFileList[ #inputFileList + 1 ] = object.name
+    end
+    
+    outputFile = '(memory)'
+  end
+  
   -- Check for mandatory arguments
   if outputFile == nil then
     io.stderr:write( 'Error: Output file not informed\n' )
@@ -158,6 +394,16 @@ local function parseArguments( args )
     return -1
   end
   
+  if partial and ( compress or lazy or hashfunc or prebindFile or frontCode or sizeReport or pack or buildId or hugepageAlign or hotswap or functionTable ) then
+    io.stderr:write( 'Error: -r only takes -v, -t, -e and -s\n' )
+    return -1
+  end
+  
+  if bundle and ( partial or exportFile or exportSymbol or compress or lazy or hashfunc or prebindFile or frontCode or sizeReport or pack or buildId or hugepageAlign or hotswap or functionTable ) then
+    io.stderr:write( 'Error: --bundle only takes -v and -t\n' )
+    return -1
+  end
+  
   -- Load hash function
   if hashfunc then
     info( 'Loading hash function' )
@@ -170,8 +416,53 @@ local function parseArguments( args )
         return -1
       end
       
-      hashfunc = hash.load( file:read( '*a' ) )
+      local chunk, err = load( file:read( '*a' ), '=' .. hashfunc )
       file:close()
+      
+      if not chunk then
+        io.stderr:write( 'Error: ', err, '\n' )
+        return -1
+      end
+      
+      hashfunc = chunk()
+    end
+  end
+  
+  -- Load the prebind manifest
+  prebindMap = {}
+  prebindChecksum = 0
+  
+  if prebindFile then
+    info( 'Loading prebind manifest' )
+    
+    local file, err = io.open( prebindFile, 'rb' )
+    
+    if not file then
+      io.stderr:write( 'Error: ', err, '\n' )
+      return -1
+    end
+    
+    local contents = file:read( '*a' )
+    file:close()
+    
+    -- The host checks it against its own manifest at load time
+    prebindChecksum = coff.checksum( contents )
+    local lineNumber = 0
+    
+    for line in ( contents .. '\n' ):gmatch( '(.-)\r?\n' ) do
+      lineNumber = lineNumber + 1
+      
+      if not line:match( '^%s*$' ) and not line:match( '^%s*#' ) then
+        local name, address = line:match( '^%s*(%S+)%s+0?[xX]?(%x+)%s*$' )
+        
+        if not name or #address > 16 then
+          io.stderr:write( string.format( 'Error: Invalid entry at %s:%d\n', prebindFile, lineNumber ) )
+          return -1
+        end
+        
+        -- Split the address in two halves so that it doesn't lose bits in a double
+        prebindMap[ name ] = { low = tonumber( address:sub( -8 ), 16 ), high = tonumber( address:sub( 1, -9 ), 16 ) or 0 }
+      end
     end
   end
 end
@@ -183,6 +474,52 @@ end
 -- |_|\___/ \__,_|\__,_|\___/|_.__// |\___|\___|\__|___/
 --                               |__/                   
 
+local function readObject( inputFile )
+  if memoryLink then
+    return coff.newCoff( memoryObjects[ inputFile ] )
+  end
+  
+  -- Objects in the cache are reused while their files don't change, a new
+  -- modification time with the same contents only updates the entry
+  local mtime, size, id = coff.stat( inputFile )
+  local key = id or inputFile
+  local entry = objectCache and mtime and objectCache[ key ]
+  
+  if entry and entry.mtime == mtime and entry.size == size then
+    info( '\t\tCached' )
+    return entry.object
+  end
+  
+  local file, err = io.open( inputFile, 'rb' )
+  
+  if not file then
+    return nil, err
+  end
+  
+  local contents = file:read( '*a' )
+  file:close()
+  
+  if not objectCache then
+    return coff.newCoff( contents )
+  end
+  
+  local hash = coff.checksum( contents )
+  
+  if entry and entry.size == #contents and entry.hash == hash then
+    info( '\t\tCached, contents unchanged' )
+    entry.mtime = mtime
+    return entry.object
+  end
+  
+  entry = { mtime = mtime, size = #contents, hash = hash, object = coff.newCoff( contents ) }
+  
+  if mtime then
+    objectCache[ key ] = entry
+  end
+  
+  return entry.object
+end
+
 local function loadObjects()
   info( 'Loading objects' )
   objectList = {}
@@ -192,16 +529,13 @@ local function loadObjects()
   do
     for _, inputFile in ipairs( inputFileList ) do
       info( '\t%s', inputFile )
-      local file, err = io.open( inputFile, 'rb' )
+      local object, err = readObject( inputFile )
       
-      if not file then
+      if not object then
         io.stderr:write( 'Error: ', err, '\n' )
         return -1
       end
       
-      local object = coff.newCoff( file:read( '*a' ) )
-      file:close()
-      
       local proc = object:getMachine()
       
       if proc ~= coff.machines.MACHINE_AMD64 
@@ -251,6 +585,8 @@ end
 local function buildParentMap()
   parentMap = {}
   sectionNameMap = {}
+  sectionOrderMap = {}
+  local order = 0
 
   -- Build parentship map
   for _, object in ipairs( objectList ) do
@@ -266,6 +602,8 @@ local function buildParentMap()
       end
       
       sectionNameMap[ section ] = string.format( '%s@%s', section:getName(), objectMap[ object ] )
+      order = order + 1
+      sectionOrderMap[ section ] = order
     end
   end
 end
@@ -315,7 +653,6 @@ end
 
 local function buildListOfSymbols()
   knownSymbolMap = {}
-  unknownSymbolMap = {}
   
   do
     info( 'Building list of known symbols' )
@@ -339,33 +676,6 @@ local function buildListOfSymbols()
         end
       end
     end
-    
-    info( 'Building list of undefined symbols' )
-    
-    local messages = {}
-  
-    for _, object in ipairs( objectList ) do
-      for _, section in ipairs( objectSections[ object ] ) do
-        for _, relocation in section:relocations() do
-          local symbol = object:getSymbol( relocation:getSymbolTableIndex() )
-          local name = symbol:getName()
-          local known, unknown = isSymbolKnown( symbol )
-        
-          if unknown and not knownSymbolMap[ name ] then
-            local list = unknownSymbolMap[ name ] or {}
-            list[ #list + 1 ] = relocation
-            unknownSymbolMap[ name ] = list
-            
-            local msg = string.format( '\t%s needs symbol %s', sectionNameMap[ section ], name )
-            
-            if not messages[ msg ] then
-              messages[ msg ] = true
-              info( '%s', msg )
-            end
-          end
-        end
-      end
-    end
   end
 end
 
@@ -405,20 +715,31 @@ local function buildExportMap()
     end
     
     exportMap[ exportSymbol ] = exps[ exportSymbol ]
-  elseif exportFile then
-    -- Read exported symbols from file
-    info( 'Reading exported symbols from %s', exportFile )
+  elseif exportFile or ( memoryLink and memoryLink.exports ) then
     local missing = {}
-    local file, err = io.open( exportFile, 'r' )
+    local names = {}
     
-    if not file then
-      io.stderr:write( 'Error: ', err, '\n' )
-      return -1
+    if exportFile then
+      -- Read exported symbols from file
+      info( 'Reading exported symbols from %s', exportFile )
+      local file, err = io.open( exportFile, 'r' )
+      
+      if not file then
+        io.stderr:write( 'Error: ', err, '\n' )
+        return -1
+      end
+      
+      for line in file:lines() do
+        names[ #names + 1 ] = line:gsub( '%s*([^%s+])%s*', '%1' )
+      end
+      
+      file:close()
+    else
+      info( 'Exporting the symbols given to the library' )
+      names = memoryLink.exports
     end
     
-    for line in file:lines() do
-      local name = line:gsub( '%s*([^%s+])%s*', '%1' )
-      
+    for _, name in ipairs( names ) do
       if name and #name ~= 0 then
         if exps[ name ] then
           info( '\t%s', name )
@@ -443,7 +764,7 @@ local function buildExportMap()
     exportMap = exps
   end
   
-  for name in pairs( exportMap ) do
+  for _, name in ipairs( sortedKeys( exportMap ) ) do
     info( '\t%s', name )
   end
 end
@@ -565,6 +886,8 @@ local function buildListOfRequiredSections()
       visitedSet[ section ] = true
     end
     
+    table.sort( list, function( s1, s2 ) return sectionOrderMap[ s1 ] < sectionOrderMap[ s2 ] end )
+    
     local i = 1
     
     while list[ i ] do
@@ -574,9 +897,17 @@ local function buildListOfRequiredSections()
       for _, relocation in section:relocations() do
         local symbol = object:getSymbol( relocation:getSymbolTableIndex() )
         local index = symbol:getSectionNumber()
+        local object2 = object
+        
+        -- Symbols defined in other objects take their sections along too
+        if index < 1 and knownSymbolMap[ symbol:getName() ] then
+          symbol = knownSymbolMap[ symbol:getName() ]
+          index = symbol:getSectionNumber()
+          object2 = parentMap[ symbol ]
+        end
         
         if index >= 1 then
-          local section2 = object:getSection( index )
+          local section2 = object2:getSection( index )
           
           if section2 ~= section and sectionIsAllowed( section2 ) then
             local msg = string.format( '\tSection %s for symbol %s used in section %s', sectionNameMap[ section2 ], symbol:getName(), sectionNameMap[ section ] )
@@ -627,9 +958,12 @@ local function buildListOfRequiredSections()
     elseif n1 ~= n2 then
       -- lexical order
       return n1 < n2
-    else
+    elseif s1:getSizeOfRawData() ~= s2:getSizeOfRawData() then
       -- order by size
       return s1:getSizeOfRawData() > s2:getSizeOfRawData()
+    else
+      -- command line order, table.sort isn't stable
+      return sectionOrderMap[ s1 ] < sectionOrderMap[ s2 ]
     end
   end
 
@@ -637,7 +971,8 @@ local function buildListOfRequiredSections()
   info( 'Building list of required sections' )
   local mandatorySet = {}
   
-  for name, symbol in pairs( exportMap ) do
+  for _, name in ipairs( sortedKeys( exportMap ) ) do
+    local symbol = exportMap[ name ]
     local section = parentMap[ symbol ]:getSection( symbol:getSectionNumber() )
     info( '\tSection %s exports symbol %s', sectionNameMap[ section ], name )
     
@@ -659,253 +994,988 @@ local function buildListOfRequiredSections()
   table.sort( sectionList, compareSections )
 end
 
---  _           _ _     _  ___   __  __          _   __  __             
--- | |__  _   _(_) | __| |/ _ \ / _|/ _|___  ___| |_|  \/  | __ _ _ __  
--- | '_ \| | | | | |/ _` | | | | |_| |_/ __|/ _ \ __| |\/| |/ _` | '_ \ 
--- | |_) | |_| | | | (_| | |_| |  _|  _\__ \  __/ |_| |  | | (_| | |_) |
--- |_.__/ \__,_|_|_|\__,_|\___/|_| |_| |___/\___|\__|_|  |_|\__,_| .__/ 
---                                                               |_|    
+--                                ____                _  ___        _       ____            _   _                 
+--  _ __ ___   ___ _ __ __ _  ___|  _ \ ___  __ _  __| |/ _ \ _ __ | |_   _/ ___|  ___  ___| |_(_) ___  _ __  ___ 
+-- | '_ ` _ \ / _ \ '__/ _` |/ _ \ |_) / _ \/ _` |/ _` | | | | '_ \| | | | \___ \ / _ \/ __| __| |/ _ \| '_ \/ __|
+-- | | | | | |  __/ | | (_| |  __/  _ <  __/ (_| | (_| | |_| | | | | | |_| |___) |  __/ (__| |_| | (_) | | | \__ \
+-- |_| |_| |_|\___|_|  \__, |\___|_| \_\___|\__,_|\__,_|\___/|_| |_|_|\__, |____/ \___|\___|\__|_|\___/|_| |_|___/
+--                     |___/                                          |___/                                       
 
-local function buildOffsetMap()
-  info( 'Evaluating offsets' )
+local function mergeReadOnlySections()
+  -- Identical read-only sections from different objects, such as the same
+  -- string literal or constant pool, go into the .flo only once. Sections
+  -- must have the same contents, alignment and relocations, and relocations
+  -- are only compared when they point to external symbols, which resolve to
+  -- the same address wherever they're used.
+  info( 'Merging read-only sections' )
   
-  -- Evaluate the offsets
-  local offset = 0
-  bssoffset = nil
-  offsetMap = {}
+  local EXTERNAL = coff.symbolStorageClasses.EXTERNAL
+  local MEM_WRITE = coff.sectionCharacteristics.MEM_WRITE
   
-  for _, section in ipairs( sectionList ) do
-    local alignment = section:getAlignmentBytes() - 1
+  local canonicalMap = {}
+  local list = {}
+  mergeMap = {}
+  mergedsize = 0
+  
+  local function key( section )
+    if section:getName():sub( 1, 6 ) ~= '.rdata' or bit32.band( section:getCharacteristics(), MEM_WRITE ) ~= 0 then
+      return nil
+    end
     
-    offset = bit32.band( offset + alignment, bit32.bnot( alignment ) )
-    offsetMap[ section ] = offset
-    info( '\tSection %s is at 0x%08x', sectionNameMap[ section ], offset )
+    local object = parentMap[ section ]
+    local parts = { section:getAlignmentBytes(), section:getRawData():get() }
     
-    if not bssoffset and section:getName():sub( 1, 4 ) == '.bss' then
-      bssoffset = offset
+    for _, relocation in section:relocations() do
+      local symbol = object:getSymbol( relocation:getSymbolTableIndex() )
+      
+      if symbol:getStorageClass() ~= EXTERNAL then
+        return nil
+      end
+      
+      parts[ #parts + 1 ] = string.format( '%u:%u:%s', relocation:getVirtualAddress(), relocation:getType(), symbol:getName() )
     end
     
-    offset = offset + section:getSizeOfRawData()
-  end
-  
-  if bssoffset then
-    bsssize = offset - bssoffset
-    info( '\t.bss is at 0x%08x, size is %u', bssoffset, bsssize )
-  else
-    bssstart = 0
-    bsssize = 0
-    info( '\tNo .bss section(s) found' )
+    return table.concat( parts, '\0' )
   end
   
-  for name, symbol in pairs( knownSymbolMap ) do
-    local object = parentMap[ symbol ]
-    local section = object:getSection( symbol:getSectionNumber() )
+  for _, section in ipairs( sectionList ) do
+    local k = key( section )
+    local canonical = k and canonicalMap[ k ]
     
-    if offsetMap[ section ] then
-      local offset = offsetMap[ section ] + symbol:getValue()
-      offsetMap[ symbol:getName() ] = offset
-      info( '\tSymbol %s is at 0x%08x', symbol:getName(), offset )
+    if canonical then
+      info( '\tSection %s merged into %s', sectionNameMap[ section ], sectionNameMap[ canonical ] )
+      mergeMap[ section ] = canonical
+      mergedsize = mergedsize + section:getSizeOfRawData()
+    else
+      if k then
+        canonicalMap[ k ] = section
+      end
+      
+      list[ #list + 1 ] = section
     end
   end
+  
+  sectionList = list
 end
 
---      _                      ____            _   _                _____     _____ _       
---   __| |_   _ _ __ ___  _ __/ ___|  ___  ___| |_(_) ___  _ __  __|_   _|__ |  ___| | ___  
---  / _` | | | | '_ ` _ \| '_ \___ \ / _ \/ __| __| |/ _ \| '_ \/ __|| |/ _ \| |_  | |/ _ \ 
--- | (_| | |_| | | | | | | |_) |__) |  __/ (__| |_| | (_) | | | \__ \| | (_) |  _| | | (_) |
---  \__,_|\__,_|_| |_| |_| .__/____/ \___|\___|\__|_|\___/|_| |_|___/|_|\___/|_|   |_|\___/ 
---                       |_|                                                                
+--  _           _ _     _ _     _     _    ___   __ ___                            _       
+-- | |__  _   _(_) | __| | |   (_)___| |_ / _ \ / _|_ _|_ __ ___  _ __   ___  _ __| |_ ___ 
+-- | '_ \| | | | | |/ _` | |   | / __| __| | | | |_ | || '_ ` _ \| '_ \ / _ \| '__| __/ __|
+-- | |_) | |_| | | | (_| | |___| \__ \ |_| |_| |  _|| || | | | | | |_) | (_) | |  | |_\__ \
+-- |_.__/ \__,_|_|_|\__,_|_____|_|___/\__|\___/|_| |___|_| |_| |_| .__/ \___/|_|   \__|___/
+--                                                               |_|                       
 
-local function dumpSectionsToFlo()
-  info( 'Building %s', outputFile )
-  flo = coff.newBuffer()
+local function buildListOfImports()
+  -- Only the sections that made it into the .flo, imports used only by dead
+  -- code don't get trampolines
+  info( 'Building list of undefined symbols' )
+  unknownSymbolMap = {}
+  
+  local messages = {}
   
   for _, section in ipairs( sectionList ) do
-    local alignment = section:getAlignmentBytes()
-    
-    -- Align
-    flo:align( alignment )
-    info( '\tAdded section %s at 0x%08x', sectionNameMap[ section ], flo:getSize() )
+    local object = parentMap[ section ]
     
-    -- Next offset
-    flo:appendRaw( section:getRawData() )
+    for _, relocation in section:relocations() do
+      local symbol = object:getSymbol( relocation:getSymbolTableIndex() )
+      local name = symbol:getName()
+      local known, unknown = isSymbolKnown( symbol )
+      
+      if unknown and not knownSymbolMap[ name ] then
+        local list = unknownSymbolMap[ name ] or {}
+        list[ #list + 1 ] = relocation
+        unknownSymbolMap[ name ] = list
+        
+        local msg = string.format( '\t%s needs symbol %s', sectionNameMap[ section ], name )
+        
+        if not messages[ msg ] then
+          messages[ msg ] = true
+          info( '%s', msg )
+        end
+      end
+    end
   end
 end
 
---            _     _ _____                                _ _                 
---   __ _  __| | __| |_   _| __ __ _ _ __ ___  _ __   ___ | (_)_ __   ___  ___ 
---  / _` |/ _` |/ _` | | || '__/ _` | '_ ` _ \| '_ \ / _ \| | | '_ \ / _ \/ __|
--- | (_| | (_| | (_| | | || | | (_| | | | | | | |_) | (_) | | | | | |  __/\__ \
---  \__,_|\__,_|\__,_| |_||_|  \__,_|_| |_| |_| .__/ \___/|_|_|_| |_|\___||___/
---                                            |_|                              
+--  _           _ _     _  ___   __  __          _   __  __             
+-- | |__  _   _(_) | __| |/ _ \ / _|/ _|___  ___| |_|  \/  | __ _ _ __  
+-- | '_ \| | | | | |/ _` | | | | |_| |_/ __|/ _ \ __| |\/| |/ _` | '_ \ 
+-- | |_) | |_| | | | (_| | |_| |  _|  _\__ \  __/ |_| |  | | (_| | |_) |
+-- |_.__/ \__,_|_|_|\__,_|\___/|_| |_| |___/\___|\__|_|  |_|\__,_| .__/ 
+--                                                               |_|    
 
-local function addTrampolines()
-  -- Trampolines for external functions
-  info( 'Adding trampolines for undefined symbols' )
+local function buildOffsetMap()
+  info( 'Evaluating offsets' )
   
-  fixups = {}
+  -- Group the sections by kind keeping their order, so that .bss is last
+  -- and can be left out of the .flo. Read-only data goes before writable
+  -- data, so that the code and the read-only data can share pages that
+  -- never get written once the module is relocated
+  local groups = { [ KIND_CODE ] = {}, [ KIND_DATA ] = {}, [ KIND_BSS ] = {} }
+  local writable = {}
+  local MEM_WRITE = coff.sectionCharacteristics.MEM_WRITE
   
-  local funcs = {}
+  for _, section in ipairs( sectionList ) do
+    local kind = sectionKind( section )
+    local group = kind == KIND_DATA and bit32.band( section:getCharacteristics(), MEM_WRITE ) ~= 0 and writable or groups[ kind ]
+    group[ #group + 1 ] = section
+  end
   
-  funcs[ coff.machines.MACHINE_AMD64 ] = {}
-  funcs[ coff.machines.MACHINE_AMD64 ][ coff.relocationTypes.AMD64_REL32 ] = function( object, section, relocation, symbol )
-    -- 32-bit displacement from RIP of next instruction to target
-    -- This needs to be turned into a trampoline because of REL32 address limits in 64-bit mode
-    local name = symbol:getName()
-    local addr = offsetMap[ section ] + relocation:getVirtualAddress()
-
-    if not offsetMap[ name ] then
-      flo:align( 4 )
-      info( '\tAdding trampoline for %s at 0x%08x', name, flo:getSize() )
-    
-      offsetMap[ name ] = flo:getSize()
-      fixups[ #fixups + 1 ] = { name = name, addr = flo:getSize() + 2, type = FLO_ADDR64 }
+  -- Evaluate the offsets
+  local offset = 0
+  local list = {}
+  bssoffset = nil
+  trampolineoffset = nil
+  bindoffset = nil
+  textsize = nil
+  offsetMap = {}
+  slotMap = {}
+  entryMap = {}
+  entrySlotMap = {}
+  
+  -- Exported functions, the ones that get entry stubs with --hotswap
+  local entries = {}
+  
+  if hotswap then
+    for _, name in ipairs( sortedKeys( exportMap ) ) do
+      local symbol = exportMap[ name ]
+      local section = parentMap[ symbol ]:getSection( symbol:getSectionNumber() )
       
-      flo:append8( 0x48 ) -- mov rax, qword 0
-      flo:append8( 0xb8 )
-      flo:append32( 0 )
-      flo:append32( 0 )
-      flo:append8( 0xff ) -- jmp rax
-      flo:append8( 0xe0 )
+      if sectionKind( section ) == KIND_CODE then
+        entries[ #entries + 1 ] = name
+      end
     end
   end
   
-  for name, relocationList in pairs( unknownSymbolMap ) do
-    for _, relocation in ipairs( relocationList ) do
-      local section = parentMap[ relocation ]
-      local object = parentMap[ section ]
-      local symbol = object:getSymbol( relocation:getSymbolTableIndex() )
+  local function sections( group )
+    if not pack then
+      local i = 0
       
-      local func = funcs[ machine ]
-      func = func and func[ relocation:getType() ]
+      return function()
+        i = i + 1
+        return group[ i ]
+      end
+    end
+    
+    -- Sections are bucketed by alignment, keeping their order in each
+    -- bucket, and the next one comes from the bucket that needs the least
+    -- padding at the current offset, the one with the biggest alignment on
+    -- ties
+    local buckets = {}
+    local alignments = {}
+    
+    for _, section in ipairs( group ) do
+      local alignment = section:getAlignmentBytes()
       
-      if func then
-        func( object, section, relocation, symbol )
-      else
-        io.stderr:write( 'Error: Invalid relocation type (', string.format( '0x%04x', relocation:getType() ), ') for imported symbol ', symbol:getName(), '\n' )
-        return -1
+      if not buckets[ alignment ] then
+        buckets[ alignment ] = { first = 1 }
+        alignments[ #alignments + 1 ] = alignment
       end
+      
+      local bucket = buckets[ alignment ]
+      bucket[ #bucket + 1 ] = section
     end
-  end
-end
-
---           _                 _       
---  _ __ ___| | ___   ___ __ _| |_ ___ 
--- | '__/ _ \ |/ _ \ / __/ _` | __/ _ \
--- | | |  __/ | (_) | (_| (_| | ||  __/
--- |_|  \___|_|\___/ \___\__,_|\__\___|
---
+    
+    table.sort( alignments, function( a1, a2 ) return a1 > a2 end )
+    
+    return function()
+      local best, bestpadding
+      
+      for _, alignment in ipairs( alignments ) do
+        local bucket = buckets[ alignment ]
+        
+        if bucket[ bucket.first ] then
+          local padding = bit32.band( -offset, alignment - 1 )
+          
+          if not bestpadding or padding < bestpadding then
+            best, bestpadding = bucket, padding
+          end
+        end
+      end
+      
+      if best then
+        best.first = best.first + 1
+        return best[ best.first - 1 ]
+      end
+    end
+  end
+  
+  local function sectionPadding( order )
+    -- Padding between the sections alone if laid out in order, for -v
+    local offset, padding = 0, 0
+    
+    for _, section in ipairs( order ) do
+      local alignment = section:getAlignmentBytes() - 1
+      local aligned = bit32.band( offset + alignment, bit32.bnot( alignment ) )
+      padding = padding + aligned - offset
+      offset = aligned + section:getSizeOfRawData()
+    end
+    
+    return padding
+  end
+  
+  local function reserveTrampolines()
+    -- Right after the code, addTrampolines fills them in
+    if lazy then
+      offset = bit32.band( offset + 15, bit32.bnot( 15 ) )
+      trampolineoffset = offset
+      
+      for _, name in ipairs( sortedKeys( unknownSymbolMap ) ) do
+        offsetMap[ name ] = offset
+        info( '\tLazy binding stub for %s is at 0x%08x', name, offset )
+        offset = offset + LAZY_STUB_SIZE
+      end
+      
+      resolveroffset = offset
+      info( '\tResolver is at 0x%08x', resolveroffset )
+      offset = offset + RESOLVER_SIZE
+    else
+      offset = bit32.band( offset + 3, bit32.bnot( 3 ) )
+      trampolineoffset = offset
+      
+      for _, name in ipairs( sortedKeys( unknownSymbolMap ) ) do
+        offsetMap[ name ] = offset
+        info( '\tTrampoline for %s is at 0x%08x', name, offset )
+        offset = offset + TRAMPOLINE_SIZE
+      end
+    end
+    
+    -- The entry stubs go with the code, offsetMap keeps the addresses of
+    -- the functions so calls inside the module don't go through them
+    offset = bit32.band( offset + 7, bit32.bnot( 7 ) )
+    entryoffset = offset
+    numentries = #entries
+    
+    for _, name in ipairs( entries ) do
+      entryMap[ name ] = offset
+      info( '\tEntry stub for %s is at 0x%08x', name, offset )
+      offset = offset + ENTRY_STUB_SIZE
+    end
+  end
+  
+  local function startWritten()
+    -- The first byte the module writes to starts a page, so the pool can
+    -- seal everything before it and still load the module at a page
+    -- boundary, where every section keeps its alignment
+    if not textsize then
+      offset = bit32.band( offset + PAGE_SIZE - 1, bit32.bnot( PAGE_SIZE - 1 ) )
+      textsize = offset
+      info( '\tWritten part of the image starts at 0x%08x', textsize )
+    end
+  end
+  
+  local function reserveSlots()
+    -- At the end of the data, the slots of lazy imports are patched by the
+    -- resolver
+    offset = bit32.band( offset + 7, bit32.bnot( 7 ) )
+    startWritten()
+    bindoffset = offset
+    info( '\tResolver control block is at 0x%08x', bindoffset )
+    offset = offset + 24
+    
+    for _, name in ipairs( sortedKeys( unknownSymbolMap ) ) do
+      slotMap[ name ] = offset
+      info( '\tSlot for %s is at 0x%08x', name, offset )
+      offset = offset + 8
+    end
+  end
+  
+  local function reserveEntrySlots()
+    -- At the end of the data too, flo_swap points them to the new module
+    offset = bit32.band( offset + 7, bit32.bnot( 7 ) )
+    
+    if #entries ~= 0 then
+      startWritten()
+    end
+    
+    for _, name in ipairs( entries ) do
+      entrySlotMap[ name ] = offset
+      info( '\tEntry slot for %s is at 0x%08x', name, offset )
+      offset = offset + 8
+    end
+  end
+  
+  for kind = KIND_CODE, KIND_BSS do
+    if kind == KIND_DATA then
+      reserveTrampolines()
+      
+      if hugepageAlign then
+        -- The loader puts the image at a huge page boundary, so the code,
+        -- trampolines included, only takes whole huge pages
+        offset = bit32.band( offset + HUGE_PAGE_SIZE - 1, bit32.bnot( HUGE_PAGE_SIZE - 1 ) )
+        info( '\tCode padded to 0x%08x for huge pages', offset )
+      end
+    elseif kind == KIND_BSS then
+      if lazy then
+        reserveSlots()
+      end
+      
+      reserveEntrySlots()
+    end
+    
+    local function place( group, written )
+      for section in sections( group ) do
+        if written then
+          startWritten()
+        end
+        
+        local alignment = section:getAlignmentBytes() - 1
+        offset = bit32.band( offset + alignment, bit32.bnot( alignment ) )
+        offsetMap[ section ] = offset
+        list[ #list + 1 ] = section
+        info( '\tSection %s is at 0x%08x', sectionNameMap[ section ], offset )
+        
+        if not bssoffset and kind == KIND_BSS then
+          bssoffset = offset
+        end
+        
+        offset = offset + section:getSizeOfRawData()
+      end
+    end
+    
+    place( groups[ kind ], kind == KIND_BSS )
+    
+    if kind == KIND_DATA then
+      place( writable, true )
+    end
+  end
+  
+  if pack and verbose then
+    local unpacked = {}
+    
+    for kind = KIND_CODE, KIND_BSS do
+      for _, section in ipairs( groups[ kind ] ) do
+        unpacked[ #unpacked + 1 ] = section
+      end
+      
+      if kind == KIND_DATA then
+        for _, section in ipairs( writable ) do
+          unpacked[ #unpacked + 1 ] = section
+        end
+      end
+    end
+    
+    info( '\tPadding between sections is %u bytes, %u before packing', sectionPadding( list ), sectionPadding( unpacked ) )
+  elseif verbose then
+    info( '\tPadding between sections is %u bytes', sectionPadding( list ) )
+  end
+  
+  sectionList = list
+  
+  -- Merged sections share the offset of the section they were merged into,
+  -- so symbols and relocations pointing to them are redirected there
+  for section, canonical in pairs( mergeMap ) do
+    offsetMap[ section ] = offsetMap[ canonical ]
+  end
+  
+  layoutsize = offset
+  textsize = textsize or offset
+  info( '\tRead-only part of the image is %u bytes', textsize )
+  
+  if bssoffset then
+    bsssize = offset - bssoffset
+    imagesize = bssoffset
+    info( '\t.bss is at 0x%08x, size is %u', bssoffset, bsssize )
+  else
+    bsssize = 0
+    imagesize = offset
+    info( '\tNo .bss section(s) found' )
+  end
+  
+  for _, name in ipairs( sortedKeys( knownSymbolMap ) ) do
+    local symbol = knownSymbolMap[ name ]
+    local object = parentMap[ symbol ]
+    local section = object:getSection( symbol:getSectionNumber() )
+    
+    if offsetMap[ section ] then
+      local offset = offsetMap[ section ] + symbol:getValue()
+      offsetMap[ symbol:getName() ] = offset
+      info( '\tSymbol %s is at 0x%08x', symbol:getName(), offset )
+    end
+  end
+  
+  -- The functions for --function-table: external symbols and static
+  -- functions in the code, each one running up to the next one in its
+  -- section or to the end of the section. Only one name is kept for
+  -- functions with aliases, preferring external ones
+  functions = {}
+  
+  if functionTable then
+    local EXTERNAL = coff.symbolStorageClasses.EXTERNAL
+    local STATIC = coff.symbolStorageClasses.STATIC
+    local DTYPE_FUNCTION = coff.symbolTypes.DTYPE_FUNCTION
+    local starts = {}
+    
+    for _, object in ipairs( objectList ) do
+      for _, symbol in object:symbols() do
+        local sc = symbol:getStorageClass()
+        local index = symbol:getSectionNumber()
+        
+        if index >= 1 and ( sc == EXTERNAL or ( sc == STATIC and symbol:getComplexType() == DTYPE_FUNCTION ) ) then
+          local section = object:getSection( index )
+          
+          if offsetMap[ section ] and sectionKind( section ) == KIND_CODE and not mergeMap[ section ] then
+            starts[ section ] = starts[ section ] or {}
+            local list = starts[ section ]
+            list[ #list + 1 ] = { name = symbol:getName(), value = symbol:getValue(), external = sc == EXTERNAL }
+          end
+        end
+      end
+    end
+    
+    for _, section in ipairs( sectionList ) do
+      local list = starts[ section ]
+      
+      if list then
+        table.sort( list, function( f1, f2 )
+          if f1.value ~= f2.value then
+            return f1.value < f2.value
+          elseif f1.external ~= f2.external then
+            return f1.external
+          end
+          
+          return f1.name < f2.name
+        end )
+        
+        for i, func in ipairs( list ) do
+          if i == 1 or func.value ~= list[ i - 1 ].value then
+            local nextvalue = section:getSizeOfRawData()
+            
+            for j = i + 1, #list do
+              if list[ j ].value ~= func.value then
+                nextvalue = list[ j ].value
+                break
+              end
+            end
+            
+            functions[ #functions + 1 ] = { name = func.name, offset = offsetMap[ section ] + func.value, size = nextvalue - func.value }
+          end
+        end
+      end
+    end
+    
+    info( '\t%u functions in the function table', #functions )
+  end
+end
+
+--      _                      ____            _   _                _____     _____ _       
+--   __| |_   _ _ __ ___  _ __/ ___|  ___  ___| |_(_) ___  _ __  __|_   _|__ |  ___| | ___  
+--  / _` | | | | '_ ` _ \| '_ \___ \ / _ \/ __| __| |/ _ \| '_ \/ __|| |/ _ \| |_  | |/ _ \ 
+-- | (_| | |_| | | | | | | |_) |__) |  __/ (__| |_| | (_) | | | \__ \| | (_) |  _| | | (_) |
+--  \__,_|\__,_|_| |_| |_| .__/____/ \___|\___|\__|_|\___/|_| |_|___/|_|\___/|_|   |_|\___/ 
+--                       |_|                                                                
+
+local function dumpSectionsToFlo()
+  info( 'Building %s', outputFile )
+  flo = coff.newBuffer()
+  
+  -- Gaps in the code are filled with int3, so that running into them traps
+  local INT3 = 0xcc
+  local codeend = 0
+  
+  local function fillCode( from, to )
+    for offset = from, to - 1 do
+      flo:set8( offset, INT3 )
+    end
+  end
+  
+  for _, section in ipairs( sectionList ) do
+    -- Pad up to the offset of the section, this also leaves room for the
+    -- trampolines
+    local gap = flo:getSize()
+    flo:grow( offsetMap[ section ] - flo:getSize() )
+    info( '\tAdded section %s at 0x%08x', sectionNameMap[ section ], flo:getSize() )
+    
+    if sectionKind( section ) == KIND_CODE then
+      fillCode( gap, flo:getSize() )
+      flo:appendRaw( section:getRawData() )
+      codeend = flo:getSize()
+    elseif sectionKind( section ) == KIND_BSS then
+      -- .bss has no raw data, and isn't written to the .flo
+      flo:grow( section:getSizeOfRawData() )
+    else
+      flo:appendRaw( section:getRawData() )
+    end
+  end
+  
+  flo:grow( layoutsize - flo:getSize() )
+  
+  -- Up to the trampolines, which are right after the code
+  fillCode( codeend, trampolineoffset )
+end
+
+--            _     _ _____                                _ _                 
+--   __ _  __| | __| |_   _| __ __ _ _ __ ___  _ __   ___ | (_)_ __   ___  ___ 
+--  / _` |/ _` |/ _` | | || '__/ _` | '_ ` _ \| '_ \ / _ \| | | '_ \ / _ \/ __|
+-- | (_| | (_| | (_| | | || | | (_| | | | | | | |_) | (_) | | | | | |  __/\__ \
+--  \__,_|\__,_|\__,_| |_||_|  \__,_|_| |_| |_| .__/ \___/|_|_|_| |_|\___||___/
+--                                            |_|                              
+
+local function addTrampolines()
+  -- Trampolines for external functions
+  info( 'Adding trampolines for undefined symbols' )
+  
+  imports = {}
+  
+  local funcs = {}
+  local added = {}
+  local names = {}
+  
+  -- Writes machine code at offset
+  local offset
+  
+  local function bytes( ... )
+    for _, byte in ipairs{ ... } do
+      flo:set8( offset, byte )
+      offset = offset + 1
+    end
+  end
+  
+  local function rel32( target )
+    -- 32-bit displacement from RIP of next instruction, always the last field
+    flo:set32( offset, target - ( offset + 4 ) )
+    offset = offset + 4
+  end
+  
+  local function imm32( value )
+    flo:set32( offset, value )
+    offset = offset + 4
+  end
+  
+  if lazy then
+    -- Saves the argument registers, calls bind( header, index ) and jumps to
+    -- the address it returns. The index was pushed by the stub, and both the
+    -- Windows and the System V registers are set up for the call.
+    offset = resolveroffset
+    
+    bytes( 0x50, 0x51, 0x52, 0x56, 0x57 )                   -- push rax, rcx, rdx, rsi, rdi
+    bytes( 0x41, 0x50, 0x41, 0x51, 0x41, 0x52 )             -- push r8, r9, r10
+    bytes( 0x48, 0x81, 0xec, 0x80, 0x00, 0x00, 0x00 )       -- sub rsp, 128
+    
+    for k = 0, 7 do
+      bytes( 0xf3, 0x0f, 0x7f, 0x44 + k * 8, 0x24, k * 16 ) -- movdqu [rsp+16*k], xmmk
+    end
+    
+    bytes( 0x48, 0x83, 0xec, 0x20 )                         -- sub rsp, 32 (shadow space)
+    bytes( 0x48, 0x8b, 0x94, 0x24, 0xe0, 0x00, 0x00, 0x00 ) -- mov rdx, [rsp+224] (the index)
+    bytes( 0x48, 0x89, 0xd6 )                               -- mov rsi, rdx
+    bytes( 0x48, 0x8b, 0x0d ) rel32( bindoffset + 8 )       -- mov rcx, [rip+header]
+    bytes( 0x48, 0x89, 0xcf )                               -- mov rdi, rcx
+    bytes( 0xff, 0x15 ) rel32( bindoffset )                 -- call [rip+bind]
+    bytes( 0x48, 0x89, 0x84, 0x24, 0xe0, 0x00, 0x00, 0x00 ) -- mov [rsp+224], rax
+    bytes( 0x48, 0x83, 0xc4, 0x20 )                         -- add rsp, 32
+    
+    for k = 0, 7 do
+      bytes( 0xf3, 0x0f, 0x6f, 0x44 + k * 8, 0x24, k * 16 ) -- movdqu xmmk, [rsp+16*k]
+    end
+    
+    bytes( 0x48, 0x81, 0xc4, 0x80, 0x00, 0x00, 0x00 )       -- add rsp, 128
+    bytes( 0x41, 0x5a, 0x41, 0x59, 0x41, 0x58 )             -- pop r10, r9, r8
+    bytes( 0x5f, 0x5e, 0x5a, 0x59, 0x58 )                   -- pop rdi, rsi, rdx, rcx, rax
+    bytes( 0xc3 )                                           -- ret, to the bound address
+    
+    assert( offset == resolveroffset + RESOLVER_SIZE )
+  end
+  
+  funcs[ coff.machines.MACHINE_AMD64 ] = {}
+  funcs[ coff.machines.MACHINE_AMD64 ][ coff.relocationTypes.AMD64_REL32 ] = function( object, section, relocation, symbol )
+    -- 32-bit displacement from RIP of next instruction to target
+    -- This needs to be turned into a trampoline because of REL32 address limits in 64-bit mode
+    local name = symbol:getName()
+    
+    if not added[ name ] then
+      added[ name ] = true
+      names[ #names + 1 ] = name
+    end
+  end
+  
+  -- Pointers to imports point to their trampolines
+  funcs[ coff.machines.MACHINE_AMD64 ][ coff.relocationTypes.AMD64_ADDR64 ] = funcs[ coff.machines.MACHINE_AMD64 ][ coff.relocationTypes.AMD64_REL32 ]
+  
+  for _, name in ipairs( sortedKeys( unknownSymbolMap ) ) do
+    for _, relocation in ipairs( unknownSymbolMap[ name ] ) do
+      local section = parentMap[ relocation ]
+      local object = parentMap[ section ]
+      local symbol = object:getSymbol( relocation:getSymbolTableIndex() )
+      
+      local func = funcs[ machine ]
+      func = func and func[ relocation:getType() ]
+      
+      if func then
+        func( object, section, relocation, symbol )
+      else
+        io.stderr:write( 'Error: Invalid relocation type (', string.format( '0x%04x', relocation:getType() ), ') for imported symbol ', symbol:getName(), '\n' )
+        return -1
+      end
+    end
+  end
+  
+  -- Prebound imports go last, so the loader can skip them as a block. Both
+  -- groups are sorted, so that front-coded names are decoded sequentially
+  local ordered = {}
+  numprebound = 0
+  table.sort( names )
+  
+  for _, name in ipairs( names ) do
+    if not prebindMap[ name ] then
+      ordered[ #ordered + 1 ] = name
+    end
+  end
+  
+  for _, name in ipairs( names ) do
+    if prebindMap[ name ] then
+      ordered[ #ordered + 1 ] = name
+      numprebound = numprebound + 1
+    end
+  end
+  
+  for _, name in ipairs( ordered ) do
+    -- The room for the trampoline was reserved by buildOffsetMap
+    local address = prebindMap[ name ] or { low = 0, high = 0 }
+    offset = offsetMap[ name ]
+    
+    if lazy then
+      -- The slot starts pointing to the push, the loader adds the base
+      -- address to it. Prebound slots point to the import already.
+      local slot = slotMap[ name ]
+      info( '\tAdding lazy binding stub for %s at 0x%08x', name, offset )
+      
+      imports[ #imports + 1 ] = { name = name, addr = slot, type = FLO_ADDR64 }
+      
+      if prebindMap[ name ] then
+        flo:set32( slot, address.low )
+        flo:set32( slot + 4, address.high )
+      else
+        flo:set32( slot, offset + 6 )
+        flo:set32( slot + 4, 0 )
+      end
+      
+      bytes( 0xff, 0x25 ) rel32( slot )     -- jmp [rip+slot]
+      bytes( 0x68 ) imm32( #imports - 1 )   -- push index
+      bytes( 0xe9 ) rel32( resolveroffset ) -- jmp resolver
+    else
+      info( '\tAdding trampoline for %s at 0x%08x', name, offset )
+      imports[ #imports + 1 ] = { name = name, addr = offset + 2, type = FLO_ADDR64 }
+      
+      -- mov rax, qword address
+      bytes( 0x48, 0xb8 ) imm32( address.low ) imm32( address.high )
+      -- jmp rax
+      bytes( 0xff, 0xe0 )
+    end
+    
+    if prebindMap[ name ] then
+      info( '\t\tPrebound to 0x%08x%08x', address.high, address.low )
+    end
+  end
+  
+  for _, name in ipairs( sortedKeys( entryMap ) ) do
+    -- The slot starts pointing to the function, relocate adds it to the base
+    -- fixups
+    local slot = entrySlotMap[ name ]
+    offset = entryMap[ name ]
+    info( '\tAdding entry stub for %s at 0x%08x', name, offset )
+    
+    flo:set32( slot, offsetMap[ name ] )
+    flo:set32( slot + 4, 0 )
+    
+    bytes( 0xff, 0x25 ) rel32( slot ) -- jmp [rip+slot]
+    bytes( 0xcc, 0xcc )               -- int3
+  end
+end
+
+--           _                 _       
+--  _ __ ___| | ___   ___ __ _| |_ ___ 
+-- | '__/ _ \ |/ _ \ / __/ _` | __/ _ \
+-- | | |  __/ | (_) | (_| (_| | ||  __/
+-- |_|  \___|_|\___/ \___\__,_|\__\___|
+--
 
 local function relocate()
   -- Resolve relocations
   info( 'Relocating' )
   
   local funcs = {}
+  baseFixups = {}
+  
+  local function findTarget( object, symbol )
+    -- Symbols defined in the object go through their own section, the
+    -- COMDAT sections of string literals are all named .rdata so the name
+    -- would find the first one
+    local index = symbol:getSectionNumber()
+    local section = index >= 1 and object:getSection( index )
+    
+    if section and offsetMap[ section ] then
+      return offsetMap[ section ] + symbol:getValue()
+    end
+    
+    return offsetMap[ symbol:getName() ]
+  end
   
   funcs[ coff.machines.MACHINE_AMD64 ] = {}
   funcs[ coff.machines.MACHINE_AMD64 ][ coff.relocationTypes.AMD64_REL32 ] = function( object, section, relocation, symbol )
     -- 32-bit displacement from RIP of next instruction to target
     local addr = offsetMap[ section ] + relocation:getVirtualAddress()
-    local target = offsetMap[ symbol:getName() ]
-    
-    if not target then
-      for _, section in object:sections() do
-        if section:getName() == symbol:getName() then
-          target = offsetMap[ section ]
-          break
-        end
-      end
-    end
+    local target = findTarget( object, symbol )
     
     target = target + flo:get32( addr )
     flo:set32( addr, target - ( addr + 4 ) )
     info( '\tSymbol %s at 0x%08x relocated to 0x%08x', symbol:getName(), addr, target )
   end
   
+  funcs[ coff.machines.MACHINE_AMD64 ][ coff.relocationTypes.AMD64_ADDR64 ] = function( object, section, relocation, symbol )
+    -- 64-bit absolute address, relative to the image here, the loader adds
+    -- the base address
+    local addr = offsetMap[ section ] + relocation:getVirtualAddress()
+    local target = findTarget( object, symbol )
+    
+    if addr % 8 ~= 0 then
+      io.stderr:write( string.format( 'Error: Unaligned 64-bit address of symbol %s in %s\n', symbol:getName(), sectionNameMap[ section ] ) )
+      return -1
+    end
+    
+    -- The addend is signed
+    local high = flo:get32( addr + 4 )
+    target = target + flo:get32( addr ) + ( high < 0x80000000 and high or high - 0x100000000 ) * 0x100000000
+    
+    if target < 0 or target >= 0x100000000 then
+      io.stderr:write( string.format( 'Error: Address of symbol %s in %s is outside the image\n', symbol:getName(), sectionNameMap[ section ] ) )
+      return -1
+    end
+    
+    flo:set32( addr, target )
+    flo:set32( addr + 4, 0 )
+    baseFixups[ #baseFixups + 1 ] = addr
+    info( '\tAddress of symbol %s at 0x%08x relocated to 0x%08x', symbol:getName(), addr, target )
+  end
+  
   for _, section in ipairs( sectionList ) do
     local object = parentMap[ section ]
     
-    for _, relocation in section:relocations() do
-      local symbol = object:getSymbol( relocation:getSymbolTableIndex() )
-      
-      local func = funcs[ machine ]
-      func = func and func[ relocation:getType() ]
+    for _, relocation in section:relocations() do
+      local symbol = object:getSymbol( relocation:getSymbolTableIndex() )
+      
+      local func = funcs[ machine ]
+      func = func and func[ relocation:getType() ]
+      
+      if func then
+        if func( object, section, relocation, symbol ) then
+          return -1
+        end
+      else
+        io.stderr:write( string.format( 'Error: Invalid relocation type 0x%04x for symbol %s\n', relocation:getType(), symbol:getName() ) )
+        return -1
+      end
+    end
+  end
+  
+  -- The entry slots of --hotswap hold addresses of functions too
+  for _, slot in pairs( entrySlotMap ) do
+    baseFixups[ #baseFixups + 1 ] = slot
+  end
+  
+  -- RELR-style encoding: the offset of a fixup, then bitmap words with their
+  -- lowest bit set, bit n + 1 standing for the n'th 64-bit word after the
+  -- ones already covered
+  table.sort( baseFixups )
+  fixupWords = {}
+  local i = 1
+  
+  while baseFixups[ i ] do
+    local where = baseFixups[ i ]
+    fixupWords[ #fixupWords + 1 ] = where
+    where = where + 8
+    i = i + 1
+    
+    while true do
+      local bitmap = 0
+      
+      while baseFixups[ i ] and baseFixups[ i ] < where + BITMAP_BITS * 8 do
+        bitmap = bit32.bor( bitmap, bit32.lshift( 1, ( baseFixups[ i ] - where ) / 8 ) )
+        i = i + 1
+      end
+      
+      if bitmap == 0 then
+        break
+      end
+      
+      fixupWords[ #fixupWords + 1 ] = bit32.bor( bit32.lshift( bitmap, 1 ), 1 )
+      where = where + BITMAP_BITS * 8
+    end
+  end
+  
+  info( '\t%u base fixups in %u words', #baseFixups, #fixupWords )
+end
+
+--  _           _ _     _ ____                  _           _ _____     _     _      
+-- | |__  _   _(_) | __| / ___| _   _ _ __ ___ | |__   ___ | |_   _|_ _| |__ | | ___ 
+-- | '_ \| | | | | |/ _` \___ \| | | | '_ ` _ \| '_ \ / _ \| | | |/ _` | '_ \| |/ _ \
+-- | |_) | |_| | | | (_| |___) | |_| | | | | | | |_) | (_) | | | | (_| | |_) | |  __/
+-- |_.__/ \__,_|_|_|\__,_|____/ \__, |_| |_| |_|_.__/ \___/|_| |_|\__,_|_.__/|_|\___|
+--                              |___/                                                
+
+local function buildSymbolTable()
+  info( 'Building symbol table' )
+  
+  strtable = {}
+  exports = {}
+  
+  for name, symbol in pairs( exportMap ) do
+    local section = parentMap[ symbol ]:getSection( symbol:getSectionNumber() )
+    exports[ #exports + 1 ] = { name = name, addr = entryMap[ name ] or symbol:getValue() + offsetMap[ section ], type = FLO_EXPORTED }
+  end
+  
+  -- Sorted, so that front-coded names are decoded sequentially, and so that
+  -- flo_swap matches the exports of two modules in a single pass, by hash
+  -- with -h
+  if hashfunc then
+    for _, export in ipairs( exports ) do
+      export.hash = bit32.band( hashfunc( export.name ), 0xffffffff )
+    end
+    
+    table.sort( exports, function( e1, e2 ) return e1.hash < e2.hash or ( e1.hash == e2.hash and e1.name < e2.name ) end )
+  else
+    table.sort( exports, function( e1, e2 ) return e1.name < e2.name end )
+  end
+  
+  local names = {}
+  local seen = {}
+  
+  for _, list in ipairs{ exports, imports } do
+    for _, fixup in ipairs( list ) do
+      if not seen[ fixup.name ] then
+        seen[ fixup.name ] = true
+        names[ #names + 1 ] = fixup.name
+      end
+    end
+  end
+  
+  -- The function table goes first, its names and then its entries, which
+  -- have negative offsets to the name and to the function, and the size
+  local start = flo:getSize()
+  functionoffset = nil
+  
+  if functionTable then
+    local functionnames = {}
+    
+    for _, func in ipairs( functions ) do
+      functionnames[ func ] = flo:getSize()
+      flo:appendString( func.name )
+    end
+    
+    flo:align( 4 )
+    functionoffset = flo:getSize()
+    
+    for _, func in ipairs( functions ) do
+      local here = flo:getSize()
+      flo:append32( here - functionnames[ func ] )
+      flo:append32( here - func.offset )
+      flo:append32( func.size )
+    end
+  end
+  
+  functionsize = flo:getSize() - start
+  start = flo:getSize()
+  namesoffset = nil
+  
+  if hashfunc then
+    -- Only the hashes go into the symbol table
+  elseif frontCode then
+    -- Each name is the length of the prefix it shares with the previous one
+    -- and the rest of the name, restarting every NAMES_PER_BLOCK names. The
+    -- offsets of the blocks follow the names.
+    local blocks = {}
+    local previous = ''
+    
+    table.sort( names )
+    
+    for i, name in ipairs( names ) do
+      local prefix = 0
+      
+      if #name >= MAX_NAME_SIZE then
+        io.stderr:write( 'Error: Symbol name too long to be front-coded: ', name, '\n' )
+        return -1
+      end
+      
+      if ( i - 1 ) % NAMES_PER_BLOCK == 0 then
+        blocks[ #blocks + 1 ] = flo:getSize()
+      else
+        local max = math.min( #name, #previous, 255 )
+        
+        while prefix < max and name:byte( prefix + 1 ) == previous:byte( prefix + 1 ) do
+          prefix = prefix + 1
+        end
+      end
+      
+      strtable[ name ] = i - 1
+      flo:append8( prefix )
+      flo:appendString( name:sub( prefix + 1 ) )
+      previous = name
+    end
+    
+    flo:align( 4 )
+    namesoffset = flo:getSize()
+    
+    for _, block in ipairs( blocks ) do
+      flo:append32( namesoffset - block )
+    end
+  else
+    -- Tail merging: sorted by their reversed names, names come right before
+    -- the names that they're a suffix of
+    local reversed = {}
+    
+    for i, name in ipairs( names ) do
+      reversed[ i ] = name:reverse()
+    end
+    
+    table.sort( reversed )
+    
+    for i = #reversed, 1, -1 do
+      local name = reversed[ i ]:reverse()
+      local following = reversed[ i + 1 ]
       
-      if func then
-        func( object, section, relocation, symbol )
+      if following and following:sub( 1, #reversed[ i ] ) == reversed[ i ] then
+        local longer = following:reverse()
+        strtable[ name ] = strtable[ longer ] + #longer - #name
       else
-        io.stderr:write( string.format( 'Error: Invalid relocation type 0x%04x for symbol %s\n', relocation:getType(), symbol:getName() ) )
-        return -1
+        strtable[ name ] = flo:getSize()
+        flo:appendString( name )
       end
     end
   end
-end
-
---  _           _ _     _ ____                  _           _ _____     _     _      
--- | |__  _   _(_) | __| / ___| _   _ _ __ ___ | |__   ___ | |_   _|_ _| |__ | | ___ 
--- | '_ \| | | | | |/ _` \___ \| | | | '_ ` _ \| '_ \ / _ \| | | |/ _` | '_ \| |/ _ \
--- | |_) | |_| | | | (_| |___) | |_| | | | | | | |_) | (_) | | | | (_| | |_) | |  __/
--- |_.__/ \__,_|_|_|\__,_|____/ \__, |_| |_| |_|_.__/ \___/|_| |_|\__,_|_.__/|_|\___|
---                              |___/                                                
-
-local function buildSymbolTable()
-  info( 'Building symbol table' )
-  
-  strtable = {}
   
-  for name, symbol in pairs( exportMap ) do
-    local section = parentMap[ symbol ]:getSection( symbol:getSectionNumber() )
-    fixups[ #fixups + 1 ] = { name = name, addr = symbol:getValue() + offsetMap[ section ], type = FLO_EXPORTED }
-  end
+  stringsize = flo:getSize() - start
+  flo:align( 4 )
   
-  if not hashfunc then
-    for _, fixup in ipairs( fixups ) do
-      if not strtable[ fixup.name ] then
-        strtable[ fixup.name ] = flo:getSize()
-        flo:appendString( fixup.name )
-      end
-    end
+  -- The base fixups, right before the exports
+  for _, word in ipairs( fixupWords ) do
+    flo:append32( word )
   end
   
-  flo:align( 4 )
-  
   local relocnames = {
     [ FLO_EXPORTED ] = 'exported',
     [ FLO_ADDR64 ] = 'addr64'
   }
   
-  for i = 1, #fixups, 4 do
-    for j = 0, 3 do
-      local fixup = fixups[ i + j ]
+  -- Exports and then imports, each kind in its own contiguous array right
+  -- before the header
+  for _, list in ipairs{ exports, imports } do
+    for _, fixup in ipairs( list ) do
+      local here = flo:getSize()
+      info( '\tAdding entry for %s (%s at 0x%08x)', fixup.name, relocnames[ fixup.type ], fixup.addr )
       
-      if fixup then
-        info( '\tAdding entry for %s (%s at 0x%08x)', fixup.name, relocnames[ fixup.type ], fixup.addr )
-        flo:append8( fixup.type )
+      if hashfunc then
+        -- the hash of the symbol
+        flo:append32( hashfunc( fixup.name ) )
+      elseif frontCode then
+        -- the index of the front-coded name
+        flo:append32( strtable[ fixup.name ] )
       else
-        flo:append8( FLO_UNUSED )
+        -- a negative offset to symbol name
+        flo:append32( here - strtable[ fixup.name ] )
       end
-    end
-    
-    for j = 0, 3 do
-      local fixup = fixups[ i + j ]
       
-      if fixup then
-        local here = flo:getSize()
-        
-        if hashfunc then
-          -- the hash of the symbol
-          flo:append32( hashfunc:call( fixup.name ) )
-        else
-          -- a negative offset to symbol name
-          flo:append32( here - strtable[ fixup.name ] )
-        end
-        
-        -- a negative offset to the symbol address
-        flo:append32( here - fixup.addr )
-      else
-        flo:append32( 0 )
-        flo:append32( 0 )
-      end
+      -- a negative offset to the symbol address
+      flo:append32( here - fixup.addr )
     end
   end
 end
@@ -920,9 +1990,59 @@ end
 local function finishFlo()
   info( 'Writing the header' )
   
-  flo:append32( #fixups )
-  flo:append32( bssstart )
+  local here = flo:getSize()
+  local memsize = here + FLO_HEADER_SIZE
+  
+  flo:append32( #exports )
+  flo:append32( #imports )
+  -- a negative offset to the start of the .bss section
+  flo:append32( bssoffset and here - bssoffset or 0 )
   flo:append32( bsssize )
+  flo:append32( imagesize )
+  flo:append32( memsize )
+  flo:append32( bit32.bor( lazy and FLO_FLAG_LAZY or 0, namesoffset and FLO_FLAG_FRONTCODED or 0, hugepageAlign and FLO_FLAG_HUGEPAGE or 0, hotswap and FLO_FLAG_HOTSWAP or 0 ) )
+  -- a negative offset to the resolver control block
+  flo:append32( bindoffset and here - bindoffset or 0 )
+  -- a negative offset to the block index of front-coded names
+  flo:append32( namesoffset and here - namesoffset or 0 )
+  flo:append32( prebindChecksum )
+  flo:append32( numprebound )
+  -- the number of words of base fixups before the exports
+  flo:append32( #fixupWords )
+  -- the build id is filled in once the whole file is known
+  local buildidoffset = flo:getSize()
+  flo:append32( 0 )
+  -- a negative offset to the entry stubs, which are contiguous
+  flo:append32( numentries ~= 0 and here - entryoffset or 0 )
+  flo:append32( numentries )
+  -- a negative offset to the function table, and its number of entries
+  flo:append32( functionoffset and here - functionoffset or 0 )
+  flo:append32( #functions )
+  -- the size of the code and read-only data, pages before it can be made
+  -- executable and read-only once the module is relocated
+  flo:append32( textsize )
+  
+  -- The symbol names, the symbol table and the header are never compressed,
+  -- so the loader can read them first to know how much memory the module
+  -- needs. .bss isn't written, the loader gets zeroed memory for it
+  local packed
+  
+  if compress then
+    packed = flo:compress( imagesize )
+    info( '\tImage compressed from %u to %u bytes', imagesize, #packed )
+    flo:append32( #packed )
+  else
+    flo:append32( 0 )
+  end
+  
+  flo:append32( bit32.bor( FLO_MAGIC, bit32.lshift( FLO_VERSION, 24 ) ) )
+  
+  if memoryLink then
+    -- libflolink copies the module as laid out in memory, .bss included
+    memoryLink.image = flo:get( 0 )
+    filesize = flo:getSize()
+    return
+  end
   
   local file, err = io.open( outputFile, 'wb' )
   
@@ -931,10 +2051,146 @@ local function finishFlo()
     return -1
   end
   
-  file:write( flo:get() )
+  local image = packed or flo:get( 0, imagesize )
+  
+  if buildId then
+    -- The checksum of the file with a zero build id, zero means no build id
+    local id = coff.checksum( image .. flo:get( imagesize + bsssize ) )
+    id = id ~= 0 and id or 1
+    flo:set32( buildidoffset, id )
+    info( '\tBuild id is 0x%08x', id )
+  end
+  
+  file:write( image, flo:get( imagesize + bsssize ) )
+  filesize = ( packed and #packed or imagesize ) + flo:getSize() - imagesize - bsssize
+  
   file:close()
 end
 
+--             _       _   ____  _         ____                       _   
+--  _ __  _ __(_)_ __ | |_/ ___|(_)_______|  _ \ ___ _ __   ___  _ __| |_ 
+-- | '_ \| '__| | '_ \| __\___ \| |_  / _ \ |_) / _ \ '_ \ / _ \| '__| __|
+-- | |_) | |  | | | | | |_ ___) | |/ /  __/  _ <  __/ |_) | (_) | |  | |_ 
+-- | .__/|_|  |_|_| |_|\__|____/|_/___\___|_| \_\___| .__/ \___/|_|   \__|
+-- |_|                                              |_|                   
+
+local function printSizeReport()
+  if not sizeReport then
+    return
+  end
+  
+  local kindNames = { [ KIND_CODE ] = 'code', [ KIND_DATA ] = 'data', [ KIND_BSS ] = 'bss' }
+  local sizes = { code = 0, data = 0, bss = 0 }
+  local objectSizes = {}
+  
+  for _, section in ipairs( sectionList ) do
+    local kind = kindNames[ sectionKind( section ) ]
+    local object = parentMap[ section ]
+    local size = section:getSizeOfRawData()
+    
+    objectSizes[ object ] = objectSizes[ object ] or { code = 0, data = 0, bss = 0 }
+    objectSizes[ object ][ kind ] = objectSizes[ object ][ kind ] + size
+    sizes[ kind ] = sizes[ kind ] + size
+  end
+  
+  if lazy then
+    -- Stubs, slots, the resolver and its control block
+    sizes.trampolines = #imports * ( LAZY_STUB_SIZE + 8 ) + RESOLVER_SIZE + 24
+  else
+    sizes.trampolines = #imports * TRAMPOLINE_SIZE
+  end
+  
+  -- Entry stubs and their slots
+  sizes.trampolines = sizes.trampolines + numentries * ( ENTRY_STUB_SIZE + 8 )
+  
+  sizes[ 'symbol table' ] = ( #exports + #imports ) * 8 + FLO_HEADER_SIZE
+  sizes.strings = stringsize
+  sizes[ 'base fixups' ] = #fixupWords * 4
+  sizes.functions = functionsize
+  
+  -- Whatever is left is alignment
+  local parts = { 'code', 'data', 'bss', 'trampolines', 'symbol table', 'strings', 'base fixups', 'functions' }
+  sizes.padding = flo:getSize()
+  
+  for _, part in ipairs( parts ) do
+    sizes.padding = sizes.padding - sizes[ part ]
+  end
+  
+  parts[ #parts + 1 ] = 'padding'
+  io.write( string.format( 'Size report for %s\n', outputFile ) )
+  
+  for _, part in ipairs( parts ) do
+    io.write( string.format( '  %-14s %10u\n', part, sizes[ part ] ) )
+  end
+  
+  io.write( string.format( '  %-14s %10u\n', 'memory', flo:getSize() ) )
+  io.write( string.format( '  %-14s %10u\n', 'file', filesize ) )
+  io.write( string.format( '  %-14s %10u\n', 'merged', mergedsize ) )
+  
+  -- The objects that use each name: the one that defines an export, and the
+  -- ones with relocations against an import
+  local users = {}
+  
+  for name, symbol in pairs( exportMap ) do
+    users[ name ] = { parentMap[ symbol ] }
+  end
+  
+  for name, relocations in pairs( unknownSymbolMap ) do
+    local seen = {}
+    users[ name ] = {}
+    
+    for _, relocation in ipairs( relocations ) do
+      local object = parentMap[ parentMap[ relocation ] ]
+      
+      if not seen[ object ] then
+        seen[ object ] = true
+        users[ name ][ #users[ name ] + 1 ] = object
+      end
+    end
+  end
+  
+  -- The trampoline and slot of an import, and the entry stub and slot of an
+  -- export, are split evenly between the objects that use the name. So are
+  -- the names, scaled so that they add up to the merged or front-coded size.
+  -- The resolver, the headers and the padding aren't anyone's.
+  local rawstrings = 0
+  
+  for name in pairs( users ) do
+    rawstrings = rawstrings + #name + 1
+  end
+  
+  local stringscale = rawstrings ~= 0 and stringsize / rawstrings or 0
+  
+  for name, list in pairs( users ) do
+    local trampoline = 0
+    
+    if unknownSymbolMap[ name ] then
+      trampoline = lazy and LAZY_STUB_SIZE + 8 or TRAMPOLINE_SIZE
+    elseif entryMap[ name ] then
+      trampoline = ENTRY_STUB_SIZE + 8
+    end
+    
+    for _, object in ipairs( list ) do
+      local size = objectSizes[ object ]
+      size.trampolines = ( size.trampolines or 0 ) + trampoline / #list
+      size.strings = ( size.strings or 0 ) + ( #name + 1 ) * stringscale / #list
+    end
+  end
+  
+  io.write( 'By object\n' )
+  
+  for _, object in ipairs( objectList ) do
+    local size = objectSizes[ object ]
+    
+    if size then
+      io.write( string.format( '  %s: code %u, data %u, bss %u, trampolines %u, strings %u\n', objectMap[ object ],
+        size.code, size.data, size.bss, math.floor( ( size.trampolines or 0 ) + 0.5 ), math.floor( ( size.strings or 0 ) + 0.5 ) ) )
+    else
+      io.write( string.format( '  %s: not linked\n', objectMap[ object ] ) )
+    end
+  end
+end
+
 --                  _
 --  _ __ ___   __ _(_)_ __  
 -- | '_ ` _ \ / _` | | '_ \ 
@@ -942,18 +2198,431 @@ end
 -- |_| |_| |_|\__,_|_|_| |_|
 --
 
-return function( args )
-  return parseArguments( args )
-      or loadObjects()
-      or buildParentMap()
-      or buildListOfSymbols()
-      or buildExportMap()
-      or buildListOfRequiredSections()
-      or buildOffsetMap()
-      or dumpSectionsToFlo()
-      or addTrampolines()
-      or relocate()
-      or buildSymbolTable()
-      or finishFlo()
-      or 0
+--                _ _       ____      _                 _        _     _       ___  _     _           _   
+-- __      ___ __(_) |_ ___|  _ \ ___| | ___   ___ __ _| |_ __ _| |__ | | ___ / _ \| |__ (_) ___  ___| |_ 
+-- \ \ /\ / / '__| | __/ _ \ |_) / _ \ |/ _ \ / __/ _` | __/ _` | '_ \| |/ _ \ | | | '_ \| |/ _ \/ __| __|
+--  \ V  V /| |  | | ||  __/  _ <  __/ | (_) | (_| (_| | || (_| | |_) | |  __/ |_| | |_) | |  __/ (__| |_ 
+--   \_/\_/ |_|  |_|\__\___|_| \_\___|_|\___/ \___\__,_|\__\__,_|_.__/|_|\___|\___/|_.__// |\___|\___|\__|
+--                                                                                     |__/               
+
+local function writeRelocatableObject()
+  -- Partial link: the required sections of each kind are merged into one
+  -- section, references between sections of the same kind are resolved, and
+  -- the others are left as relocations against the section symbols, since
+  -- the final link places each kind somewhere else. Exports stay external
+  -- symbols and imports stay undefined ones.
+  info( 'Writing relocatable object %s', outputFile )
+  
+  local REL32 = coff.relocationTypes.AMD64_REL32
+  local ADDR64 = coff.relocationTypes.AMD64_ADDR64
+  local EXTERNAL = coff.symbolStorageClasses.EXTERNAL
+  local STATIC = coff.symbolStorageClasses.STATIC
+  local chars = coff.sectionCharacteristics
+  
+  local outputs = {
+    [ KIND_CODE ] = { name = '.text', characteristics = bit32.bor( chars.CNT_CODE, chars.MEM_EXECUTE, chars.MEM_READ ) },
+    [ KIND_DATA ] = { name = '.data', characteristics = bit32.bor( chars.CNT_INITIALIZED_DATA, chars.MEM_READ, chars.MEM_WRITE ) },
+    [ KIND_BSS ] = { name = '.bss', characteristics = bit32.bor( chars.CNT_UNINITIALIZED_DATA, chars.MEM_READ, chars.MEM_WRITE ) }
+  }
+  
+  -- Evaluate the offsets of the sections inside their output sections
+  local ordered = {}
+  offsetMap = {}
+  
+  for kind = KIND_CODE, KIND_BSS do
+    local output = outputs[ kind ]
+    output.size = 0
+    output.alignment = 1
+    output.relocations = {}
+    
+    for _, section in ipairs( sectionList ) do
+      if sectionKind( section ) == kind then
+        local alignment = section:getAlignmentBytes()
+        output.size = bit32.band( output.size + alignment - 1, bit32.bnot( alignment - 1 ) )
+        output.alignment = math.max( output.alignment, alignment )
+        output.used = true
+        offsetMap[ section ] = output.size
+        info( '\tSection %s is at %s+0x%08x', sectionNameMap[ section ], output.name, output.size )
+        output.size = output.size + section:getSizeOfRawData()
+        ordered[ #ordered + 1 ] = section
+      end
+    end
+  end
+  
+  for section, canonical in pairs( mergeMap ) do
+    offsetMap[ section ] = offsetMap[ canonical ]
+  end
+  
+  -- Only the kinds that have sections get an output section, numbered from 1
+  local list = {}
+  
+  for kind = KIND_CODE, KIND_BSS do
+    if outputs[ kind ].used then
+      list[ #list + 1 ] = outputs[ kind ]
+      outputs[ kind ].number = #list
+    end
+  end
+  
+  -- The file header and the section headers are written last
+  local object = coff.newBuffer()
+  object:grow( 20 + 40 * #list )
+  
+  for _, output in ipairs( list ) do
+    if output ~= outputs[ KIND_BSS ] then
+      object:align( output.alignment )
+      output.pointer = object:getSize()
+    end
+    
+    for _, section in ipairs( ordered ) do
+      if outputs[ sectionKind( section ) ] == output and output.pointer then
+        object:grow( output.pointer + offsetMap[ section ] - object:getSize() )
+        object:appendRaw( section:getRawData() )
+      end
+    end
+    
+    if output.pointer then
+      object:grow( output.pointer + output.size - object:getSize() )
+    end
+  end
+  
+  -- Symbols: the section symbols, the exports and the imports
+  local symbols = {}
+  local importIndex = {}
+  
+  for _, output in ipairs( list ) do
+    symbols[ #symbols + 1 ] = { name = output.name, value = 0, number = output.number, type = 0, class = STATIC }
+    output.symbol = #symbols - 1
+  end
+  
+  for _, name in ipairs( sortedKeys( exportMap ) ) do
+    local symbol = exportMap[ name ]
+    local section = parentMap[ symbol ]:getSection( symbol:getSectionNumber() )
+    local value = offsetMap[ section ] + symbol:getValue()
+    symbols[ #symbols + 1 ] = { name = name, value = value, number = outputs[ sectionKind( section ) ].number, type = symbol:getType(), class = EXTERNAL }
+    info( '\tExporting %s at %s+0x%08x', name, outputs[ sectionKind( section ) ].name, value )
+  end
+  
+  for _, name in ipairs( sortedKeys( unknownSymbolMap ) ) do
+    symbols[ #symbols + 1 ] = { name = name, value = 0, number = 0, type = 0, class = EXTERNAL }
+    importIndex[ name ] = #symbols - 1
+    info( '\tImporting %s', name )
+  end
+  
+  -- Relocations
+  for _, section in ipairs( ordered ) do
+    local parent = parentMap[ section ]
+    local output = outputs[ sectionKind( section ) ]
+    
+    for _, relocation in section:relocations() do
+      local symbol = parent:getSymbol( relocation:getSymbolTableIndex() )
+      local name = symbol:getName()
+      local site = offsetMap[ section ] + relocation:getVirtualAddress()
+      
+      local type = relocation:getType()
+      
+      if type ~= REL32 and type ~= ADDR64 then
+        io.stderr:write( string.format( 'Error: Invalid relocation type 0x%04x for symbol %s\n', type, name ) )
+        return -1
+      end
+      
+      -- Symbols defined in the object go through their own section, like in
+      -- relocate, so that statics of the same name in different objects stay
+      -- apart, and the others through the known symbols
+      local own = symbol:getSectionNumber() >= 1 and parent:getSection( symbol:getSectionNumber() )
+      local defined = own and offsetMap[ own ] and symbol
+      
+      if not defined and importIndex[ name ] then
+        output.relocations[ #output.relocations + 1 ] = { site = site, symbol = importIndex[ name ], type = type }
+      else
+        defined = defined or knownSymbolMap[ name ] or symbol
+        local index = defined:getSectionNumber()
+        local target = index >= 1 and parentMap[ defined ]:getSection( index )
+        
+        if not target or not offsetMap[ target ] then
+          io.stderr:write( 'Error: Symbol ', name, ' used in ', sectionNameMap[ section ], ' is in a section left out of the link\n' )
+          return -1
+        end
+        
+        local address = offsetMap[ target ] + defined:getValue() + object:get32( output.pointer + site )
+        local targetOutput = outputs[ sectionKind( target ) ]
+        
+        if type == ADDR64 then
+          -- Absolute addresses always wait for the final link, with a signed
+          -- 64-bit addend
+          local high = object:get32( output.pointer + site + 4 )
+          address = address + ( high < 0x80000000 and high or high - 0x100000000 ) * 0x100000000
+          object:set32( output.pointer + site, address % 0x100000000 )
+          object:set32( output.pointer + site + 4, address < 0 and 0xffffffff or 0 )
+          output.relocations[ #output.relocations + 1 ] = { site = site, symbol = targetOutput.symbol, type = ADDR64 }
+        elseif targetOutput == output then
+          object:set32( output.pointer + site, address - ( site + 4 ) )
+        else
+          object:set32( output.pointer + site, address )
+          output.relocations[ #output.relocations + 1 ] = { site = site, symbol = targetOutput.symbol, type = REL32 }
+        end
+      end
+    end
+  end
+  
+  for _, output in ipairs( list ) do
+    if #output.relocations > 65535 then
+      io.stderr:write( 'Error: Too many relocations in ', output.name, '\n' )
+      return -1
+    end
+    
+    output.relocationPointer = object:getSize()
+    
+    for _, relocation in ipairs( output.relocations ) do
+      object:append32( relocation.site )
+      object:append32( relocation.symbol )
+      object:append16( relocation.type )
+    end
+  end
+  
+  -- The symbol table, names longer than 8 bytes go to the string table
+  local symbolTable = object:getSize()
+  local strings = {}
+  local stringsSize = 4
+  
+  local function appendName( name )
+    if #name <= 8 then
+      for i = 1, 8 do
+        object:append8( name:byte( i ) or 0 )
+      end
+    else
+      object:append32( 0 )
+      object:append32( stringsSize )
+      strings[ #strings + 1 ] = name
+      stringsSize = stringsSize + #name + 1
+    end
+  end
+  
+  for _, symbol in ipairs( symbols ) do
+    appendName( symbol.name )
+    object:append32( symbol.value )
+    object:append16( symbol.number )
+    object:append16( symbol.type )
+    object:append8( symbol.class )
+    object:append8( 0 )
+  end
+  
+  object:append32( stringsSize )
+  
+  for _, name in ipairs( strings ) do
+    object:appendString( name )
+  end
+  
+  -- The headers
+  object:set16( 0, machine )
+  object:set16( 2, #list )
+  object:set32( 4, 0 )
+  object:set32( 8, symbolTable )
+  object:set32( 12, #symbols )
+  object:set16( 16, 0 )
+  object:set16( 18, 0 )
+  
+  for i, output in ipairs( list ) do
+    local header = 20 + 40 * ( i - 1 )
+    local log2 = 0
+    
+    while bit32.lshift( 1, log2 ) < output.alignment do
+      log2 = log2 + 1
+    end
+    
+    for j = 1, 8 do
+      object:set8( header + j - 1, output.name:byte( j ) or 0 )
+    end
+    
+    object:set32( header + 8, 0 )
+    object:set32( header + 12, 0 )
+    object:set32( header + 16, output.size )
+    object:set32( header + 20, output.pointer or 0 )
+    object:set32( header + 24, #output.relocations ~= 0 and output.relocationPointer or 0 )
+    object:set32( header + 28, 0 )
+    object:set16( header + 32, #output.relocations )
+    object:set16( header + 34, 0 )
+    object:set32( header + 36, bit32.bor( output.characteristics, bit32.lshift( log2 + 1, 20 ) ) )
+  end
+  
+  local file, err = io.open( outputFile, 'wb' )
+  
+  if not file then
+    io.stderr:write( 'Error: ', err, '\n' )
+    return -1
+  end
+  
+  file:write( object:get() )
+  file:close()
+end
+
+--                _ _       ____                  _ _      
+-- __      ___ __(_) |_ ___| __ ) _   _ _ __   __| | | ___ 
+-- \ \ /\ / / '__| | __/ _ \  _ \| | | | '_ \ / _` | |/ _ \
+--  \ V  V /| |  | | ||  __/ |_) | |_| | | | | (_| | |  __/
+--   \_/\_/ |_|  |_|\__\___|____/ \__,_|_| |_|\__,_|_|\___|
+--                                                         
+
+local function writeBundle()
+  -- Packs linked modules as they are into one file: a header, a directory
+  -- of name, offset, size and build id sorted by name, the names, and the
+  -- modules, so that hosts open and map a single file
+  info( 'Writing bundle %s', outputFile )
+  
+  local function get32( contents, offset )
+    local b1, b2, b3, b4 = contents:byte( offset + 1, offset + 4 )
+    return b1 + b2 * 0x100 + b3 * 0x10000 + b4 * 0x1000000
+  end
+  
+  local modules = {}
+  local names = {}
+  
+  for _, inputFile in ipairs( inputFileList ) do
+    local file, err = io.open( inputFile, 'rb' )
+    
+    if not file then
+      io.stderr:write( 'Error: ', err, '\n' )
+      return -1
+    end
+    
+    local contents = file:read( '*a' )
+    file:close()
+    
+    if #contents < FLO_HEADER_SIZE or get32( contents, #contents - 4 ) ~= bit32.bor( FLO_MAGIC, bit32.lshift( FLO_VERSION, 24 ) ) then
+      io.stderr:write( 'Error: ', inputFile, ' is not a module of the current version\n' )
+      return -1
+    end
+    
+    -- Modules are found by their file name without the folders and the
+    -- extension
+    local name = inputFile:gsub( '^.*[/\\]', '' ):gsub( '%.flo$', '' )
+    
+    if names[ name ] then
+      io.stderr:write( 'Error: Duplicate module name ', name, ' in ', inputFile, '\n' )
+      return -1
+    end
+    
+    names[ name ] = true
+    -- The build id is the thirteenth field of the header
+    modules[ #modules + 1 ] = { name = name, contents = contents, buildid = get32( contents, #contents - FLO_HEADER_SIZE + 48 ) }
+  end
+  
+  table.sort( modules, function( a, b ) return a.name < b.name end )
+  
+  local directory = coff.newBuffer()
+  directory:append32( FLO_BUNDLE_MAGIC )
+  directory:append32( FLO_BUNDLE_VERSION )
+  directory:append32( #modules )
+  directory:grow( FLO_BUNDLE_ENTRY_SIZE * #modules )
+  
+  for i, module in ipairs( modules ) do
+    directory:set32( FLO_BUNDLE_HEADER_SIZE + FLO_BUNDLE_ENTRY_SIZE * ( i - 1 ), directory:getSize() )
+    directory:appendString( module.name )
+  end
+  
+  local offset = directory:getSize()
+  
+  for i, module in ipairs( modules ) do
+    local entry = FLO_BUNDLE_HEADER_SIZE + FLO_BUNDLE_ENTRY_SIZE * ( i - 1 )
+    offset = bit32.band( offset + FLO_BUNDLE_ALIGNMENT - 1, bit32.bnot( FLO_BUNDLE_ALIGNMENT - 1 ) )
+    module.offset = offset
+    directory:set32( entry + 4, offset )
+    directory:set32( entry + 8, #module.contents )
+    directory:set32( entry + 12, module.buildid )
+    info( '\tModule %s is at 0x%08x, %u bytes, build id 0x%08x', module.name, offset, #module.contents, module.buildid )
+    offset = offset + #module.contents
+    
+    if offset >= 0x100000000 then
+      io.stderr:write( 'Error: Bundle is bigger than 4 GB\n' )
+      return -1
+    end
+  end
+  
+  local file, err = io.open( outputFile, 'wb' )
+  
+  if not file then
+    io.stderr:write( 'Error: ', err, '\n' )
+    return -1
+  end
+  
+  local here = directory:getSize()
+  file:write( directory:get() )
+  
+  for _, module in ipairs( modules ) do
+    file:write( string.rep( '\0', module.offset - here ), module.contents )
+    here = module.offset + #module.contents
+  end
+  
+  file:close()
+end
+
+local phases = {
+  { name = 'parseArguments',              func = parseArguments },
+  { name = 'loadObjects',                 func = loadObjects },
+  { name = 'buildParentMap',              func = buildParentMap },
+  { name = 'buildListOfSymbols',          func = buildListOfSymbols },
+  { name = 'buildExportMap',              func = buildExportMap },
+  { name = 'buildListOfRequiredSections', func = buildListOfRequiredSections },
+  { name = 'mergeReadOnlySections',       func = mergeReadOnlySections },
+  { name = 'buildListOfImports',          func = buildListOfImports },
+  { name = 'buildOffsetMap',              func = buildOffsetMap,         link = true },
+  { name = 'dumpSectionsToFlo',           func = dumpSectionsToFlo,      link = true },
+  { name = 'addTrampolines',              func = addTrampolines,         link = true },
+  { name = 'relocate',                    func = relocate,               link = true },
+  { name = 'buildSymbolTable',            func = buildSymbolTable,       link = true },
+  { name = 'finishFlo',                   func = finishFlo,              link = true },
+  { name = 'printSizeReport',             func = printSizeReport,        link = true },
+  { name = 'writeRelocatableObject',      func = writeRelocatableObject, partial = true },
+  { name = 'writeBundle',                 func = writeBundle,            bundle = true }
+}
+
+return function( args, cache, memory )
+  objectCache = cache
+  memoryLink = memory
+  local timings = {}
+  local total = os.clock()
+  
+  for _, phase in ipairs( phases ) do
+    -- -r skips the phases that build the .flo, and the other way around,
+    -- --bundle only reads the arguments and packs the modules
+    local skip
+    
+    if phase.func == parseArguments then
+      skip = false
+    elseif bundle then
+      skip = not phase.bundle
+    else
+      skip = phase.bundle or ( phase.link and partial ) or ( phase.partial and not partial )
+    end
+    
+    if not skip then
+      local start = os.clock()
+      local _, _, _, allocatorStart = flolink.memory()
+      local ret = phase.func( args )
+      timings[ #timings + 1 ] = { name = phase.name, time = os.clock() - start }
+      
+      -- Only measured with -v, reading the clock on every allocation isn't free
+      flolink.trackAllocator( verbose )
+      
+      if verbose then
+        local inuse, peak, reserved, allocatorTime, rss = flolink.memory()
+        info( '%s: %.6f s in the allocator, %u KB in use, %u KB peak, %u KB reserved, %u KB peak RSS',
+          phase.name, allocatorTime - allocatorStart, math.floor( inuse / 1024 ), math.floor( peak / 1024 ), math.floor( reserved / 1024 ), math.floor( rss ) )
+      end
+      
+      if ret then
+        return ret
+      end
+    end
+  end
+  
+  if timing then
+    -- One "phase seconds" pair per line so scripts can parse it
+    for _, t in ipairs( timings ) do
+      io.write( string.format( '%s %.6f\n', t.name, t.time ) )
+    end
+    
+    io.write( string.format( 'total %.6f\n', os.clock() - total ) )
+  end
+  
+  return 0
 end
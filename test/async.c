@@ -0,0 +1,141 @@
+// Driver of floasync.c (Linux).
+//
+// Queues many loads of a module on a few workers, cancels every third job
+// right after queueing it, and waits for all of them. Modules are bound
+// through the loader of a floregistry.c registry that they all share. A job
+// that was cancelled must end with FLO_ERROR_CANCELLED and no module, the
+// others with FLO_OK and a module of the right size, and on_ready must run
+// once per job with the same result. Prints how long the whole batch took,
+// in the "name seconds" format of benchflo.
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <floasync.h>
+#include <floregistry.h>
+
+typedef struct
+{
+  flo_job_t*  job;
+  int         cancelled;
+  atomic_int  ready;
+  int         status;
+  void*       flo;
+  unsigned    size;
+}
+job_t;
+
+static flo_loader_t registry_loader;
+
+static double now( void )
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uintptr_t async_get_symbol( void* ud, flo_key_t key )
+{
+  uintptr_t address = registry_loader.get_symbol( ud, key );
+  
+  // Symbols not exported by the module stand for host functions.
+  return address != 0 ? address : (uintptr_t)async_get_symbol;
+}
+
+static void on_ready( void* ud, flo_job_t* job, int status, void* flo, unsigned int size )
+{
+  job_t* j = (job_t*)ud;
+  
+  (void)job;
+  j->status = status;
+  j->flo = flo;
+  j->size = size;
+  atomic_fetch_add( &j->ready, 1 );
+}
+
+int main( int argc, const char* argv[] )
+{
+  if ( argc < 2 )
+  {
+    fprintf( stderr, "Usage: asyncflo file.flo [jobs] [threads]\n" );
+    return 1;
+  }
+  
+  int numjobs = argc > 2 ? atoi( argv[ 2 ] ) : 64;
+  int numthreads = argc > 3 ? atoi( argv[ 3 ] ) : 4;
+  unsigned size;
+  void* flo = flo_load_compressed( argv[ 1 ], &size );
+  
+  if ( flo == NULL )
+  {
+    fprintf( stderr, "Error: Could not load %s\n", argv[ 1 ] );
+    return 1;
+  }
+  
+  flo_free_image( flo, size );
+  numjobs = numjobs > 0 ? numjobs : 1;
+  
+  flo_registry_t* registry = flo_registry_new( 0 );
+  flo_async_t* async = flo_async_new( numthreads > 0 ? numthreads : 1 );
+  job_t* jobs = (job_t*)calloc( numjobs, sizeof( job_t ) );
+  
+  if ( registry == NULL || async == NULL || jobs == NULL )
+  {
+    fprintf( stderr, "Error: Out of memory\n" );
+    return 1;
+  }
+  
+  // Every module defines the same exports, the registry keeps the last ones.
+  flo_registry_loader( registry, &registry_loader );
+  flo_loader_t loader = { async_get_symbol, registry_loader.put_symbol, registry };
+  int i, cancelled = 0, loaded = 0, errors = 0;
+  double start = now();
+  
+  for ( i = 0; i < numjobs; i++ )
+  {
+    jobs[ i ].job = flo_load_async( async, argv[ 1 ], &loader, on_ready, jobs + i );
+    
+    if ( jobs[ i ].job == NULL )
+    {
+      fprintf( stderr, "Error: Out of memory\n" );
+      return 1;
+    }
+    
+    if ( i % 3 == 2 )
+    {
+      jobs[ i ].cancelled = flo_async_cancel( jobs[ i ].job );
+      cancelled += jobs[ i ].cancelled;
+    }
+  }
+  
+  for ( i = 0; i < numjobs; i++ )
+  {
+    void* module;
+    unsigned modulesize;
+    int status = flo_async_wait( jobs[ i ].job, &module, &modulesize );
+    int expected = jobs[ i ].cancelled ? FLO_ERROR_CANCELLED : FLO_OK;
+    
+    if ( status != expected || atomic_load( &jobs[ i ].ready ) != 1 || jobs[ i ].status != status || jobs[ i ].flo != module || jobs[ i ].size != modulesize || ( module != NULL ) != ( status == FLO_OK ) || ( module != NULL && modulesize != size ) )
+    {
+      fprintf( stderr, "Error: Job %d ended with %d, expected %d\n", i, status, expected );
+      errors++;
+    }
+    
+    if ( module != NULL )
+    {
+      loaded++;
+      flo_free_image( module, modulesize );
+    }
+  }
+  
+  double end = now();
+  flo_async_delete( async );
+  flo_registry_delete( registry );
+  free( jobs );
+  
+  fprintf( stderr, "%d jobs, %d cancelled, %d loaded, %d errors\n", numjobs, cancelled, loaded, errors );
+  printf( "total %.9f\n", end - start );
+  return errors != 0;
+}
@@ -0,0 +1,395 @@
+// Load latency harness for .flo modules (Linux).
+//
+// Loads, relocates and unloads a .flo in a loop, and reports the p50 and p99
+// latencies of the whole cycle and of each of its phases. Build it with
+// -DFLO_HASHED_SYMBOLS for modules linked with flolink -h. Version 1 modules
+// are read into the heap with flo_load, current ones are loaded with
+// flo_load_compressed, or with flo_pool_load if the third argument is pool,
+// in which case the walk includes flo_pool_seal. With bundle and a file
+// written by flolink --bundle, they're instantiated from the module of the
+// bundle named after the .flo, which must be byte-identical to what
+// flo_load_compressed gives. With perf, the functions of modules linked with
+// flolink --function-table are added to the perf map once relocated and
+// removed before unloading.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <floregistry.h>
+
+enum
+{
+  PHASE_READ,      // flo_load, flo_load_compressed, flo_pool_load or flo_bundle_instantiate
+  PHASE_WALK,      // flo_relocate_ctx minus the time spent in the callbacks and clearing .bss
+  PHASE_CALLBACKS, // put_symbol and get_symbol
+  PHASE_BSS,       // clearing .bss (version 1 modules only)
+  PHASE_UNLOAD,    // freeing the module and forgetting its symbols
+  PHASE_PERF,      // flo_perf_map_add and flo_perf_map_remove
+  PHASE_TOTAL,
+  PHASE_COUNT
+};
+
+static const char* phase_names[ PHASE_COUNT ] = { "read", "walk", "callbacks", "bss", "unload", "perf", "total" };
+
+static double now( void )
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The callbacks use the registry of floregistry.c, so that they do what a
+// real host would do: exports are inserted, imports are looked up.
+static flo_registry_t* registry;
+
+static double callback_time;
+static double timer_overhead;
+
+static uintptr_t bench_get_symbol( void* ud, flo_key_t key )
+{
+  double start = now();
+  uintptr_t address = flo_registry_get( (flo_registry_t*)ud, key );
+  
+  // Symbols not exported by the module stand for host functions.
+  if ( address == 0 )
+  {
+    address = (uintptr_t)bench_get_symbol;
+  }
+  
+  callback_time += now() - start - timer_overhead;
+  return address;
+}
+
+static int bench_put_symbol( void* ud, flo_key_t key, uintptr_t address )
+{
+  double start = now();
+  int ok = flo_registry_put( (flo_registry_t*)ud, key, address );
+  
+  callback_time += now() - start - timer_overhead;
+  return ok;
+}
+
+void* flo_load( const char* name, unsigned int* size )
+{
+  FILE* file = fopen( name, "rb" );
+  
+  if ( file != NULL )
+  {
+    fseek( file, 0, SEEK_END );
+    *size = ftell( file );
+    fseek( file, 0, SEEK_SET );
+    
+    void* flo = malloc( *size );
+    
+    if ( flo )
+    {
+      fread( flo, 1, *size, file );
+      fclose( file );
+      return flo;
+    }
+    
+    fclose( file );
+  }
+  
+  return NULL;
+}
+
+// Opens a bundle and finds the module named after the .flo file, exits if it can't.
+static const flo_bundle_entry_t* find_module( const char* bundlename, const char* name, flo_bundle_t** bundle )
+{
+  const char* base = strrchr( name, '/' );
+  char module[ 256 ];
+  
+  base = base != NULL ? base + 1 : name;
+  snprintf( module, sizeof( module ), "%s", base );
+  
+  if ( strlen( module ) > 4 && !strcmp( module + strlen( module ) - 4, ".flo" ) )
+  {
+    module[ strlen( module ) - 4 ] = 0;
+  }
+  
+  *bundle = flo_bundle_open( bundlename );
+  const flo_bundle_entry_t* entry = *bundle != NULL ? flo_bundle_find( *bundle, module ) : NULL;
+  
+  if ( entry == NULL )
+  {
+    fprintf( stderr, "Error: Could not find %s in %s\n", module, bundlename );
+    exit( 1 );
+  }
+  
+  return entry;
+}
+
+// Checks that the module instantiated from the bundle is the one loaded from its file.
+static int same_module( flo_bundle_t* bundle, const flo_bundle_entry_t* entry, const char* name )
+{
+  unsigned size, bundlesize;
+  void* flo = flo_load_compressed( name, &size );
+  void* instance = flo_bundle_instantiate( bundle, entry, NULL, &bundlesize );
+  int same = flo != NULL && instance != NULL && size == bundlesize && !memcmp( flo, instance, size );
+  
+  if ( flo != NULL )
+  {
+    flo_free_image( flo, size );
+  }
+  
+  if ( instance != NULL )
+  {
+    flo_free_image( instance, bundlesize );
+  }
+  
+  return same;
+}
+
+// The number of lines of the perf map that fall inside a module.
+static unsigned perf_map_lines( void* flo, unsigned size )
+{
+  char name[ 64 ];
+  char line[ 1024 ];
+  unsigned count = 0;
+  
+  snprintf( name, sizeof( name ), "/tmp/perf-%ld.map", (long)getpid() );
+  FILE* map = fopen( name, "r" );
+  
+  if ( map != NULL )
+  {
+    while ( fgets( line, sizeof( line ), map ) != NULL )
+    {
+      uintptr_t address = (uintptr_t)strtoull( line, NULL, 16 );
+      count += address >= (uintptr_t)flo && address < (uintptr_t)flo + size;
+    }
+    
+    fclose( map );
+  }
+  
+  return count;
+}
+
+static int compare_doubles( const void* a, const void* b )
+{
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return ( x > y ) - ( x < y );
+}
+
+int main( int argc, const char* argv[] )
+{
+  if ( argc < 2 || ( argc == 4 && !strcmp( argv[ 3 ], "bundle" ) ) )
+  {
+    fprintf( stderr, "Usage: benchflo file.flo [iterations] [pool | bundle file.flb | perf]\n" );
+    return 1;
+  }
+  
+  int iterations = argc > 2 ? atoi( argv[ 2 ] ) : 1000;
+  flo_pool_t* pool = argc > 3 && !strcmp( argv[ 3 ], "pool" ) ? flo_pool_new( 0 ) : NULL;
+  flo_bundle_t* bundle = NULL;
+  const flo_bundle_entry_t* entry = argc > 4 && !strcmp( argv[ 3 ], "bundle" ) ? find_module( argv[ 4 ], argv[ 1 ], &bundle ) : NULL;
+  int perf = argc > 3 && !strcmp( argv[ 3 ], "perf" );
+  double* samples[ PHASE_COUNT ];
+  int i, p;
+  
+  if ( iterations <= 0 )
+  {
+    iterations = 1;
+  }
+  
+  for ( p = 0; p < PHASE_COUNT; p++ )
+  {
+    samples[ p ] = (double*)malloc( iterations * sizeof( double ) );
+  }
+  
+  // Calibrate the cost of reading the timer twice, the callbacks do it on
+  // every call.
+  double start = now();
+  
+  for ( i = 0; i < 1000; i++ )
+  {
+    now();
+  }
+  
+  timer_overhead = ( now() - start ) / 1000;
+  
+  // Only version 1 modules can be relocated right from the file contents.
+  unsigned size;
+  void* flo = flo_load( argv[ 1 ], &size );
+  
+  if ( flo == NULL )
+  {
+    fprintf( stderr, "Error: Could not load %s\n", argv[ 1 ] );
+    return 1;
+  }
+  
+  int mapped = FLO_GET_VERSION( flo, size ) != 1;
+  free( flo );
+  
+  if ( entry != NULL && ( !mapped || !same_module( bundle, entry, argv[ 1 ] ) ) )
+  {
+    fprintf( stderr, "Error: %s differs from its module in %s\n", argv[ 1 ], argv[ 4 ] );
+    return 1;
+  }
+  
+  if ( perf && !mapped )
+  {
+    fprintf( stderr, "Error: Version 1 modules have no function table\n" );
+    return 1;
+  }
+  
+  for ( i = 0; i < iterations; i++ )
+  {
+    double t0 = now();
+    flo = !mapped ? flo_load( argv[ 1 ], &size ) : pool != NULL ? flo_pool_load( pool, argv[ 1 ], &size ) : entry != NULL ? flo_bundle_instantiate( bundle, entry, NULL, &size ) : flo_load_compressed( argv[ 1 ], &size );
+    double t1 = now();
+    
+    if ( flo == NULL )
+    {
+      fprintf( stderr, "Error: Could not load %s\n", argv[ 1 ] );
+      return 1;
+    }
+    
+    unsigned numsymbols;
+    void* bssstart;
+    unsigned bsssize;
+    
+    if ( FLO_GET_VERSION( flo, size ) == 1 )
+    {
+      flo_header_v1_t* header = FLO_V1_GET_HEADER( flo, size );
+      numsymbols = FLO_V1_GET_NUMSYMBOLS( header );
+      bssstart = FLO_GET_BSSOFFSET( header );
+      bsssize = FLO_GET_BSSSIZE( header );
+    }
+    else
+    {
+      // .bss comes zeroed from flo_load_compressed
+      flo_header_t* header = FLO_GET_HEADER( flo, size );
+      numsymbols = FLO_GET_NUMSYMBOLS( header );
+      bssstart = FLO_GET_BSSOFFSET( header );
+      bsssize = 0;
+      
+      if ( i == 0 && ( FLO_GET_FLAGS( header ) & FLO_FLAG_HUGEPAGE ) )
+      {
+        uint32_t flags = FLO_GET_FLAGS( header );
+        fprintf( stderr, "Huge page module loaded into %s\n", ( flags & FLO_FLAG_HUGETLB ) ? "MAP_HUGETLB pages" : ( flags & FLO_FLAG_THP ) ? "transparent huge pages" : "normal pages" );
+      }
+    }
+    
+    if ( registry == NULL )
+    {
+      registry = flo_registry_new( numsymbols );
+    }
+    
+    flo_loader_t loader = { bench_get_symbol, bench_put_symbol, registry };
+    
+    callback_time = 0;
+    int res = flo_relocate_ctx( &loader, flo, size );
+    
+    if ( res == FLO_OK && mapped && pool != NULL && !flo_pool_seal( pool ) )
+    {
+      fprintf( stderr, "Error: flo_pool_seal failed\n" );
+      return 1;
+    }
+    
+    double t2 = now();
+    
+    if ( res != FLO_OK )
+    {
+      fprintf( stderr, "Error: flo_relocate_ctx returned %d\n", res );
+      return 1;
+    }
+    
+    // flo_relocate_ctx clears .bss of version 1 modules as its last step, do the
+    // same work again to know how much of its time went there.
+    double t3 = now();
+    memset( bssstart, 0, bsssize );
+    double t4 = now();
+    double perf_time = 0;
+    
+    if ( perf )
+    {
+      unsigned numfuncs = FLO_GET_NUMFUNCTIONS( FLO_GET_HEADER( flo, size ) );
+      int added = flo_perf_map_add( flo, size );
+      double t6 = now();
+      
+      // Check the map once, outside of the timings.
+      if ( !added || ( i == 0 && ( numfuncs == 0 || perf_map_lines( flo, size ) != numfuncs ) ) )
+      {
+        fprintf( stderr, "Error: The functions of %s weren't added to the perf map\n", argv[ 1 ] );
+        return 1;
+      }
+      
+      double t7 = now();
+      int removed = flo_perf_map_remove( flo, size );
+      double t8 = now();
+      
+      if ( !removed || ( i == 0 && perf_map_lines( flo, size ) != 0 ) )
+      {
+        fprintf( stderr, "Error: The functions of %s weren't removed from the perf map\n", argv[ 1 ] );
+        return 1;
+      }
+      
+      perf_time = ( t6 - t4 ) + ( t8 - t7 );
+    }
+    
+    double unload = now();
+    
+    if ( mapped && pool != NULL )
+    {
+      flo_pool_free( pool, flo, size );
+    }
+    else if ( mapped )
+    {
+      flo_free_image( flo, size );
+    }
+    else
+    {
+      free( flo );
+    }
+    
+    flo_registry_delete( registry );
+    registry = flo_registry_new( numsymbols );
+    double t5 = now();
+    
+    double relocate = t2 - t1;
+    double bss = t4 - t3;
+    double walk = relocate - callback_time - bss;
+    
+    samples[ PHASE_READ ][ i ] = t1 - t0;
+    samples[ PHASE_WALK ][ i ] = walk > 0 ? walk : 0;
+    samples[ PHASE_CALLBACKS ][ i ] = callback_time;
+    samples[ PHASE_BSS ][ i ] = bss;
+    samples[ PHASE_UNLOAD ][ i ] = t5 - unload;
+    samples[ PHASE_PERF ][ i ] = perf_time;
+    samples[ PHASE_TOTAL ][ i ] = ( t2 - t0 ) + ( t5 - unload ) + perf_time;
+  }
+  
+  // Same "name seconds" format as flolink -t
+  for ( p = 0; p < PHASE_COUNT; p++ )
+  {
+    qsort( samples[ p ], iterations, sizeof( double ), compare_doubles );
+    printf( "%s.p50 %.9f\n", phase_names[ p ], samples[ p ][ iterations / 2 ] );
+    printf( "%s.p99 %.9f\n", phase_names[ p ], samples[ p ][ ( iterations * 99 ) / 100 ] );
+    free( samples[ p ] );
+  }
+  
+  flo_registry_delete( registry );
+  
+  if ( pool != NULL )
+  {
+    flo_pool_delete( pool );
+  }
+  
+  if ( bundle != NULL )
+  {
+    flo_bundle_close( bundle );
+  }
+  
+  if ( perf )
+  {
+    char name[ 64 ];
+    snprintf( name, sizeof( name ), "/tmp/perf-%ld.map", (long)getpid() );
+    remove( name );
+  }
+  
+  return 0;
+}
@@ -0,0 +1,107 @@
+#!/bin/sh
+# Links synthetic objects of increasing size and prints how long flolink takes
+# and how long loading the result takes with string and hashed symbols, as CSV
+# on stdout. Every knob can be overriden from the environment, i.e.
+# SIZES="10 100" ./bench.sh > results.csv
+
+FLOLINK=${FLOLINK:-../flolink.exe}
+MKCOFF=${MKCOFF:-./mkcoff}
+BENCHFLO=${BENCHFLO:-./benchflo}
+BENCHFLO_HASH=${BENCHFLO_HASH:-./benchflo-hash}
+ASYNCFLO=${ASYNCFLO:-./asyncflo}
+HASHFUNC=${HASHFUNC:-../djb2.lua}
+SIZES=${SIZES:-"10 100 1000 10000 100000"}
+FUNCTIONS=${FUNCTIONS:-10}
+FANOUT=${FANOUT:-2}
+BSS=${BSS:-0}
+ITERATIONS=${ITERATIONS:-100}
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+echo "symbols,objects,functions,fanout,imports,metric,seconds"
+
+for symbols in $SIZES; do
+  functions=$FUNCTIONS
+  [ "$symbols" -lt "$functions" ] && functions=$symbols
+  objects=$(( symbols / functions ))
+  imports=$(( symbols / 10 ))
+  prefix="$symbols,$objects,$functions,$FANOUT,$imports"
+  
+  rm -f "$WORK"/*
+  $MKCOFF -n $objects -m $functions -f $FANOUT -k $imports -b $BSS -o "$WORK/obj" || exit 1
+  
+  start=$(date +%s%N)
+  $FLOLINK -t -o "$WORK/bench.flo" "$WORK"/obj*.o > "$WORK/phases.txt" || exit 1
+  end=$(date +%s%N)
+  
+  echo "$prefix,flolink,$(echo $start $end | awk '{ printf "%.6f", ( $2 - $1 ) / 1e9 }')"
+  
+  while read phase seconds; do
+    echo "$prefix,flolink.$phase,$seconds"
+  done < "$WORK/phases.txt"
+  
+  $BENCHFLO "$WORK/bench.flo" $ITERATIONS > "$WORK/load.txt" || exit 1
+  
+  while read metric seconds; do
+    echo "$prefix,floload.string.$metric,$seconds"
+  done < "$WORK/load.txt"
+  
+  $BENCHFLO "$WORK/bench.flo" $ITERATIONS pool > "$WORK/load.txt" || exit 1
+  
+  while read metric seconds; do
+    echo "$prefix,floload.pool.$metric,$seconds"
+  done < "$WORK/load.txt"
+  
+  # ITERATIONS loads on 4 workers with a third of them cancelled, asyncflo
+  # fails if a job doesn't end the way it should
+  $ASYNCFLO "$WORK/bench.flo" $ITERATIONS 4 2> /dev/null > "$WORK/load.txt" || exit 1
+  
+  while read metric seconds; do
+    echo "$prefix,floload.async.$metric,$seconds"
+  done < "$WORK/load.txt"
+  
+  $FLOLINK -z -o "$WORK/bench-z.flo" "$WORK"/obj*.o || exit 1
+  $BENCHFLO "$WORK/bench-z.flo" $ITERATIONS > "$WORK/load.txt" || exit 1
+  
+  while read metric seconds; do
+    echo "$prefix,floload.z.$metric,$seconds"
+  done < "$WORK/load.txt"
+  
+  $FLOLINK -l -o "$WORK/bench-lazy.flo" "$WORK"/obj*.o || exit 1
+  $BENCHFLO "$WORK/bench-lazy.flo" $ITERATIONS > "$WORK/load.txt" || exit 1
+  
+  while read metric seconds; do
+    echo "$prefix,floload.lazy.$metric,$seconds"
+  done < "$WORK/load.txt"
+  
+  # The same modules instantiated from a bundle, benchflo checks that each
+  # one is byte-identical to the module loaded from its own file
+  $FLOLINK --front-code -o "$WORK/bench-fc.flo" "$WORK"/obj*.o || exit 1
+  $FLOLINK --bundle -o "$WORK/bench.flb" "$WORK/bench.flo" "$WORK/bench-z.flo" "$WORK/bench-lazy.flo" "$WORK/bench-fc.flo" || exit 1
+  $BENCHFLO "$WORK/bench.flo" $ITERATIONS bundle "$WORK/bench.flb" > "$WORK/load.txt" || exit 1
+  
+  while read metric seconds; do
+    echo "$prefix,floload.bundle.$metric,$seconds"
+  done < "$WORK/load.txt"
+  
+  for module in bench-z bench-lazy bench-fc; do
+    $BENCHFLO "$WORK/$module.flo" 1 bundle "$WORK/bench.flb" > /dev/null || exit 1
+  done
+  
+  # The perf map of a module with a function table, benchflo checks that its
+  # functions are added and removed
+  $FLOLINK --function-table -o "$WORK/bench-ft.flo" "$WORK"/obj*.o || exit 1
+  $BENCHFLO "$WORK/bench-ft.flo" $ITERATIONS perf > "$WORK/load.txt" || exit 1
+  
+  while read metric seconds; do
+    echo "$prefix,floload.perf.$metric,$seconds"
+  done < "$WORK/load.txt"
+  
+  $FLOLINK -h $HASHFUNC -o "$WORK/bench-hash.flo" "$WORK"/obj*.o || exit 1
+  $BENCHFLO_HASH "$WORK/bench-hash.flo" $ITERATIONS > "$WORK/load.txt" || exit 1
+  
+  while read metric seconds; do
+    echo "$prefix,floload.hash.$metric,$seconds"
+  done < "$WORK/load.txt"
+done
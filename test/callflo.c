@@ -0,0 +1,120 @@
+// Calls functions of a module and checks what they return (Linux).
+//
+// Loads a module with flo_load_compressed, relocates it with every import
+// bound to a stub, and calls each of the given exports as an int function of
+// no arguments, which must return the given value. Used by check.sh on the
+// objects of mkcoff -s, where f<n>_0 returns n.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <floload.h>
+
+typedef struct
+{
+  const char* name;
+  int         expected;
+  uintptr_t   address;
+}
+call_t;
+
+static call_t* calls;
+static int numcalls;
+
+static void stub( void )
+{
+}
+
+static uintptr_t get_symbol( void* ud, flo_key_t key )
+{
+  (void)ud;
+  (void)key;
+  return (uintptr_t)stub;
+}
+
+static int put_symbol( void* ud, flo_key_t key, uintptr_t address )
+{
+  int i;
+  
+  (void)ud;
+  
+  for ( i = 0; i < numcalls; i++ )
+  {
+    if ( !strcmp( calls[ i ].name, key ) )
+    {
+      calls[ i ].address = address;
+    }
+  }
+  
+  return 1;
+}
+
+int main( int argc, char* argv[] )
+{
+  if ( argc < 2 )
+  {
+    fprintf( stderr, "Usage: callflo file.flo [symbol=value...]\n" );
+    return 1;
+  }
+  
+  numcalls = argc - 2;
+  calls = (call_t*)calloc( numcalls + 1, sizeof( call_t ) );
+  
+  if ( calls == NULL )
+  {
+    fprintf( stderr, "Error: Out of memory\n" );
+    return 1;
+  }
+  
+  int i, errors = 0;
+  
+  for ( i = 0; i < numcalls; i++ )
+  {
+    char* equal = strchr( argv[ i + 2 ], '=' );
+    
+    if ( equal == NULL )
+    {
+      fprintf( stderr, "Error: Expected symbol=value, got %s\n", argv[ i + 2 ] );
+      return 1;
+    }
+    
+    *equal = 0;
+    calls[ i ].name = argv[ i + 2 ];
+    calls[ i ].expected = atoi( equal + 1 );
+  }
+  
+  unsigned size;
+  void* flo = flo_load_compressed( argv[ 1 ], &size );
+  flo_loader_t loader = { get_symbol, put_symbol, NULL };
+  
+  if ( flo == NULL || flo_relocate_ctx( &loader, flo, size ) != FLO_OK )
+  {
+    fprintf( stderr, "Error: Could not load %s\n", argv[ 1 ] );
+    return 1;
+  }
+  
+  for ( i = 0; i < numcalls; i++ )
+  {
+    int got;
+    
+    if ( calls[ i ].address == 0 )
+    {
+      fprintf( stderr, "Error: %s isn't exported\n", calls[ i ].name );
+      errors++;
+      continue;
+    }
+    
+    got = ( (int ( * )( void ))calls[ i ].address )();
+    
+    if ( got != calls[ i ].expected )
+    {
+      fprintf( stderr, "Error: %s returned %d, expected %d\n", calls[ i ].name, got, calls[ i ].expected );
+      errors++;
+    }
+  }
+  
+  flo_free_image( flo, size );
+  free( calls );
+  printf( "%d calls, %d errors\n", numcalls, errors );
+  return errors != 0;
+}
@@ -0,0 +1,25 @@
+#!/bin/sh
+# Links synthetic objects in the ways that have broken before and checks that
+# the modules still run. Exits with a non-zero status on the first failure.
+
+FLOLINK=${FLOLINK:-../flolink.exe}
+MKCOFF=${MKCOFF:-./mkcoff}
+CALLFLO=${CALLFLO:-./callflo}
+SWAPFLO=${SWAPFLO:-./swapflo}
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+# Every object has a static function named helper: each object must call its
+# own, both when linked directly and through a partial link with -r.
+$MKCOFF -n 2 -m 2 -s 1 -o "$WORK/static" || exit 1
+$FLOLINK -o "$WORK/static.flo" "$WORK/static0.o" "$WORK/static1.o" > /dev/null || exit 1
+$CALLFLO "$WORK/static.flo" f0_0=0 f1_0=1 || exit 1
+$FLOLINK -r -o "$WORK/static-r.o" "$WORK/static0.o" "$WORK/static1.o" > /dev/null || exit 1
+$FLOLINK -o "$WORK/static-r.flo" "$WORK/static-r.o" > /dev/null || exit 1
+$CALLFLO "$WORK/static-r.flo" f0_0=0 f1_0=1 || exit 1
+
+# A module swapped over and over must not pile up in memory: once quiesced,
+# only the first one, which published the entry stubs, stays retired.
+$FLOLINK --hotswap -o "$WORK/swap.flo" "$WORK/static0.o" "$WORK/static1.o" > /dev/null || exit 1
+$SWAPFLO "$WORK/swap.flo" 1000 f0_0=0 f1_0=1 || exit 1
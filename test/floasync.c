@@ -0,0 +1,320 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <floasync.h>
+
+/* Pages of .bss are touched at this stride. */
+#define FLO_ASYNC_PAGE_SIZE 4096
+
+typedef enum
+{
+  FLO_JOB_QUEUED,
+  FLO_JOB_LOADING,    /* Can still be cancelled. */
+  FLO_JOB_RELOCATING, /* The loader can know the exports, can't be cancelled anymore. */
+  FLO_JOB_DONE
+}
+flo_job_state_t;
+
+struct flo_job_t
+{
+  flo_job_t*      next;      /* In the queue. */
+  flo_async_t*    async;
+  char*           name;
+  flo_loader_t    loader;
+  flo_ready_t     on_ready;
+  void*           ud;
+  flo_job_state_t state;     /* Changed with the mutex of the pool held. */
+  int             cancelled;
+  int             status;
+  void*           flo;
+  unsigned int    size;
+};
+
+struct flo_async_t
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t  queued;    /* Signaled when a job is queued or the workers must stop. */
+  pthread_cond_t  done;      /* Broadcast when a job is done. */
+  flo_job_t*      head;
+  flo_job_t*      tail;
+  int             stopping;
+  unsigned int    numthreads;
+  pthread_t       threads[ 1 ];
+};
+
+/* Faults the pages of .bss in, the rest of the module was written by the loader already. */
+static void flo_prefault( void* flo, unsigned int size )
+{
+  flo_header_t* header = FLO_GET_HEADER( flo, size );
+  uintptr_t start = (uintptr_t)flo + FLO_GET_IMAGESIZE( header );
+  uintptr_t last = start + FLO_GET_BSSSIZE( header ) - 1;
+  uintptr_t page;
+  
+  if ( FLO_GET_BSSSIZE( header ) == 0 )
+  {
+    return;
+  }
+  
+  /* Writing makes the kernel give private pages instead of the shared zero page. .bss can start in the middle of a */
+  /* page that holds data, so that page is touched at its first byte and the next ones at their start, up to the */
+  /* page of its last byte. */
+  *(volatile uint8_t*)start = 0;
+  
+  for ( page = ( start & ~(uintptr_t)( FLO_ASYNC_PAGE_SIZE - 1 ) ) + FLO_ASYNC_PAGE_SIZE; page <= last; page += FLO_ASYNC_PAGE_SIZE )
+  {
+    *(volatile uint8_t*)page = 0;
+  }
+}
+
+/* Runs a job up to the point where it's done, without the mutex. */
+static void flo_async_run( flo_async_t* async, flo_job_t* job )
+{
+  unsigned int size;
+  void* flo = flo_load_compressed( job->name, &size );
+  int cancelled;
+  
+  if ( flo != NULL )
+  {
+    flo_prefault( flo, size );
+  }
+  
+  pthread_mutex_lock( &async->mutex );
+  cancelled = job->cancelled;
+  job->state = FLO_JOB_RELOCATING;
+  pthread_mutex_unlock( &async->mutex );
+  
+  if ( cancelled )
+  {
+    job->status = FLO_ERROR_CANCELLED;
+  }
+  else if ( flo == NULL )
+  {
+    job->status = FLO_ERROR_LOADING;
+  }
+  else
+  {
+    job->status = flo_relocate_ctx( &job->loader, flo, size );
+  }
+  
+  if ( job->status != FLO_OK && flo != NULL )
+  {
+    flo_free_image( flo, size );
+    flo = NULL;
+  }
+  
+  job->flo = flo;
+  job->size = flo != NULL ? size : 0;
+}
+
+/* Delivers the result of a job and wakes up its waiters. */
+static void flo_async_finish( flo_async_t* async, flo_job_t* job )
+{
+  if ( job->on_ready != NULL )
+  {
+    job->on_ready( job->ud, job, job->status, job->flo, job->size );
+  }
+  
+  pthread_mutex_lock( &async->mutex );
+  job->state = FLO_JOB_DONE;
+  pthread_cond_broadcast( &async->done );
+  pthread_mutex_unlock( &async->mutex );
+}
+
+static void* flo_async_worker( void* arg )
+{
+  flo_async_t* async = (flo_async_t*)arg;
+  
+  for ( ;; )
+  {
+    flo_job_t* job;
+    
+    pthread_mutex_lock( &async->mutex );
+    
+    while ( async->head == NULL && !async->stopping )
+    {
+      pthread_cond_wait( &async->queued, &async->mutex );
+    }
+    
+    if ( async->head == NULL )
+    {
+      pthread_mutex_unlock( &async->mutex );
+      return NULL;
+    }
+    
+    job = async->head;
+    async->head = job->next;
+    
+    if ( async->head == NULL )
+    {
+      async->tail = NULL;
+    }
+    
+    job->state = FLO_JOB_LOADING;
+    pthread_mutex_unlock( &async->mutex );
+    
+    flo_async_run( async, job );
+    flo_async_finish( async, job );
+  }
+}
+
+flo_async_t* flo_async_new( unsigned int numthreads )
+{
+  flo_async_t* async;
+  unsigned int i;
+  
+  numthreads = numthreads != 0 ? numthreads : 1;
+  async = (flo_async_t*)malloc( sizeof( flo_async_t ) + ( numthreads - 1 ) * sizeof( pthread_t ) );
+  
+  if ( async == NULL )
+  {
+    return NULL;
+  }
+  
+  pthread_mutex_init( &async->mutex, NULL );
+  pthread_cond_init( &async->queued, NULL );
+  pthread_cond_init( &async->done, NULL );
+  async->head = async->tail = NULL;
+  async->stopping = 0;
+  async->numthreads = 0;
+  
+  for ( i = 0; i < numthreads; i++ )
+  {
+    if ( pthread_create( async->threads + i, NULL, flo_async_worker, async ) != 0 )
+    {
+      flo_async_delete( async );
+      return NULL;
+    }
+    
+    async->numthreads++;
+  }
+  
+  return async;
+}
+
+void flo_async_delete( flo_async_t* async )
+{
+  unsigned int i;
+  
+  pthread_mutex_lock( &async->mutex );
+  async->stopping = 1;
+  pthread_cond_broadcast( &async->queued );
+  pthread_mutex_unlock( &async->mutex );
+  
+  for ( i = 0; i < async->numthreads; i++ )
+  {
+    pthread_join( async->threads[ i ], NULL );
+  }
+  
+  pthread_cond_destroy( &async->done );
+  pthread_cond_destroy( &async->queued );
+  pthread_mutex_destroy( &async->mutex );
+  free( async );
+}
+
+flo_job_t* flo_load_async( flo_async_t* async, const char* name, const flo_loader_t* loader, flo_ready_t on_ready, void* ud )
+{
+  size_t length = strlen( name ) + 1;
+  flo_job_t* job = (flo_job_t*)malloc( sizeof( flo_job_t ) + length );
+  
+  if ( job == NULL )
+  {
+    return NULL;
+  }
+  
+  /* The name is copied after the job, the caller's string can go away. */
+  job->next = NULL;
+  job->async = async;
+  job->name = (char*)( job + 1 );
+  memcpy( job->name, name, length );
+  job->loader = *loader;
+  job->on_ready = on_ready;
+  job->ud = ud;
+  job->state = FLO_JOB_QUEUED;
+  job->cancelled = 0;
+  job->status = FLO_OK;
+  job->flo = NULL;
+  job->size = 0;
+  
+  pthread_mutex_lock( &async->mutex );
+  
+  if ( async->tail != NULL )
+  {
+    async->tail->next = job;
+  }
+  else
+  {
+    async->head = job;
+  }
+  
+  async->tail = job;
+  pthread_cond_signal( &async->queued );
+  pthread_mutex_unlock( &async->mutex );
+  return job;
+}
+
+int flo_async_cancel( flo_job_t* job )
+{
+  flo_async_t* async = job->async;
+  
+  pthread_mutex_lock( &async->mutex );
+  
+  if ( job->state == FLO_JOB_LOADING )
+  {
+    /* The worker checks it once the file is loaded. */
+    job->cancelled = 1;
+    pthread_mutex_unlock( &async->mutex );
+    return 1;
+  }
+  
+  if ( job->state != FLO_JOB_QUEUED )
+  {
+    pthread_mutex_unlock( &async->mutex );
+    return 0;
+  }
+  
+  /* Take the job out of the queue, no worker will see it. */
+  flo_job_t** link = &async->head;
+  flo_job_t* previous = NULL;
+  
+  while ( *link != job )
+  {
+    previous = *link;
+    link = &previous->next;
+  }
+  
+  *link = job->next;
+  
+  if ( async->tail == job )
+  {
+    async->tail = previous;
+  }
+  
+  /* Another flo_async_cancel leaves it alone now. */
+  job->state = FLO_JOB_RELOCATING;
+  pthread_mutex_unlock( &async->mutex );
+  
+  job->status = FLO_ERROR_CANCELLED;
+  flo_async_finish( async, job );
+  return 1;
+}
+
+int flo_async_wait( flo_job_t* job, void** flo, unsigned int* size )
+{
+  flo_async_t* async = job->async;
+  int status;
+  
+  pthread_mutex_lock( &async->mutex );
+  
+  while ( job->state != FLO_JOB_DONE )
+  {
+    pthread_cond_wait( &async->done, &async->mutex );
+  }
+  
+  pthread_mutex_unlock( &async->mutex );
+  
+  status = job->status;
+  *flo = job->flo;
+  *size = job->size;
+  free( job );
+  return status;
+}
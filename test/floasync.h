@@ -0,0 +1,40 @@
+#ifndef FLOASYNC_H
+#define FLOASYNC_H
+
+#include <floload.h>
+
+/*
+Loads modules on a pool of worker threads, so that the thread that needs a
+module doesn't stall on the file, the page faults and the relocation. A job
+loads the file with flo_load_compressed, touches the pages of .bss so they're
+faulted in, and relocates the module with the loader given to
+flo_load_async, which is called from the workers and so must be
+thread-safe, like the one of flo_registry_loader. When the job is done, its
+on_ready callback runs with the result, on the worker, or in
+flo_async_cancel for jobs that hadn't started, and flo_async_wait returns
+it. The module then belongs to the host, which frees it with
+flo_free_image. Needs POSIX threads.
+*/
+typedef struct flo_async_t flo_async_t;
+typedef struct flo_job_t   flo_job_t;
+
+/* Called when a job is done, status is FLO_OK or an error, flo is NULL unless status is FLO_OK. */
+typedef void ( *flo_ready_t )( void* ud, flo_job_t* job, int status, void* flo, unsigned int size );
+
+/* Start a pool of numthreads workers, zero for one. Returns NULL if out of memory or if the threads can't be created. */
+flo_async_t* flo_async_new( unsigned int numthreads );
+/* Stop the workers, every job must have been waited for. */
+void         flo_async_delete( flo_async_t* async );
+/* Queue the load of a module, on_ready can be NULL. The loader is copied. Returns NULL if out of memory. */
+flo_job_t*   flo_load_async( flo_async_t* async, const char* name, const flo_loader_t* loader, flo_ready_t on_ready, void* ud );
+/*
+Cancel a job. A job that hasn't started is done right away with
+FLO_ERROR_CANCELLED, one that's loading the file stops before relocating,
+since after that the loader could already know its exports. Returns zero if
+the job will still deliver its module or already did.
+*/
+int          flo_async_cancel( flo_job_t* job );
+/* Wait for a job to be done and free it, returns its status and the module in flo and size. Every job must be waited for once. */
+int          flo_async_wait( flo_job_t* job, void** flo, unsigned int* size );
+
+#endif /* FLOASYNC_H */
@@ -0,0 +1,35 @@
+#include <stddef.h>
+#include <floload.h>
+
+/*
+flo_relocate and flo_relocate_prebind, on top of a loader that calls the
+flo_get_symbol and flo_put_symbol functions defined by the host. Hosts using
+flo_relocate_ctx don't need this file.
+*/
+
+static uintptr_t flo_global_get_symbol( void* ud, flo_key_t key )
+{
+  (void)ud;
+  return flo_get_symbol( key );
+}
+
+static int flo_global_put_symbol( void* ud, flo_key_t key, uintptr_t address )
+{
+  (void)ud;
+  return flo_put_symbol( key, address );
+}
+
+static const flo_loader_t flo_global_loader = { flo_global_get_symbol, flo_global_put_symbol, NULL };
+
+/* extra points here for front-coded modules. */
+static char flo_global_extra[ FLO_MAX_NAME_SIZE ];
+
+int flo_relocate( void* flo, unsigned int size, const char** extra )
+{
+  return flo_relocate_loader( &flo_global_loader, flo, size, 0, 0, extra, flo_global_extra );
+}
+
+int flo_relocate_prebind( void* flo, unsigned int size, uint32_t checksum, const char** extra )
+{
+  return flo_relocate_loader( &flo_global_loader, flo, size, 1, checksum, extra, flo_global_extra );
+}
@@ -1,11 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <floload.h>
 
-int flo_relocate( void* flo, unsigned int size, const char** extra )
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef FLO_HASHED_SYMBOLS
+#define FLO_SYMBOL_KEY( names, symbol )           FLO_GET_SYMBOL_HASH( symbol )
+#define FLO_SYMBOL_EXTRA( names, symbol, buffer ) NULL
+#define FLO_KEY_IS_VALID( key )                   1
+#else
+#define FLO_SYMBOL_KEY( names, symbol )           flo_symbol_name( names, symbol )
+#define FLO_SYMBOL_EXTRA( names, symbol, buffer ) flo_symbol_extra( names, symbol, buffer )
+#define FLO_KEY_IS_VALID( key )                   ( ( key ) != NULL )
+#endif
+
+/* extra is NULL when called by the reentrant API. */
+#define FLO_SET_EXTRA( extra, names, symbol, buffer ) do { if ( extra != NULL ) { *extra = FLO_SYMBOL_EXTRA( names, symbol, buffer ); } } while ( 0 )
+#define FLO_NO_EXTRA( extra )                         do { if ( extra != NULL ) { *extra = NULL; } } while ( 0 )
+
+/* Decodes front-coded names, going to the next name in a block only decodes that name. Version 1 modules pass NULL. */
+typedef struct
+{
+  const uint32_t* blocks; /* The block index, NULL if the names aren't front-coded. */
+  const uint8_t*  next;   /* The next name in the block. */
+  uint32_t        index;  /* The index of the next name, zero if there's no name in the buffer. */
+  uint32_t        count;  /* There are at most this many names, one per symbol. */
+  uint32_t        length; /* The length of the name in the buffer. */
+  char            name[ FLO_MAX_NAME_SIZE ];
+}
+flo_names_t;
+
+static void flo_names_init( flo_names_t* names, flo_header_t* header )
+{
+  names->blocks = ( FLO_GET_FLAGS( header ) & FLO_FLAG_FRONTCODED ) ? FLO_GET_NAMES( header ) : NULL;
+  names->index = 0;
+  names->count = FLO_GET_NUMEXPORTS( header ) + FLO_GET_NUMIMPORTS( header );
+}
+
+#ifndef FLO_HASHED_SYMBOLS
+/* Returns NULL if the name is corrupt: out of range, sharing more than the previous name, or too long. */
+static const char* flo_symbol_name( flo_names_t* names, const flo_symbol_t* symbol )
+{
+  uint32_t index = symbol->name;
+  
+  if ( names == NULL || names->blocks == NULL )
+  {
+    return FLO_GET_SYMBOL_NAME( symbol );
+  }
+  
+  if ( index >= names->count )
+  {
+    return NULL;
+  }
+  
+  /* Restart at the block of the name unless it's the one in the buffer or comes later in the same block. */
+  if ( names->index == 0 || index + 1 < names->index || index / FLO_NAMES_PER_BLOCK != ( names->index - 1 ) / FLO_NAMES_PER_BLOCK )
+  {
+    names->next = (const uint8_t*)names->blocks - names->blocks[ index / FLO_NAMES_PER_BLOCK ];
+    names->index = index - index % FLO_NAMES_PER_BLOCK;
+    names->length = 0;
+  }
+  
+  while ( names->index <= index )
+  {
+    uint32_t prefix = *names->next++;
+    char* name = names->name + prefix;
+    char* end = names->name + FLO_MAX_NAME_SIZE;
+    
+    if ( prefix > names->length )
+    {
+      names->index = 0;
+      return NULL;
+    }
+    
+    /* Copy the rest of the name, the terminator must fit too. */
+    while ( ( *name = (char)*names->next++ ) != 0 )
+    {
+      if ( ++name == end )
+      {
+        names->index = 0;
+        return NULL;
+      }
+    }
+    
+    names->length = (uint32_t)( name - names->name );
+    names->index++;
+  }
+  
+  return names->name;
+}
+
+static const char* flo_symbol_extra( flo_names_t* names, const flo_symbol_t* symbol, char* buffer )
+{
+  const char* name;
+  
+  if ( names == NULL || names->blocks == NULL )
+  {
+    return FLO_GET_SYMBOL_NAME( symbol );
+  }
+  
+  /* The decoder is gone once flo_relocate returns. */
+  name = flo_symbol_name( names, symbol );
+  return name != NULL ? strcpy( buffer, name ) : NULL;
+}
+#endif
+
+static int flo_relocate_v1( const flo_loader_t* loader, void* flo, unsigned int size, const char** extra, char* buffer )
 {
-  flo_header_t* header = FLO_GET_HEADER( flo, size );
-  flo_symbol_block_t* block = FLO_GET_FIRST_BLOCK( header );
-  flo_symbol_block_t* end = FLO_GET_LAST_BLOCK( header );
+  flo_header_v1_t* header = FLO_V1_GET_HEADER( flo, size );
+  flo_symbol_block_t* block = FLO_V1_GET_FIRST_BLOCK( header );
+  flo_symbol_block_t* end = FLO_V1_GET_LAST_BLOCK( header );
+  
+  /* Only used by FLO_SET_EXTRA for front-coded names, which version 1 modules don't have. */
+  (void)buffer;
   
   while ( block <= end )
   {
@@ -18,25 +133,20 @@ int flo_relocate( void* flo, unsigned int size, const char** extra )
       switch ( block->types[ i ] )
       {
       case FLO_EXPORTED:
+        if ( !loader->put_symbol( loader->ud, FLO_SYMBOL_KEY( NULL, symbol ), (uintptr_t)FLO_GET_SYMBOL_ADDRESS( symbol ) ) )
         {
-          const char* name = FLO_GET_SYMBOL_NAME( symbol );
-          
-          if ( !flo_put_symbol( name, (uintptr_t)FLO_GET_SYMBOL_ADDRESS( symbol ) ) )
-          {
-            *extra = name;
-            return FLO_ERROR_DEFINING_SYMBOL;
-          }
+          FLO_SET_EXTRA( extra, NULL, symbol, buffer );
+          return FLO_ERROR_DEFINING_SYMBOL;
         }
         break;
       
       case FLO_ADDR64:
         {
-          const char* name = FLO_GET_SYMBOL_NAME( symbol );
-          uintptr_t address = flo_get_symbol( name );
+          uintptr_t address = loader->get_symbol( loader->ud, FLO_SYMBOL_KEY( NULL, symbol ) );
           
           if ( address == 0 )
           {
-            *extra = name;
+            FLO_SET_EXTRA( extra, NULL, symbol, buffer );
             return FLO_SYMBOL_NOT_FOUND;
           }
           
@@ -46,9 +156,1521 @@ int flo_relocate( void* flo, unsigned int size, const char** extra )
       }
     }
     
-    block = FLO_GET_NEXT_BLOCK( block );
+    block = FLO_V1_GET_NEXT_BLOCK( block );
   }
   
   memset( FLO_GET_BSSOFFSET( header ), 0, FLO_GET_BSSSIZE( header ) );
   return FLO_OK;
 }
+
+/* Called by the resolver of lazy modules on the first call to an import. */
+static uintptr_t flo_bind( void* header, uintptr_t index )
+{
+  const flo_loader_t* loader = FLO_GET_BIND( (flo_header_t*)header )->loader;
+  flo_symbol_t* symbol = FLO_GET_IMPORTS( (flo_header_t*)header ) + index;
+  flo_names_t names;
+  flo_key_t key;
+  uintptr_t address;
+  
+  flo_names_init( &names, (flo_header_t*)header );
+  key = FLO_SYMBOL_KEY( &names, symbol );
+  address = FLO_KEY_IS_VALID( key ) ? loader->get_symbol( loader->ud, key ) : 0;
+  
+  if ( address == 0 )
+  {
+    abort();
+  }
+  
+  /* Later calls go straight to the import through the slot. */
+  FLO_RELOCATE_ADDR64( symbol, address );
+  return address;
+}
+
+static void flo_apply_fixups( uint8_t* image, const uint32_t* fixup, uint32_t count )
+{
+  uint64_t base = (uintptr_t)image;
+  uint64_t* where = NULL;
+  
+  for ( ; count != 0; count--, fixup++ )
+  {
+    uint32_t word = *fixup;
+    
+    if ( ( word & 1 ) == 0 )
+    {
+      where = (uint64_t*)( image + word );
+      *where++ += base;
+    }
+    else
+    {
+      uint64_t* slot = where;
+      
+      for ( word >>= 1; word != 0; word >>= 1, slot++ )
+      {
+        if ( word & 1 )
+        {
+          *slot += base;
+        }
+      }
+      
+      where += FLO_FIXUP_BITMAP_BITS;
+    }
+  }
+}
+
+/* Used by the functions below and by the global API in floglobal.c. */
+int flo_relocate_loader( const flo_loader_t* loader, void* flo, unsigned int size, int prebound, uint32_t checksum, const char** extra, char* buffer )
+{
+  flo_header_t* header;
+  flo_symbol_t* symbol;
+  flo_symbol_t* end;
+  flo_symbol_t* first_prebound;
+  flo_names_t names;
+  
+  switch ( FLO_GET_VERSION( flo, size ) )
+  {
+  case 1:           return flo_relocate_v1( loader, flo, size, extra, buffer );
+  case FLO_VERSION: break;
+  default:          FLO_NO_EXTRA( extra ); return FLO_ERROR_VERSION;
+  }
+  
+  header = FLO_GET_HEADER( flo, size );
+  
+  if ( FLO_GET_PACKEDSIZE( header ) != 0 )
+  {
+    FLO_NO_EXTRA( extra );
+    return FLO_ERROR_COMPRESSED;
+  }
+  
+  if ( FLO_GET_MEMSIZE( header ) != size )
+  {
+    FLO_NO_EXTRA( extra );
+    return FLO_ERROR_LAYOUT;
+  }
+  
+  flo_names_init( &names, header );
+  
+  /* Pointers inside the image first, exports can point to tables of them. */
+  flo_apply_fixups( (uint8_t*)flo, FLO_GET_FIXUPS( header ), FLO_GET_NUMFIXUPS( header ) );
+  
+  /* Imports first, so that exports are only published for a module that has all its dependencies. */
+  symbol = FLO_GET_IMPORTS( header );
+  end = symbol + FLO_GET_NUMIMPORTS( header );
+  first_prebound = end - FLO_GET_NUMPREBOUND( header );
+  
+  if ( FLO_GET_FLAGS( header ) & FLO_FLAG_LAZY )
+  {
+    flo_bind_t* bind = FLO_GET_BIND( header );
+    bind->bind = flo_bind;
+    bind->header = header;
+    bind->loader = loader;
+    
+    /* The slots have the offsets of their stubs, which go to the resolver. */
+    for ( ; symbol < first_prebound; symbol++ )
+    {
+      *(uint64_t*)FLO_GET_SYMBOL_ADDRESS( symbol ) += (uintptr_t)flo;
+    }
+  }
+  
+  /* Prebound imports already have the host addresses, bind them like the others if the manifest is different. */
+  if ( prebound && FLO_GET_CHECKSUM( header ) == checksum )
+  {
+    end = first_prebound;
+  }
+  
+  for ( ; symbol < end; symbol++ )
+  {
+    flo_key_t key = FLO_SYMBOL_KEY( &names, symbol );
+    uintptr_t address;
+    
+    if ( !FLO_KEY_IS_VALID( key ) )
+    {
+      FLO_NO_EXTRA( extra );
+      return FLO_ERROR_CORRUPT;
+    }
+    
+    address = loader->get_symbol( loader->ud, key );
+    
+    if ( address == 0 )
+    {
+      FLO_SET_EXTRA( extra, &names, symbol, buffer );
+      return FLO_SYMBOL_NOT_FOUND;
+    }
+    
+    FLO_RELOCATE_ADDR64( symbol, address );
+  }
+  
+  symbol = FLO_GET_EXPORTS( header );
+  end = symbol + FLO_GET_NUMEXPORTS( header );
+  
+  for ( ; symbol < end; symbol++ )
+  {
+    flo_key_t key = FLO_SYMBOL_KEY( &names, symbol );
+    
+    if ( !FLO_KEY_IS_VALID( key ) )
+    {
+      FLO_NO_EXTRA( extra );
+      return FLO_ERROR_CORRUPT;
+    }
+    
+    if ( !loader->put_symbol( loader->ud, key, (uintptr_t)FLO_GET_SYMBOL_ADDRESS( symbol ) ) )
+    {
+      FLO_SET_EXTRA( extra, &names, symbol, buffer );
+      return FLO_ERROR_DEFINING_SYMBOL;
+    }
+  }
+  
+  /* .bss is already zeroed, flo_load_compressed allocates fresh pages. */
+  return FLO_OK;
+}
+
+int flo_relocate_ctx( const flo_loader_t* loader, void* flo, unsigned int size )
+{
+  return flo_relocate_loader( loader, flo, size, 0, 0, NULL, NULL );
+}
+
+int flo_relocate_prebind_ctx( const flo_loader_t* loader, void* flo, unsigned int size, uint32_t checksum )
+{
+  return flo_relocate_loader( loader, flo, size, 1, checksum, NULL, NULL );
+}
+
+uint32_t flo_checksum( const void* data, unsigned int size )
+{
+  /* 32-bit FNV-1a, same as coff.checksum in luacoff.c */
+  const uint8_t* byte = (const uint8_t*)data;
+  uint32_t hash = 2166136261U;
+  
+  while ( size-- != 0 )
+  {
+    hash = ( hash ^ *byte++ ) * 16777619U;
+  }
+  
+  return hash;
+}
+
+/* Size of the mapping of a module, modules in huge pages take whole huge pages. */
+static size_t flo_mapping_size( unsigned int size, uint32_t flags )
+{
+  if ( flags & ( FLO_FLAG_HUGETLB | FLO_FLAG_THP ) )
+  {
+    return ( (size_t)size + FLO_HUGE_PAGE_SIZE - 1 ) & ~(size_t)( FLO_HUGE_PAGE_SIZE - 1 );
+  }
+  
+  return size;
+}
+
+/* Adds FLO_FLAG_HUGETLB or FLO_FLAG_THP to flags if the image got huge pages. */
+static void* flo_alloc_image( unsigned int size, uint32_t* flags )
+{
+#ifdef _WIN32
+  /* Large pages need SeLockMemoryPrivilege, huge page modules get normal pages. */
+  return VirtualAlloc( NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE );
+#else
+  void* flo;
+  
+  if ( *flags & FLO_FLAG_HUGEPAGE )
+  {
+    size_t hugesize = flo_mapping_size( size, FLO_FLAG_HUGETLB );
+    
+#ifdef MAP_HUGETLB
+    /* Pages from the hugetlbfs pool, which is usually empty unless the system reserved some. */
+    flo = mmap( NULL, hugesize, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+    
+    if ( flo != MAP_FAILED )
+    {
+      *flags |= FLO_FLAG_HUGETLB;
+      return flo;
+    }
+#endif
+    
+#ifdef MADV_HUGEPAGE
+    /* Transparent huge pages, which need the mapping to start at a huge page boundary. */
+    uint8_t* area = (uint8_t*)mmap( NULL, hugesize + FLO_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    
+    if ( area != (uint8_t*)MAP_FAILED )
+    {
+      uint8_t* aligned = (uint8_t*)( ( (uintptr_t)area + FLO_HUGE_PAGE_SIZE - 1 ) & ~(uintptr_t)( FLO_HUGE_PAGE_SIZE - 1 ) );
+      
+      if ( aligned != area )
+      {
+        munmap( area, aligned - area );
+      }
+      
+      munmap( aligned + hugesize, area + hugesize + FLO_HUGE_PAGE_SIZE - ( aligned + hugesize ) );
+      
+      if ( madvise( aligned, hugesize, MADV_HUGEPAGE ) == 0 )
+      {
+        *flags |= FLO_FLAG_THP;
+        return aligned;
+      }
+      
+      munmap( aligned, hugesize );
+    }
+#endif
+  }
+  
+  /* Normal pages. */
+  flo = mmap( NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+  return flo != MAP_FAILED ? flo : NULL;
+#endif
+}
+
+static void flo_unmap_image( void* flo, unsigned int size, uint32_t flags )
+{
+#ifdef _WIN32
+  (void)size;
+  (void)flags;
+  VirtualFree( flo, 0, MEM_RELEASE );
+#else
+  munmap( flo, flo_mapping_size( size, flags ) );
+#endif
+}
+
+void flo_free_image( void* flo, unsigned int size )
+{
+  flo_unmap_image( flo, size, FLO_GET_FLAGS( FLO_GET_HEADER( flo, size ) ) );
+}
+
+uint32_t flo_read_buildid( const char* name )
+{
+  FILE* file = fopen( name, "rb" );
+  flo_header_t header;
+  
+  if ( file == NULL )
+  {
+    return 0;
+  }
+  
+  if ( fseek( file, -(long)sizeof( header ), SEEK_END ) != 0 || fread( &header, 1, sizeof( header ), file ) != sizeof( header ) || header.version != ( FLO_MAGIC | FLO_VERSION << 24 ) )
+  {
+    fclose( file );
+    return 0;
+  }
+  
+  fclose( file );
+  return FLO_GET_BUILDID( &header );
+}
+
+/* Decompresses the output of flolink -z, see the compressor in luacoff.c. */
+static int flo_decompress( uint8_t* dest, unsigned int destsize, const uint8_t* src, unsigned int srcsize )
+{
+  uint8_t* op = dest;
+  uint8_t* oend = dest + destsize;
+  const uint8_t* ip = src;
+  const uint8_t* iend = src + srcsize;
+  
+  while ( ip < iend )
+  {
+    unsigned int token = *ip++;
+    unsigned int length = token >> 4;
+    
+    if ( length == 15 )
+    {
+      unsigned int byte;
+      
+      do
+      {
+        if ( ip >= iend )
+        {
+          return 0;
+        }
+        
+        byte = *ip++;
+        length += byte;
+      }
+      while ( byte == 255 );
+    }
+    
+    if ( length > (size_t)( iend - ip ) || length > (size_t)( oend - op ) )
+    {
+      return 0;
+    }
+    
+    memcpy( op, ip, length );
+    op += length;
+    ip += length;
+    
+    if ( ip == iend )
+    {
+      /* The last sequence has only literals. */
+      break;
+    }
+    
+    if ( iend - ip < 2 )
+    {
+      return 0;
+    }
+    
+    unsigned int offset = ip[ 0 ] | ip[ 1 ] << 8;
+    ip += 2;
+    length = ( token & 15 ) + 4;
+    
+    if ( ( token & 15 ) == 15 )
+    {
+      unsigned int byte;
+      
+      do
+      {
+        if ( ip >= iend )
+        {
+          return 0;
+        }
+        
+        byte = *ip++;
+        length += byte;
+      }
+      while ( byte == 255 );
+    }
+    
+    if ( offset == 0 || offset > (size_t)( op - dest ) || length > (size_t)( oend - op ) )
+    {
+      return 0;
+    }
+    
+    /* Matches can overlap the bytes they produce, so copy one byte at a time. */
+    const uint8_t* ref = op - offset;
+    
+    while ( length-- != 0 )
+    {
+      *op++ = *ref++;
+    }
+  }
+  
+  return op == oend;
+}
+
+/* Slots of FLO_POOL_MIN_SLOT_SIZE bytes up to half a page. */
+#define FLO_POOL_SLOT_CLASSES 4
+
+/* A page of a pool region. */
+typedef struct
+{
+  uint8_t  sealed;    /* Read-only and executable. */
+  uint8_t  dirty;     /* To be sealed by the next flo_pool_seal. */
+  uint8_t  slots;     /* A page of slots, else the first page of a run. */
+  uint8_t  sizeclass; /* Of the slots, or of the run. */
+  uint16_t used;      /* Slots handed out from the page. */
+  uint16_t live;      /* Slots that hold a module. */
+}
+flo_page_t;
+
+/* A region of a pool, mapped read-write, its pages are sealed by flo_pool_seal. */
+typedef struct flo_region_t
+{
+  struct flo_region_t* next;
+  uint8_t*             base;
+  flo_page_t           pages[ 1 ];
+}
+flo_region_t;
+
+/* Pages of a region to seal. */
+typedef struct
+{
+  flo_region_t* region;
+  uint32_t      first;
+  uint32_t      count;
+}
+flo_range_t;
+
+struct flo_pool_t
+{
+  void*         runs[ 32 ];                       /* Freed runs of each size class, read-write and linked through their first bytes. */
+  uint8_t*      slots[ FLO_POOL_SLOT_CLASSES ];   /* The pages of slots being filled for each class, NULL if none. */
+  flo_page_t*   current[ FLO_POOL_SLOT_CLASSES ]; /* The flo_page_t of each of them. */
+  flo_region_t* regions;
+  uint8_t*      next;                             /* Where the next run is carved out of the last region. */
+  uint8_t*      end;
+  unsigned int  regionsize;
+  flo_range_t*  dirty;                            /* Pages filled since the last flo_pool_seal. */
+  unsigned int  numdirty;
+  unsigned int  maxdirty;
+};
+
+/* Memory that isn't executable, the pages of a pool until they're sealed. */
+static void* flo_map_pages( size_t size )
+{
+#ifdef _WIN32
+  return VirtualAlloc( NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE );
+#else
+  void* pages = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+  return pages != MAP_FAILED ? pages : NULL;
+#endif
+}
+
+/* Makes pages read-only and executable, or read-write. */
+static int flo_protect( void* start, size_t size, int executable )
+{
+#ifdef _WIN32
+  DWORD old;
+  return VirtualProtect( start, size, executable ? PAGE_EXECUTE_READ : PAGE_READWRITE, &old ) != 0;
+#else
+  return mprotect( start, size, executable ? PROT_READ | PROT_EXEC : PROT_READ | PROT_WRITE ) == 0;
+#endif
+}
+
+/* The region an address is in, NULL if it's in a mapping of its own. */
+static flo_region_t* flo_pool_region( flo_pool_t* pool, const uint8_t* address )
+{
+  flo_region_t* region;
+  
+  for ( region = pool->regions; region != NULL; region = region->next )
+  {
+    if ( address >= region->base && address < region->base + pool->regionsize )
+    {
+      break;
+    }
+  }
+  
+  return region;
+}
+
+/* Makes the numpages pages at start read-write again if some of them were sealed. */
+static int flo_pool_unseal( flo_region_t* region, uint8_t* start, size_t numpages )
+{
+  flo_page_t* page = region->pages + ( start - region->base ) / FLO_POOL_PAGE_SIZE;
+  int sealed = 0;
+  size_t i;
+  
+  for ( i = 0; i < numpages; i++ )
+  {
+    sealed |= page[ i ].sealed;
+  }
+  
+  if ( !sealed )
+  {
+    return 1;
+  }
+  
+  if ( !flo_protect( start, numpages * FLO_POOL_PAGE_SIZE, 0 ) )
+  {
+    return 0;
+  }
+  
+  for ( i = 0; i < numpages; i++ )
+  {
+    page[ i ].sealed = 0;
+  }
+  
+  return 1;
+}
+
+/* Remembers to seal the numpages pages at start, growing the last range if they follow it. */
+static int flo_pool_dirty( flo_pool_t* pool, flo_region_t* region, uint8_t* start, size_t numpages )
+{
+  uint32_t first = (uint32_t)( ( start - region->base ) / FLO_POOL_PAGE_SIZE );
+  flo_range_t* last = pool->numdirty != 0 ? pool->dirty + pool->numdirty - 1 : NULL;
+  size_t i;
+  
+  for ( i = 0; i < numpages; i++ )
+  {
+    region->pages[ first + i ].dirty = 1;
+  }
+  
+  if ( numpages == 0 )
+  {
+    return 1;
+  }
+  
+  if ( last != NULL && last->region == region && last->first + last->count == first )
+  {
+    last->count += (uint32_t)numpages;
+    return 1;
+  }
+  
+  if ( pool->numdirty == pool->maxdirty )
+  {
+    unsigned int maxdirty = pool->maxdirty != 0 ? pool->maxdirty * 2 : 16;
+    flo_range_t* grown = (flo_range_t*)realloc( pool->dirty, maxdirty * sizeof( flo_range_t ) );
+    
+    if ( grown == NULL )
+    {
+      for ( i = 0; i < numpages; i++ )
+      {
+        region->pages[ first + i ].dirty = 0;
+      }
+      
+      return 0;
+    }
+    
+    pool->dirty = grown;
+    pool->maxdirty = maxdirty;
+  }
+  
+  pool->dirty[ pool->numdirty ].region = region;
+  pool->dirty[ pool->numdirty ].first = first;
+  pool->dirty[ pool->numdirty ].count = (uint32_t)numpages;
+  pool->numdirty++;
+  return 1;
+}
+
+/* A run of numpages pages carved out of the last region, or out of a new one. */
+static uint8_t* flo_pool_carve( flo_pool_t* pool, size_t numpages )
+{
+  size_t size = numpages * FLO_POOL_PAGE_SIZE;
+  uint8_t* run;
+  
+  if ( pool->next == NULL || size > (size_t)( pool->end - pool->next ) )
+  {
+    /* The rest of the last region is lost, runs never span regions. */
+    size_t regionpages = pool->regionsize / FLO_POOL_PAGE_SIZE;
+    flo_region_t* region = (flo_region_t*)calloc( 1, sizeof( flo_region_t ) + ( regionpages - 1 ) * sizeof( flo_page_t ) );
+    
+    if ( region == NULL || ( region->base = (uint8_t*)flo_map_pages( pool->regionsize ) ) == NULL )
+    {
+      free( region );
+      return NULL;
+    }
+    
+    region->next = pool->regions;
+    pool->regions = region;
+    pool->next = region->base;
+    pool->end = region->base + pool->regionsize;
+  }
+  
+  run = pool->next;
+  pool->next += size;
+  return run;
+}
+
+/*
+Memory for a module of size bytes at a page boundary, from a freed run of
+its class or from the last region. The pages of its first textsize bytes
+get sealed. The first page of the run goes in first.
+*/
+static uint8_t* flo_pool_alloc_run( flo_pool_t* pool, size_t size, size_t textsize, flo_page_t** first )
+{
+  size_t numpages = ( size + FLO_POOL_PAGE_SIZE - 1 ) / FLO_POOL_PAGE_SIZE;
+  int sizeclass = 0;
+  flo_region_t* region;
+  flo_page_t* page;
+  uint8_t* run;
+  
+  while ( ( (size_t)1 << sizeclass ) < numpages )
+  {
+    sizeclass++;
+  }
+  
+  numpages = (size_t)1 << sizeclass;
+  run = (uint8_t*)pool->runs[ sizeclass ];
+  
+  if ( run != NULL )
+  {
+    /* A freed run can have been sealed with the batch it was loaded in. */
+    region = flo_pool_region( pool, run );
+    
+    if ( !flo_pool_unseal( region, run, numpages ) )
+    {
+      return NULL;
+    }
+    
+    pool->runs[ sizeclass ] = *(void**)run;
+  }
+  else if ( ( run = flo_pool_carve( pool, numpages ) ) != NULL )
+  {
+    region = pool->regions;
+  }
+  else
+  {
+    return NULL;
+  }
+  
+  page = region->pages + ( run - region->base ) / FLO_POOL_PAGE_SIZE;
+  page->slots = 0;
+  page->sizeclass = (uint8_t)sizeclass;
+  
+  if ( !flo_pool_dirty( pool, region, run, ( textsize + FLO_POOL_PAGE_SIZE - 1 ) / FLO_POOL_PAGE_SIZE ) )
+  {
+    *(void**)run = pool->runs[ sizeclass ];
+    pool->runs[ sizeclass ] = run;
+    return NULL;
+  }
+  
+  *first = page;
+  return run;
+}
+
+/* A slot for a module that doesn't write to itself, from the page of slots being filled for its class. */
+static uint8_t* flo_pool_alloc_slot( flo_pool_t* pool, size_t size )
+{
+  int sizeclass = 0;
+  size_t slotsize;
+  flo_page_t* page;
+  uint8_t* slot;
+  
+  while ( ( (size_t)FLO_POOL_MIN_SLOT_SIZE << sizeclass ) < size )
+  {
+    sizeclass++;
+  }
+  
+  slotsize = (size_t)FLO_POOL_MIN_SLOT_SIZE << sizeclass;
+  page = pool->current[ sizeclass ];
+  
+  if ( page != NULL && page->used < FLO_POOL_PAGE_SIZE / slotsize )
+  {
+    slot = pool->slots[ sizeclass ] + page->used * slotsize;
+    page->used++;
+    page->live++;
+    return slot;
+  }
+  
+  /* A new page of slots, it's sealed with the modules in it. */
+  slot = flo_pool_alloc_run( pool, FLO_POOL_PAGE_SIZE, FLO_POOL_PAGE_SIZE, &page );
+  
+  if ( slot == NULL )
+  {
+    return NULL;
+  }
+  
+  page->slots = 1;
+  page->sizeclass = (uint8_t)sizeclass;
+  page->used = 1;
+  page->live = 1;
+  pool->slots[ sizeclass ] = slot;
+  pool->current[ sizeclass ] = page;
+  return slot;
+}
+
+/* Memory for a module, its textsize is a multiple of the page size if it writes to anything, see flo_check_module. */
+static void* flo_pool_alloc( flo_pool_t* pool, const flo_header_t* header, uint32_t* flags )
+{
+  unsigned int memsize = FLO_GET_MEMSIZE( header );
+  unsigned int textsize = FLO_GET_TEXTSIZE( header );
+  flo_page_t* first;
+  
+  if ( ( *flags & FLO_FLAG_HUGEPAGE ) || memsize > pool->regionsize / 4 )
+  {
+    return flo_alloc_image( memsize, flags );
+  }
+  
+  /* Modules that write to nothing are sealed whole, and can share pages. */
+  if ( textsize >= FLO_GET_IMAGESIZE( header ) + FLO_GET_BSSSIZE( header ) )
+  {
+    if ( memsize <= FLO_POOL_PAGE_SIZE / 2 )
+    {
+      return flo_pool_alloc_slot( pool, memsize );
+    }
+    
+    return flo_pool_alloc_run( pool, memsize, memsize, &first );
+  }
+  
+  return flo_pool_alloc_run( pool, memsize, textsize, &first );
+}
+
+static void flo_pool_release( flo_pool_t* pool, void* flo, unsigned int size, uint32_t flags )
+{
+  flo_region_t* region = flo_pool_region( pool, (uint8_t*)flo );
+  uint8_t* run = (uint8_t*)( (uintptr_t)flo & ~(uintptr_t)( FLO_POOL_PAGE_SIZE - 1 ) );
+  flo_page_t* page;
+  size_t numpages = 1;
+  size_t i;
+  
+  if ( region == NULL )
+  {
+    flo_unmap_image( flo, size, flags );
+    return;
+  }
+  
+  /* Runs start at the module, slots in the page of theirs. */
+  page = region->pages + ( run - region->base ) / FLO_POOL_PAGE_SIZE;
+  
+  if ( page->slots )
+  {
+    /* A page of slots is freed once all its slots are, the one being filled is reused right away. */
+    if ( --page->live != 0 )
+    {
+      return;
+    }
+    
+    if ( page == pool->current[ page->sizeclass ] )
+    {
+      page->used = 0;
+      return;
+    }
+  }
+  else
+  {
+    numpages = (size_t)1 << page->sizeclass;
+  }
+  
+  /* The pages aren't sealed anymore if they were waiting for it. */
+  for ( i = 0; i < numpages; i++ )
+  {
+    page[ i ].dirty = 0;
+  }
+  
+  /* Free runs are kept read-write to link them, and if that fails the run is lost. */
+  if ( flo_pool_unseal( region, run, numpages ) )
+  {
+    int sizeclass = page->slots ? 0 : page->sizeclass;
+    *(void**)run = pool->runs[ sizeclass ];
+    pool->runs[ sizeclass ] = run;
+  }
+}
+
+flo_pool_t* flo_pool_new( unsigned int regionsize )
+{
+  flo_pool_t* pool = (flo_pool_t*)calloc( 1, sizeof( flo_pool_t ) );
+  
+  if ( pool != NULL )
+  {
+    /* Whole pages, and enough of them for the runs of the biggest modules a pool takes. */
+    regionsize = regionsize != 0 ? regionsize : FLO_POOL_REGION_SIZE;
+    regionsize = ( regionsize + FLO_POOL_PAGE_SIZE - 1 ) & ~( FLO_POOL_PAGE_SIZE - 1 );
+    pool->regionsize = regionsize > 8 * FLO_POOL_PAGE_SIZE ? regionsize : 8 * FLO_POOL_PAGE_SIZE;
+  }
+  
+  return pool;
+}
+
+void flo_pool_delete( flo_pool_t* pool )
+{
+  while ( pool->regions != NULL )
+  {
+    flo_region_t* next = pool->regions->next;
+    flo_unmap_image( pool->regions->base, pool->regionsize, 0 );
+    free( pool->regions );
+    pool->regions = next;
+  }
+  
+  free( pool->dirty );
+  free( pool );
+}
+
+int flo_pool_seal( flo_pool_t* pool )
+{
+  unsigned int i;
+  int ok = 1;
+  
+  for ( i = 0; i < pool->numdirty; i++ )
+  {
+    flo_range_t* range = pool->dirty + i;
+    flo_page_t* page = range->region->pages + range->first;
+    flo_page_t* end = page + range->count;
+    
+    /* Pages freed since they were filled are skipped, which can split a range. */
+    while ( page != end )
+    {
+      flo_page_t* first;
+      
+      while ( page != end && !page->dirty )
+      {
+        page++;
+      }
+      
+      for ( first = page; page != end && page->dirty; page++ )
+      {
+        page->dirty = 0;
+      }
+      
+      if ( page == first )
+      {
+        continue;
+      }
+      
+      if ( !flo_protect( range->region->base + ( first - range->region->pages ) * FLO_POOL_PAGE_SIZE, ( page - first ) * FLO_POOL_PAGE_SIZE, 1 ) )
+      {
+        ok = 0;
+        continue;
+      }
+      
+      for ( ; first != page; first++ )
+      {
+        first->sealed = 1;
+      }
+    }
+  }
+  
+  /* The pages of slots that were being filled are sealed, the next slots come from new pages. */
+  pool->numdirty = 0;
+  memset( pool->slots, 0, sizeof( pool->slots ) );
+  memset( pool->current, 0, sizeof( pool->current ) );
+  return ok;
+}
+
+void flo_pool_free( flo_pool_t* pool, void* flo, unsigned int size )
+{
+  flo_pool_release( pool, flo, size, FLO_GET_FLAGS( FLO_GET_HEADER( flo, size ) ) );
+}
+
+/* Checks that a module file of filesize bytes with header is one that can be loaded. */
+static int flo_check_module( const flo_header_t* header, uint64_t filesize )
+{
+  unsigned int imagesize = FLO_GET_IMAGESIZE( header );
+  unsigned int packedsize = FLO_GET_PACKEDSIZE( header );
+  uint64_t textsize = FLO_GET_TEXTSIZE( header );
+  uint64_t layoutsize = (uint64_t)imagesize + FLO_GET_BSSSIZE( header );
+  
+  /* What the module writes to must start a page, pools load it at a page boundary and seal the pages before. */
+  if ( header->version != ( FLO_MAGIC | FLO_VERSION << 24 ) || layoutsize + sizeof( *header ) > FLO_GET_MEMSIZE( header ) || textsize > layoutsize || ( textsize < layoutsize && textsize % FLO_POOL_PAGE_SIZE != 0 ) )
+  {
+    return 0;
+  }
+  
+  unsigned int trailersize = FLO_GET_TRAILERSIZE( header );
+  return ( packedsize != 0 ? packedsize : imagesize ) + (uint64_t)trailersize == filesize && (uint64_t)FLO_GET_NUMSYMBOLS( header ) * sizeof( flo_symbol_t ) + (uint64_t)FLO_GET_NUMFIXUPS( header ) * sizeof( uint32_t ) + sizeof( *header ) <= trailersize;
+}
+
+/* Memory for a module from pool, or its own mapping if pool is NULL, with .bss cleared. */
+static uint8_t* flo_alloc_module( flo_pool_t* pool, const flo_header_t* header, uint32_t* flags )
+{
+  uint8_t* flo;
+  
+  *flags = FLO_GET_FLAGS( header ) & ~( FLO_FLAG_HUGETLB | FLO_FLAG_THP );
+  
+  if ( pool == NULL )
+  {
+    /* Fresh pages are zeroed, which takes care of .bss. */
+    return (uint8_t*)flo_alloc_image( FLO_GET_MEMSIZE( header ), flags );
+  }
+  
+  /* Slots of a pool can have been used already. */
+  flo = (uint8_t*)flo_pool_alloc( pool, header, flags );
+  
+  if ( flo != NULL )
+  {
+    memset( flo + FLO_GET_IMAGESIZE( header ), 0, FLO_GET_BSSSIZE( header ) );
+  }
+  
+  return flo;
+}
+
+static void flo_release_module( flo_pool_t* pool, void* flo, unsigned int size, uint32_t flags )
+{
+  if ( pool != NULL )
+  {
+    flo_pool_release( pool, flo, size, flags );
+  }
+  else
+  {
+    flo_unmap_image( flo, size, flags );
+  }
+}
+
+/* Loads a module into memory from pool, or into its own mapping if pool is NULL. */
+static void* flo_load_module( flo_pool_t* pool, const char* name, unsigned int* size )
+{
+  FILE* file = fopen( name, "rb" );
+  flo_header_t header;
+  
+  if ( file == NULL )
+  {
+    return NULL;
+  }
+  
+  fseek( file, 0, SEEK_END );
+  long filesize = ftell( file );
+  
+  if ( filesize < (long)sizeof( header ) || fseek( file, filesize - sizeof( header ), SEEK_SET ) != 0 || fread( &header, 1, sizeof( header ), file ) != sizeof( header ) || !flo_check_module( &header, filesize ) )
+  {
+    fclose( file );
+    return NULL;
+  }
+  
+  unsigned int imagesize = FLO_GET_IMAGESIZE( &header );
+  unsigned int packedsize = FLO_GET_PACKEDSIZE( &header );
+  unsigned int memsize = FLO_GET_MEMSIZE( &header );
+  unsigned int trailersize = FLO_GET_TRAILERSIZE( &header );
+  uint32_t flags;
+  *size = memsize;
+  uint8_t* flo = flo_alloc_module( pool, &header, &flags );
+  
+  if ( flo != NULL )
+  {
+    int ok;
+    
+    fseek( file, 0, SEEK_SET );
+    
+    if ( packedsize != 0 )
+    {
+      /* Read the compressed image and decompress it in one pass into its final place. */
+      uint8_t* packed = (uint8_t*)malloc( packedsize );
+      ok = packed != NULL && fread( packed, 1, packedsize, file ) == packedsize && flo_decompress( flo, imagesize, packed, packedsize );
+      free( packed );
+    }
+    else
+    {
+      ok = fread( flo, 1, imagesize, file ) == imagesize;
+    }
+    
+    /* The trailer goes at the end so that its negative offsets still work. */
+    if ( ok && fread( flo + memsize - trailersize, 1, trailersize, file ) == trailersize )
+    {
+      FLO_GET_HEADER( flo, memsize )->packedsize = 0;
+      FLO_GET_HEADER( flo, memsize )->flags = flags;
+      fclose( file );
+      return flo;
+    }
+    
+    flo_release_module( pool, flo, *size, flags );
+  }
+  
+  fclose( file );
+  return NULL;
+}
+
+void* flo_load_compressed( const char* name, unsigned int* size )
+{
+  return flo_load_module( NULL, name, size );
+}
+
+void* flo_pool_load( flo_pool_t* pool, const char* name, unsigned int* size )
+{
+  return flo_load_module( pool, name, size );
+}
+
+struct flo_bundle_t
+{
+  const uint8_t*            base; /* The read-only mapping of the whole file. */
+  size_t                    size;
+  const flo_bundle_entry_t* entries;
+  uint32_t                  numentries;
+};
+
+/* Maps a file read-only, returns NULL if it's empty. */
+static const uint8_t* flo_map_file( const char* name, size_t* size )
+{
+#ifdef _WIN32
+  HANDLE file = CreateFileA( name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+  LARGE_INTEGER filesize;
+  HANDLE mapping;
+  void* base = NULL;
+  
+  if ( file == INVALID_HANDLE_VALUE )
+  {
+    return NULL;
+  }
+  
+  if ( GetFileSizeEx( file, &filesize ) && filesize.QuadPart != 0 && (uint64_t)filesize.QuadPart <= (size_t)-1 )
+  {
+    /* The view keeps the mapping alive once the handles are closed. */
+    mapping = CreateFileMappingA( file, NULL, PAGE_READONLY, 0, 0, NULL );
+    
+    if ( mapping != NULL )
+    {
+      base = MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+      CloseHandle( mapping );
+    }
+    
+    *size = (size_t)filesize.QuadPart;
+  }
+  
+  CloseHandle( file );
+  return (const uint8_t*)base;
+#else
+  int fd = open( name, O_RDONLY );
+  struct stat st;
+  void* base = MAP_FAILED;
+  
+  if ( fd < 0 )
+  {
+    return NULL;
+  }
+  
+  if ( fstat( fd, &st ) == 0 && st.st_size != 0 && (uint64_t)st.st_size <= (size_t)-1 )
+  {
+    base = mmap( NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    *size = (size_t)st.st_size;
+  }
+  
+  close( fd );
+  return base != MAP_FAILED ? (const uint8_t*)base : NULL;
+#endif
+}
+
+static void flo_unmap_file( const uint8_t* base, size_t size )
+{
+#ifdef _WIN32
+  (void)size;
+  UnmapViewOfFile( base );
+#else
+  munmap( (void*)base, size );
+#endif
+}
+
+flo_bundle_t* flo_bundle_open( const char* name )
+{
+  size_t size = 0;
+  const uint8_t* base = flo_map_file( name, &size );
+  const flo_bundle_header_t* header = (const flo_bundle_header_t*)base;
+  flo_bundle_t* bundle;
+  uint32_t i;
+  
+  if ( base == NULL )
+  {
+    return NULL;
+  }
+  
+  if ( size < sizeof( *header ) || header->magic != FLO_BUNDLE_MAGIC || header->version != FLO_BUNDLE_VERSION || (uint64_t)header->numentries * sizeof( flo_bundle_entry_t ) > size - sizeof( *header ) )
+  {
+    flo_unmap_file( base, size );
+    return NULL;
+  }
+  
+  /* Check the directory once so that the other functions can trust it. */
+  const flo_bundle_entry_t* entries = (const flo_bundle_entry_t*)( header + 1 );
+  
+  for ( i = 0; i < header->numentries; i++ )
+  {
+    const flo_bundle_entry_t* entry = entries + i;
+    
+    if ( entry->name >= size || memchr( base + entry->name, 0, size - entry->name ) == NULL || entry->size < sizeof( flo_header_t ) || (uint64_t)entry->offset + entry->size > size )
+    {
+      flo_unmap_file( base, size );
+      return NULL;
+    }
+  }
+  
+  bundle = (flo_bundle_t*)malloc( sizeof( flo_bundle_t ) );
+  
+  if ( bundle == NULL )
+  {
+    flo_unmap_file( base, size );
+    return NULL;
+  }
+  
+  bundle->base = base;
+  bundle->size = size;
+  bundle->entries = entries;
+  bundle->numentries = header->numentries;
+  return bundle;
+}
+
+void flo_bundle_close( flo_bundle_t* bundle )
+{
+  flo_unmap_file( bundle->base, bundle->size );
+  free( bundle );
+}
+
+const flo_bundle_entry_t* flo_bundle_find( flo_bundle_t* bundle, const char* name )
+{
+  /* The directory is sorted by name. */
+  uint32_t low = 0;
+  uint32_t high = bundle->numentries;
+  
+  while ( low < high )
+  {
+    uint32_t middle = low + ( high - low ) / 2;
+    const flo_bundle_entry_t* entry = bundle->entries + middle;
+    int cmp = strcmp( (const char*)bundle->base + entry->name, name );
+    
+    if ( cmp == 0 )
+    {
+      return entry;
+    }
+    else if ( cmp < 0 )
+    {
+      low = middle + 1;
+    }
+    else
+    {
+      high = middle;
+    }
+  }
+  
+  return NULL;
+}
+
+void* flo_bundle_instantiate( flo_bundle_t* bundle, const flo_bundle_entry_t* entry, flo_pool_t* pool, unsigned int* size )
+{
+  const uint8_t* file = bundle->base + entry->offset;
+  flo_header_t header;
+  
+  /* Module files don't have to end at an aligned offset. */
+  memcpy( &header, file + entry->size - sizeof( header ), sizeof( header ) );
+  
+  if ( !flo_check_module( &header, entry->size ) )
+  {
+    return NULL;
+  }
+  
+  unsigned int imagesize = FLO_GET_IMAGESIZE( &header );
+  unsigned int packedsize = FLO_GET_PACKEDSIZE( &header );
+  unsigned int memsize = FLO_GET_MEMSIZE( &header );
+  unsigned int trailersize = FLO_GET_TRAILERSIZE( &header );
+  uint32_t flags;
+  *size = memsize;
+  uint8_t* flo = flo_alloc_module( pool, &header, &flags );
+  
+  if ( flo == NULL )
+  {
+    return NULL;
+  }
+  
+  if ( packedsize != 0 )
+  {
+    /* Decompress straight from the mapping. */
+    if ( !flo_decompress( flo, imagesize, file, packedsize ) )
+    {
+      flo_release_module( pool, flo, memsize, flags );
+      return NULL;
+    }
+  }
+  else
+  {
+    memcpy( flo, file, imagesize );
+  }
+  
+  memcpy( flo + memsize - trailersize, file + entry->size - trailersize, trailersize );
+  FLO_GET_HEADER( flo, memsize )->packedsize = 0;
+  FLO_GET_HEADER( flo, memsize )->flags = flags;
+  return flo;
+}
+
+/* A module replaced by flo_swap. flo_quiesce frees it, or trims it to its entry stubs and their slots if some of */
+/* them were published, and then flo_hotswap_free frees it. */
+struct flo_retired_t
+{
+  flo_retired_t* next;
+  void*          flo;
+  unsigned int   size;
+  uint32_t       flags;     /* The header is gone once the module is trimmed. */
+  uint8_t*       stubs;     /* Its entry stubs, the slots of which point to the stubs of the current module. */
+  uint8_t*       stubs_end;
+  int            published; /* Some of its stubs went through put_symbol, callers can hold them forever. */
+  int            trimmed;
+};
+
+/* The slot an entry stub jumps through. */
+static volatile uint64_t* flo_entry_slot( const uint8_t* stub )
+{
+  int32_t displacement;
+  
+  memcpy( &displacement, stub + 2, sizeof( displacement ) );
+  return (volatile uint64_t*)( stub + 6 + displacement );
+}
+
+/* Relocates a FLO_FLAG_HOTSWAP module for flo_swap, see flo_swap_put_symbol. */
+typedef struct
+{
+  flo_loader_t         loader;
+  const flo_loader_t*  host;
+  const uint8_t*       stubs;     /* The entry stubs of the current module. */
+  const uint8_t*       stubs_end;
+  const flo_retired_t* retired;   /* And the ones of the modules it replaced. */
+  const uint8_t*       own;       /* The entry stubs of the new module. */
+  const uint8_t*       own_end;
+  int                  published; /* Set if one of those goes through put_symbol. */
+}
+flo_swap_loader_t;
+
+static uintptr_t flo_swap_get_symbol( void* ud, flo_key_t key )
+{
+  const flo_loader_t* host = ( (flo_swap_loader_t*)ud )->host;
+  return host->get_symbol( host->ud, key );
+}
+
+/* The functions of the current module already have entry stubs published, by it or by a module it replaced, and */
+/* those go to the new module after the swap, so only the other exports are defined again. */
+static int flo_swap_put_symbol( void* ud, flo_key_t key, uintptr_t address )
+{
+  flo_swap_loader_t* swap = (flo_swap_loader_t*)ud;
+  const uint8_t* published = (const uint8_t*)swap->host->get_symbol( swap->host->ud, key );
+  const flo_retired_t* retired;
+  
+  if ( published >= swap->stubs && published < swap->stubs_end )
+  {
+    return 1;
+  }
+  
+  for ( retired = swap->retired; retired != NULL; retired = retired->next )
+  {
+    if ( published >= retired->stubs && published < retired->stubs_end )
+    {
+      return 1;
+    }
+  }
+  
+  if ( (const uint8_t*)address >= swap->own && (const uint8_t*)address < swap->own_end )
+  {
+    swap->published = 1;
+  }
+  
+  return swap->host->put_symbol( swap->host->ud, key, address );
+}
+
+/* Gives the pages in [start, end) back to the system, the range stays reserved on Windows until flo_unmap_image. */
+static void flo_release_pages( uint8_t* start, uint8_t* end )
+{
+  if ( end <= start )
+  {
+    return;
+  }
+  
+#ifdef _WIN32
+  VirtualFree( start, end - start, MEM_DECOMMIT );
+#else
+  munmap( start, end - start );
+#endif
+}
+
+static uintptr_t flo_page_size( void )
+{
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo( &info );
+  return info.dwPageSize;
+#else
+  return (uintptr_t)sysconf( _SC_PAGESIZE );
+#endif
+}
+
+/* Releases the pages of a retired module but the ones with its entry stubs and their slots, which callers that kept */
+/* the addresses of its functions still go through. Huge page modules are kept whole. */
+static void flo_trim_retired( flo_retired_t* retired )
+{
+  uint8_t* image = (uint8_t*)retired->flo;
+  uint8_t* end = image + retired->size;
+  uint8_t* stubs = retired->stubs;
+  uint8_t* stubs_end = retired->stubs_end;
+  uint8_t* slots = end;
+  uint8_t* slots_end = image;
+  uintptr_t mask = flo_page_size() - 1;
+  uint8_t* stub;
+  
+  retired->trimmed = 1;
+  
+  if ( retired->flags & ( FLO_FLAG_HUGETLB | FLO_FLAG_THP ) )
+  {
+    return;
+  }
+  
+  for ( stub = stubs; stub < stubs_end; stub += FLO_ENTRY_STUB_SIZE )
+  {
+    uint8_t* slot = (uint8_t*)flo_entry_slot( stub );
+    slots = slot < slots ? slot : slots;
+    slots_end = slot + 8 > slots_end ? slot + 8 : slots_end;
+  }
+  
+  if ( stubs == stubs_end )
+  {
+    flo_release_pages( image, end );
+    return;
+  }
+  
+  /* The stubs are in the code and their slots at the end of the data, in this order. */
+  stubs = (uint8_t*)( (uintptr_t)stubs & ~mask );
+  stubs_end = (uint8_t*)( ( (uintptr_t)stubs_end + mask ) & ~mask );
+  slots = (uint8_t*)( (uintptr_t)slots & ~mask );
+  slots_end = (uint8_t*)( ( (uintptr_t)slots_end + mask ) & ~mask );
+  
+  flo_release_pages( image, stubs );
+  flo_release_pages( stubs_end, slots );
+  flo_release_pages( slots_end, (uint8_t*)( ( (uintptr_t)end + mask ) & ~mask ) );
+}
+
+#ifdef FLO_HASHED_SYMBOLS
+#define FLO_SYMBOL_COMPARE( names1, symbol1, names2, symbol2 ) ( ( FLO_GET_SYMBOL_HASH( symbol1 ) > FLO_GET_SYMBOL_HASH( symbol2 ) ) - ( FLO_GET_SYMBOL_HASH( symbol1 ) < FLO_GET_SYMBOL_HASH( symbol2 ) ) )
+#else
+#define FLO_SYMBOL_COMPARE( names1, symbol1, names2, symbol2 ) flo_symbol_compare( names1, symbol1, names2, symbol2 )
+
+/* A corrupt name compares greater than anything, so it matches nothing. */
+static int flo_symbol_compare( flo_names_t* names1, const flo_symbol_t* symbol1, flo_names_t* names2, const flo_symbol_t* symbol2 )
+{
+  const char* name1 = flo_symbol_name( names1, symbol1 );
+  const char* name2 = flo_symbol_name( names2, symbol2 );
+  return name1 != NULL && name2 != NULL ? strcmp( name1, name2 ) : 1;
+}
+#endif
+
+/* Goes through the entry stubs of from along with the exports of to, which are sorted the same way, and points the */
+/* stubs to the matching exports if patch is set. Fails if an exported function of from isn't exported by to. */
+static int flo_swap_entries( flo_header_t* from, flo_header_t* to, int patch )
+{
+  flo_symbol_t* symbol = FLO_GET_EXPORTS( from );
+  flo_symbol_t* end = symbol + FLO_GET_NUMEXPORTS( from );
+  flo_symbol_t* other = FLO_GET_EXPORTS( to );
+  flo_symbol_t* other_end = other + FLO_GET_NUMEXPORTS( to );
+  uint8_t* entries = FLO_GET_ENTRIES( from );
+  uint8_t* entries_end = entries + FLO_GET_NUMENTRIES( from ) * FLO_ENTRY_STUB_SIZE;
+  flo_names_t names;
+  flo_names_t other_names;
+  
+  flo_names_init( &names, from );
+  flo_names_init( &other_names, to );
+  
+  for ( ; symbol < end; symbol++ )
+  {
+    uint8_t* stub = (uint8_t*)FLO_GET_SYMBOL_ADDRESS( symbol );
+    int cmp = 1;
+    
+    if ( stub < entries || stub >= entries_end )
+    {
+      /* Not a function. */
+      continue;
+    }
+    
+    while ( other < other_end && ( cmp = FLO_SYMBOL_COMPARE( &other_names, other, &names, symbol ) ) < 0 )
+    {
+      other++;
+    }
+    
+    if ( cmp != 0 )
+    {
+      return FLO_SYMBOL_NOT_FOUND;
+    }
+    
+    if ( patch )
+    {
+      /* The slot is 8-byte aligned, callers jumping through it see either the old or the new address. Pointing to */
+      /* the stub of the new module keeps older modules valid when it's replaced in turn. */
+      *flo_entry_slot( stub ) = (uintptr_t)FLO_GET_SYMBOL_ADDRESS( other );
+    }
+  }
+  
+  return FLO_OK;
+}
+
+int flo_swap( const flo_loader_t* loader, flo_hotswap_t* hotswap, const char* name )
+{
+  flo_header_t* current = hotswap->flo != NULL ? FLO_GET_HEADER( hotswap->flo, hotswap->size ) : NULL;
+  flo_retired_t* retired = NULL;
+  flo_header_t* header;
+  unsigned int size;
+  void* flo;
+  int published;
+  int res;
+  
+  if ( current != NULL && ( retired = (flo_retired_t*)malloc( sizeof( flo_retired_t ) ) ) == NULL )
+  {
+    return FLO_ERROR_LOADING;
+  }
+  
+  flo = flo_load_compressed( name, &size );
+  
+  if ( flo == NULL )
+  {
+    free( retired );
+    return FLO_ERROR_LOADING;
+  }
+  
+  header = FLO_GET_HEADER( flo, size );
+  res = ( FLO_GET_FLAGS( header ) & FLO_FLAG_HOTSWAP ) ? FLO_OK : FLO_ERROR_HOTSWAP;
+  published = FLO_GET_NUMENTRIES( header ) != 0;
+  
+  /* Check the exports before the loader publishes any of them. */
+  if ( res == FLO_OK && current != NULL )
+  {
+    res = flo_swap_entries( current, header, 0 );
+  }
+  
+  if ( res == FLO_OK && current != NULL )
+  {
+    flo_swap_loader_t swap;
+    
+    swap.loader.get_symbol = flo_swap_get_symbol;
+    swap.loader.put_symbol = flo_swap_put_symbol;
+    swap.loader.ud = &swap;
+    swap.host = loader;
+    swap.stubs = FLO_GET_ENTRIES( current );
+    swap.stubs_end = swap.stubs + FLO_GET_NUMENTRIES( current ) * FLO_ENTRY_STUB_SIZE;
+    swap.retired = hotswap->retired;
+    swap.own = FLO_GET_ENTRIES( header );
+    swap.own_end = swap.own + FLO_GET_NUMENTRIES( header ) * FLO_ENTRY_STUB_SIZE;
+    swap.published = 0;
+    res = flo_relocate_ctx( &swap.loader, flo, size );
+    published = swap.published;
+    
+    /* The resolver of lazy modules keeps the loader, which must outlive the module. */
+    if ( FLO_GET_FLAGS( header ) & FLO_FLAG_LAZY )
+    {
+      FLO_GET_BIND( header )->loader = loader;
+    }
+  }
+  else if ( res == FLO_OK )
+  {
+    res = flo_relocate_ctx( loader, flo, size );
+  }
+  
+  if ( res != FLO_OK )
+  {
+    flo_free_image( flo, size );
+    free( retired );
+    return res;
+  }
+  
+  if ( retired != NULL )
+  {
+    flo_retired_t* older;
+    
+    flo_swap_entries( current, header, 1 );
+    
+    retired->flo = hotswap->flo;
+    retired->size = hotswap->size;
+    retired->flags = FLO_GET_FLAGS( current );
+    retired->stubs = FLO_GET_ENTRIES( current );
+    retired->stubs_end = retired->stubs + FLO_GET_NUMENTRIES( current ) * FLO_ENTRY_STUB_SIZE;
+    retired->published = hotswap->published;
+    retired->trimmed = 0;
+    
+    /* Older modules skip the one that's retired now, so calls through them always take two jumps. */
+    for ( older = hotswap->retired; older != NULL; older = older->next )
+    {
+      uint8_t* stub;
+      
+      for ( stub = older->stubs; stub < older->stubs_end; stub += FLO_ENTRY_STUB_SIZE )
+      {
+        volatile uint64_t* slot = flo_entry_slot( stub );
+        uint8_t* target = (uint8_t*)(uintptr_t)*slot;
+        
+        if ( target >= retired->stubs && target < retired->stubs_end )
+        {
+          *slot = *flo_entry_slot( target );
+        }
+      }
+    }
+    
+    retired->next = hotswap->retired;
+    hotswap->retired = retired;
+    hotswap->numretired++;
+  }
+  
+  hotswap->flo = flo;
+  hotswap->size = size;
+  hotswap->published = published;
+  return FLO_OK;
+}
+
+void flo_quiesce( flo_hotswap_t* hotswap )
+{
+  flo_retired_t** link = &hotswap->retired;
+  
+  /* The ones trimmed by an earlier call come after the newer ones. */
+  while ( *link != NULL && !( *link )->trimmed )
+  {
+    flo_retired_t* retired = *link;
+    
+    if ( retired->published )
+    {
+      flo_trim_retired( retired );
+      link = &retired->next;
+      continue;
+    }
+    
+    /* Nothing can jump to its stubs anymore: every swap points the slots of older modules past it, and no thread */
+    /* runs its code now. */
+    *link = retired->next;
+    flo_unmap_image( retired->flo, retired->size, retired->flags );
+    free( retired );
+    hotswap->numretired--;
+  }
+}
+
+void flo_hotswap_free( flo_hotswap_t* hotswap )
+{
+  while ( hotswap->retired != NULL )
+  {
+    flo_retired_t* next = hotswap->retired->next;
+    flo_unmap_image( hotswap->retired->flo, hotswap->retired->size, hotswap->retired->flags );
+    free( hotswap->retired );
+    hotswap->retired = next;
+  }
+  
+  hotswap->numretired = 0;
+  hotswap->published = 0;
+  
+  if ( hotswap->flo != NULL )
+  {
+    flo_free_image( hotswap->flo, hotswap->size );
+    hotswap->flo = NULL;
+    hotswap->size = 0;
+  }
+}
@@ -12,22 +12,122 @@
 #define FLO_OK                     0 /* Yay! */
 #define FLO_ERROR_DEFINING_SYMBOL -1 /* flo_put_symbol returned zero. */
 #define FLO_SYMBOL_NOT_FOUND      -2 /* flo_get_symbol returned zero. */
+#define FLO_ERROR_VERSION         -3 /* Unsupported .flo version. */
+#define FLO_ERROR_COMPRESSED      -4 /* Compressed .flo, use flo_load_compressed. */
+#define FLO_ERROR_LAYOUT          -5 /* The .flo isn't laid out in memory, use flo_load_compressed. */
+#define FLO_ERROR_LOADING         -6 /* Loading the module failed. */
+#define FLO_ERROR_HOTSWAP         -7 /* The module wasn't linked with flolink --hotswap. */
+#define FLO_ERROR_CANCELLED       -8 /* The load was cancelled with flo_async_cancel. */
+#define FLO_ERROR_CORRUPT         -9 /* A front-coded name of the module is corrupt. */
 
-/* The .flo header, which is located at the end of the file actually. */
+/* Versions of the .flo format. */
+#define FLO_MAGIC   0x004f4c46U /* "FLO" in the low 24 bits of the version field. */
+#define FLO_VERSION 13          /* Current version, in the high 8 bits of the version field. */
+
+/* Header flags. */
+#define FLO_FLAG_LAZY       1 /* Imports are bound on their first call. */
+#define FLO_FLAG_FRONTCODED 2 /* Symbol names are front-coded, see below. */
+#define FLO_FLAG_HUGEPAGE   4 /* The code is padded to whole huge pages, flo_load_compressed tries to map it with them. */
+#define FLO_FLAG_HUGETLB    8 /* Set in memory by flo_load_compressed, the module is in MAP_HUGETLB pages. */
+#define FLO_FLAG_THP       16 /* Set in memory by flo_load_compressed, the module is in transparent huge pages. */
+#define FLO_FLAG_HOTSWAP   32 /* Exported functions are entry stubs, see flo_swap. */
+
+/* Size of the huge pages of FLO_FLAG_HUGEPAGE modules. */
+#define FLO_HUGE_PAGE_SIZE 0x200000U
+
+/*
+Front-coded names are sorted and stored in blocks of FLO_NAMES_PER_BLOCK
+names. Each name is a byte with the length of the prefix it shares with the
+previous name in the block, zero for the first one, followed by the rest of
+the name. An array of negative offsets to the blocks, relative to the array
+itself, follows the names, and symbols have the index of their names instead
+of offsets to them.
+*/
+#define FLO_NAMES_PER_BLOCK   16
+#define FLO_MAX_NAME_SIZE   1024 /* Including the terminator. */
+
+/*
+The .flo header, which is located at the end of the file actually. Right
+before the header are the imported symbols, and right before them the
+exported symbols, so a loader can go through each kind in a straight loop.
+In memory, the image comes first, then .bss, then the symbol names, the
+symbols and the header. The file doesn't have .bss, and the image is
+compressed if packedsize isn't zero. Only version 1 and the current version
+are supported.
+*/
 typedef struct
 {
-  uint32_t numsymbols;
+  uint32_t numexports;  /* Number of exported symbols. */
+  uint32_t numimports;  /* Number of imported (FLO_ADDR64) symbols. */
   uint32_t bssoffset;
   uint32_t bsssize;
+  uint32_t imagesize;   /* Size of the image, .bss starts right after it. */
+  uint32_t memsize;     /* Size of the module in memory, including .bss. */
+  uint32_t flags;       /* FLO_FLAG_* */
+  uint32_t bindoffset;  /* A negative offset to the flo_bind_t block of lazy modules. */
+  uint32_t namesoffset; /* A negative offset to the block index of front-coded names. */
+  uint32_t checksum;    /* Checksum of the manifest used by flolink --prebind. */
+  uint32_t numprebound; /* Number of imports at the end of the imports bound by flolink --prebind. */
+  uint32_t numfixups;   /* Number of words of base fixups right before the exported symbols. */
+  uint32_t buildid;     /* Checksum of the file written by flolink --build-id, zero if none. */
+  uint32_t entryoffset; /* A negative offset to the entry stubs of FLO_FLAG_HOTSWAP modules. */
+  uint32_t numentries;  /* Number of entry stubs. */
+  uint32_t funcoffset;  /* A negative offset to the function table of modules linked with flolink --function-table. */
+  uint32_t numfuncs;    /* Number of entries in the function table, zero if none. */
+  uint32_t textsize;    /* Size of the code and read-only data at the start of the image, the module doesn't write to them once relocated. Whole pages unless the module writes to nothing. */
+  uint32_t packedsize;  /* Size of the compressed image in the file, zero if not compressed. */
+  uint32_t version;     /* FLO_MAGIC | FLO_VERSION << 24, must be the last field. */
 }
 flo_header_t;
 
+/*
+Base fixups are the 64-bit absolute addresses inside the image, which hold
+offsets into the image until the loader adds the address of the image to
+them. They're encoded like ELF RELR relocations, with 32-bit words: a word
+with the lowest bit clear is the offset of a fixup, and a word with the
+lowest bit set is a bitmap of the FLO_FIXUP_BITMAP_BITS 64-bit words that
+follow the ones already covered, bit 1 standing for the first of them.
+*/
+#define FLO_FIXUP_BITMAP_BITS 31
+
+/*
+The exported functions of FLO_FLAG_HOTSWAP modules are entry stubs, which
+are contiguous and FLO_ENTRY_STUB_SIZE bytes each: a jmp [rip+slot] and two
+int3, the slot holding the address of the function. Exports are sorted by
+name, or by hash in modules linked with flolink -h.
+*/
+#define FLO_ENTRY_STUB_SIZE 8
+
+/*
+The function table of modules linked with flolink --function-table lists
+the functions of the code sorted by address, external symbols and static
+functions, each running up to the next one or to the end of its section.
+Their names come right before the table, which comes before the symbol
+names. Profilers use it through flo_perf_map_add.
+*/
+typedef struct
+{
+  uint32_t name;    /* A negative offset to the name of the function. */
+  uint32_t address; /* A negative offset to the function. */
+  uint32_t size;    /* Size of the function in bytes. */
+}
+flo_function_t;
+
+/* The header of version 1 .flo files, which don't have a version field. */
+typedef struct
+{
+  uint32_t numsymbols;
+  uint32_t bssoffset;
+  uint32_t bsssize;
+}
+flo_header_v1_t;
+
 /* Symbols inside a symbol block. */
 typedef struct
 {
   union
   {
-    uint32_t name; /* A negative offset to the symbol name. */
+    uint32_t name; /* A negative offset to the symbol name, or its index if front-coded. */
     uint32_t hash; /* The hash of the symbol. */
   };
   
@@ -35,6 +135,40 @@ typedef struct
 }
 flo_symbol_t;
 
+#ifdef FLO_HASHED_SYMBOLS
+/* Define FLO_HASHED_SYMBOLS when building for modules linked with flolink -h. */
+typedef uint32_t    flo_key_t;
+#else
+typedef const char* flo_key_t;
+#endif
+
+/*
+Symbol namespace used by flo_relocate_ctx, the callbacks get ud as their
+first argument. Loads with different loaders, or with the same one if its
+callbacks are thread-safe, can run concurrently.
+*/
+typedef struct
+{
+  uintptr_t ( *get_symbol )( void* ud, flo_key_t key );                    /* Return the address of a symbol, zero if not found. */
+  int       ( *put_symbol )( void* ud, flo_key_t key, uintptr_t address ); /* Define a symbol, return zero on errors. */
+  void*     ud;
+}
+flo_loader_t;
+
+/*
+Control block used by the resolver of lazy modules, the stubs of the imports
+jump to the resolver, which calls bind( header, index ) and then jumps to the
+returned address. bind looks the import up with loader.
+*/
+typedef struct
+{
+  uintptr_t ( *bind )( void* header, uintptr_t index );
+  void*     header;
+  const flo_loader_t* loader;
+}
+flo_bind_t;
+
+/* Version 1 .flo files interleave symbol types and symbols in blocks. */
 typedef struct
 {
   uint8_t      types[ 4 ];   /* The type of the i'th symbol. */
@@ -42,39 +176,248 @@ typedef struct
 }
 flo_symbol_block_t;
 
+/* Get the version of a .flo given its start address and size. */
+#define FLO_GET_VERSION_FIELD( start, size ) ( *(uint32_t*)( (uint8_t*)( start ) + ( size ) - sizeof( uint32_t ) ) )
+#define FLO_GET_VERSION( start, size ) ( ( FLO_GET_VERSION_FIELD( start, size ) & 0x00ffffffU ) == FLO_MAGIC ? FLO_GET_VERSION_FIELD( start, size ) >> 24 : 1 )
+
 /* Get the header of a .flo given its start address and size. */
 #define FLO_GET_HEADER( start, size )  ( (flo_header_t*)( (uint8_t*)( start ) + ( size ) - sizeof( flo_header_t ) ) )
 
+/* Get the number of exported symbols in the .flo. */
+#define FLO_GET_NUMEXPORTS( header ) ( ( header )->numexports )
+/* Get the number of imported symbols in the .flo. */
+#define FLO_GET_NUMIMPORTS( header ) ( ( header )->numimports )
 /* Get the number of symbols in the .flo. */
-#define FLO_GET_NUMSYMBOLS( header ) ( ( header )->numsymbols )
-/* Get the address of the start of the .bss section. */
+#define FLO_GET_NUMSYMBOLS( header ) ( ( header )->numexports + ( header )->numimports )
+/* Get the address of the start of the .bss section (works with both versions of the header). */
 #define FLO_GET_BSSOFFSET( header )  ( (void*)( (uint8_t*)( header ) - ( ( header )->bssoffset ) ) )
-/* Get the size of the .bss section. */
+/* Get the size of the .bss section (works with both versions of the header). */
 #define FLO_GET_BSSSIZE( header )    ( ( header )->bsssize )
+/* Get the size of the image. */
+#define FLO_GET_IMAGESIZE( header )  ( ( header )->imagesize )
+/* Get the size of the compressed image, zero if the image isn't compressed. */
+#define FLO_GET_PACKEDSIZE( header ) ( ( header )->packedsize )
+/* Get the size of the module in memory. */
+#define FLO_GET_MEMSIZE( header )    ( ( header )->memsize )
+/* Get the header flags. */
+#define FLO_GET_FLAGS( header )      ( ( header )->flags )
+/* Get the checksum of the prebind manifest. */
+#define FLO_GET_CHECKSUM( header )   ( ( header )->checksum )
+/* Get the number of prebound imports, which are the last ones. */
+#define FLO_GET_NUMPREBOUND( header ) ( ( header )->numprebound )
+/* Get the number of words of base fixups. */
+#define FLO_GET_NUMFIXUPS( header )  ( ( header )->numfixups )
+/* Get the build id, modules with the same non-zero build id are identical. */
+#define FLO_GET_BUILDID( header )    ( ( header )->buildid )
+/* Get the first entry stub of a FLO_FLAG_HOTSWAP module. */
+#define FLO_GET_ENTRIES( header )    ( (uint8_t*)( header ) - ( ( header )->entryoffset ) )
+/* Get the number of entry stubs. */
+#define FLO_GET_NUMENTRIES( header ) ( ( header )->numentries )
+/* Get the function table. */
+#define FLO_GET_FUNCTIONS( header )  ( (flo_function_t*)( (uint8_t*)( header ) - ( ( header )->funcoffset ) ) )
+/* Get the number of entries of the function table. */
+#define FLO_GET_NUMFUNCTIONS( header ) ( ( header )->numfuncs )
+/* Get the size of the part of the image that can be made read-only and executable once relocated. */
+#define FLO_GET_TEXTSIZE( header )   ( ( header )->textsize )
+/* Get the resolver control block of a lazy module. */
+#define FLO_GET_BIND( header )       ( (flo_bind_t*)( (uint8_t*)( header ) - ( ( header )->bindoffset ) ) )
+/* Get the block index of front-coded names. */
+#define FLO_GET_NAMES( header )      ( (uint32_t*)( (uint8_t*)( header ) - ( ( header )->namesoffset ) ) )
+/* Get the base fixups. */
+#define FLO_GET_FIXUPS( header )     ( (uint32_t*)FLO_GET_EXPORTS( header ) - FLO_GET_NUMFIXUPS( header ) )
+/* Get the size of the symbol names, the symbols and the header. */
+#define FLO_GET_TRAILERSIZE( header ) ( ( header )->memsize - ( header )->imagesize - ( header )->bsssize )
+
+/* Get the first imported symbol. */
+#define FLO_GET_IMPORTS( header ) ( (flo_symbol_t*)( header ) - ( header )->numimports )
+/* Get the first exported symbol. */
+#define FLO_GET_EXPORTS( header ) ( FLO_GET_IMPORTS( header ) - ( header )->numexports )
 
-/* Get the first symbol block. */
-#define FLO_GET_FIRST_BLOCK( header ) ( (flo_symbol_block_t*)( (uint8_t*)( header ) - ( ( ( header )->numsymbols + 3 ) / 4 ) * sizeof( flo_symbol_block_t ) ) )
-/* Get the last symbol block. */
-#define FLO_GET_LAST_BLOCK( header )  ( (flo_symbol_block_t*)( (uint8_t*)( header ) - sizeof( flo_symbol_t ) ) )
-/* Get the next symbol block. */
-#define FLO_GET_NEXT_BLOCK( block )   ( (flo_symbol_block_t*)( (uint8_t*)( block ) + sizeof( flo_symbol_block_t ) ) )
+/* Get the header of a version 1 .flo given its start address and size. */
+#define FLO_V1_GET_HEADER( start, size )  ( (flo_header_v1_t*)( (uint8_t*)( start ) + ( size ) - sizeof( flo_header_v1_t ) ) )
+/* Get the number of symbols in a version 1 .flo. */
+#define FLO_V1_GET_NUMSYMBOLS( header ) ( ( header )->numsymbols )
+/* Get the first symbol block of a version 1 .flo. */
+#define FLO_V1_GET_FIRST_BLOCK( header ) ( (flo_symbol_block_t*)( (uint8_t*)( header ) - ( ( ( header )->numsymbols + 3 ) / 4 ) * sizeof( flo_symbol_block_t ) ) )
+/* Get the last symbol block of a version 1 .flo. */
+#define FLO_V1_GET_LAST_BLOCK( header )  ( (flo_symbol_block_t*)( (uint8_t*)( header ) - sizeof( flo_symbol_t ) ) )
+/* Get the next symbol block of a version 1 .flo. */
+#define FLO_V1_GET_NEXT_BLOCK( block )   ( (flo_symbol_block_t*)( (uint8_t*)( block ) + sizeof( flo_symbol_block_t ) ) )
 
-/* Get the symbol name. */
+/* Get the symbol name, if not front-coded. */
 #define FLO_GET_SYMBOL_NAME( symbol )    ( (char*)( (uint8_t*)( symbol ) - ( symbol )->name ) )
 /* Get the symbol hash. */
-#define FLO_GET_SYMBOL_HASH( symbol )    ( ( symbol ).hash )
+#define FLO_GET_SYMBOL_HASH( symbol )    ( ( symbol )->hash )
 /* Get the symbol address. */
 #define FLO_GET_SYMBOL_ADDRESS( symbol ) ( (void*)( (uint8_t*)( symbol ) - ( symbol )->address ) )
 
+/* Get the name of a function of the function table. */
+#define FLO_GET_FUNCTION_NAME( func )    ( (const char*)( (uint8_t*)( func ) - ( func )->name ) )
+/* Get the address of a function of the function table. */
+#define FLO_GET_FUNCTION_ADDRESS( func ) ( (void*)( (uint8_t*)( func ) - ( func )->address ) )
+
 /* Relocate a ADDR64 symbol. */
 #define FLO_RELOCATE_ADDR64( symbol, addr ) do { *(uint64_t*)FLO_GET_SYMBOL_ADDRESS( symbol ) = (uint64_t)(uintptr_t)addr; } while ( 0 )
 
-/* Relocate an in-memory .flo, returns one of the errors above. */
+/* Relocate an in-memory .flo with the symbols of loader, returns one of the errors above. Reentrant. */
+/* The names of front-coded modules are decoded into a buffer on the stack, they're only valid during the callbacks. */
+/* Imports of lazy modules are only resolved on their first call, which aborts if get_symbol returns zero, so loader */
+/* must outlive them. */
+int flo_relocate_ctx( const flo_loader_t* loader, void* flo, unsigned int size );
+/* Same as flo_relocate_ctx, but skips the prebound imports if checksum matches the one of the manifest used by flolink. */
+int flo_relocate_prebind_ctx( const flo_loader_t* loader, void* flo, unsigned int size, uint32_t checksum );
+/* What both of the above and floglobal.c call, not meant for hosts. Skips the prebound imports if prebound is set and */
+/* checksum matches. On errors, extra is set to the name of the symbol if not NULL, front-coded names are copied into */
+/* buffer, which holds FLO_MAX_NAME_SIZE bytes and can only be NULL if extra is. */
+int flo_relocate_loader( const flo_loader_t* loader, void* flo, unsigned int size, int prebound, uint32_t checksum, const char** extra, char* buffer );
+
+/* Same as flo_relocate_ctx with the user-defined flo_get_symbol and flo_put_symbol below, in floglobal.c. */
+/* extra is set to the name of the symbol on errors, NULL in FLO_HASHED_SYMBOLS builds. Names of front-coded */
+/* modules are copied into a static buffer, which makes these functions not reentrant. */
 int flo_relocate( void* flo, unsigned int size, const char** extra );
+/* Same as flo_relocate_prebind_ctx, in floglobal.c. */
+int flo_relocate_prebind( void* flo, unsigned int size, uint32_t checksum, const char** extra );
+/* Checksum of a prebind manifest. */
+uint32_t flo_checksum( const void* data, unsigned int size );
+
+/* Load a module of the current version into zeroed executable memory, decompressing it if needed. */
+/* FLO_FLAG_HUGEPAGE modules go into MAP_HUGETLB pages, or transparent huge pages if there are none, or normal */
+/* pages, and FLO_FLAG_HUGETLB or FLO_FLAG_THP in the flags of the header in memory tell which one they got. */
+/* Returns NULL on errors, the module must be freed with flo_free_image. */
+void* flo_load_compressed( const char* name, unsigned int* size );
+/* Free a module loaded with flo_load_compressed. */
+void  flo_free_image( void* flo, unsigned int size );
+/* Read the build id of a module file without loading it, zero if it has none or isn't a module of the current version. */
+uint32_t flo_read_buildid( const char* name );
+
+/* Append the functions of a module linked with flolink --function-table to /tmp/perf-<pid>.map, where perf and other */
+/* profilers find the symbols of code they can't map to a file. Returns zero if the map can't be written, modules */
+/* without a function table add nothing. In floperf.c, Linux only, needs POSIX threads. */
+int flo_perf_map_add( void* flo, unsigned int size );
+/* Remove the functions of a module from the map, before freeing it. The map is rewritten without the lines inside the */
+/* module. Both functions hold the same mutex, so threads can add and remove modules at the same time, but other code */
+/* generators of the process must not write the map meanwhile. Profiles taken while the module was loaded but reported */
+/* after this lose its symbols. Returns zero if the map can't be rewritten. */
+int flo_perf_map_remove( void* flo, unsigned int size );
+
+/*
+A pool of memory for hosts that load many small modules, which never has
+pages that are both writable and executable. Regions are mapped read-write,
+and modules go into them ready to be relocated. flo_pool_seal then makes the
+code and read-only data of every module loaded since the last call read-only
+and executable, with one mprotect per run of contiguous pages, so hosts load
+and relocate a batch of modules and seal them before running any of them.
+The text of a module ends at a page boundary, and what it writes to, .data,
+.bss and the slots of lazy and FLO_FLAG_HOTSWAP modules, starts on the next
+page and stays read-write. Modules that write to nothing are packed in pages
+of slots of power of two sizes, starting at FLO_POOL_MIN_SLOT_SIZE bytes,
+and others take runs of power of two numbers of pages. Freed runs are reused
+by the next module of their size, and a page of slots once all its slots
+are freed, so once the pool has grown, loading and freeing modules doesn't
+map or unmap any memory. Modules bigger than a quarter of a region and
+FLO_FLAG_HUGEPAGE modules get their own mapping, which is writable and
+executable like the one of flo_load_compressed. A pool isn't thread-safe.
+*/
+typedef struct flo_pool_t flo_pool_t;
+
+#define FLO_POOL_MIN_SLOT_SIZE 256U
+#define FLO_POOL_PAGE_SIZE     4096U
+#define FLO_POOL_REGION_SIZE   0x100000U /* Default size of the regions. */
+
+/* Create a pool that maps regions of regionsize bytes, zero for FLO_POOL_REGION_SIZE. Returns NULL if out of memory. */
+flo_pool_t* flo_pool_new( unsigned int regionsize );
+/* Unmap the regions of a pool, the modules in them must not be used anymore. */
+void        flo_pool_delete( flo_pool_t* pool );
+/* Same as flo_load_compressed, but puts the module in pool, where it can't run until flo_pool_seal. */
+void*       flo_pool_load( flo_pool_t* pool, const char* name, unsigned int* size );
+/* Make the text of the modules loaded since the last call read-only and executable. Returns zero if mprotect failed. */
+int         flo_pool_seal( flo_pool_t* pool );
+/* Give the memory of a module loaded with flo_pool_load back to pool. */
+void        flo_pool_free( flo_pool_t* pool, void* flo, unsigned int size );
+
+/*
+A bundle written by flolink --bundle: a flo_bundle_header_t, the directory
+of the modules sorted by name, their names, and the module files as they
+are, each aligned to FLO_BUNDLE_ALIGNMENT bytes. flo_bundle_open maps the
+whole file read-only, and flo_bundle_instantiate copies or decompresses one
+module from the mapping into executable memory, ready for flo_relocate_ctx.
+A bundle can be used by several threads at once, except flo_bundle_close.
+*/
+#define FLO_BUNDLE_MAGIC     0x424f4c46U /* "FLOB" */
+#define FLO_BUNDLE_VERSION   1
+#define FLO_BUNDLE_ALIGNMENT 16
+
+typedef struct
+{
+  uint32_t magic;      /* FLO_BUNDLE_MAGIC */
+  uint32_t version;    /* FLO_BUNDLE_VERSION */
+  uint32_t numentries; /* Number of modules, their entries follow the header. */
+}
+flo_bundle_header_t;
+
+typedef struct
+{
+  uint32_t name;    /* Offset of the name of the module from the start of the bundle. */
+  uint32_t offset;  /* Offset of the module file from the start of the bundle. */
+  uint32_t size;    /* Size of the module file. */
+  uint32_t buildid; /* The build id of the module, zero if it has none. */
+}
+flo_bundle_entry_t;
+
+typedef struct flo_bundle_t flo_bundle_t;
+
+/* Map a bundle, returns NULL if it can't be opened or isn't a valid bundle. */
+flo_bundle_t*             flo_bundle_open( const char* name );
+/* Unmap a bundle, its entries can't be used anymore, modules already instantiated stay. */
+void                      flo_bundle_close( flo_bundle_t* bundle );
+/* Find a module by name, the file name given to flolink without the folders and the .flo extension. Returns NULL if not found. */
+const flo_bundle_entry_t* flo_bundle_find( flo_bundle_t* bundle, const char* name );
+/* Same as flo_load_compressed or flo_pool_load if pool isn't NULL, but for a module of the bundle. */
+void*                     flo_bundle_instantiate( flo_bundle_t* bundle, const flo_bundle_entry_t* entry, flo_pool_t* pool, unsigned int* size );
+
+/*
+A module that can be replaced while other threads are calling it. flo_swap
+points the entry stubs of the old module to the ones of the new module with
+atomic stores, so callers holding the addresses of its functions go to the
+new code without taking any lock. The old module stays mapped until
+flo_quiesce, which the host calls once no thread runs its code or holds
+pointers to its data anymore. flo_quiesce then frees it, unless some of its
+entry stubs were published through put_symbol, since callers can keep those
+forever: it then frees all of it but the pages of the entry stubs and their
+slots, which stay until flo_hotswap_free. Only the first module and the ones
+that add functions publish stubs, so hosts that call flo_quiesce keep a
+bounded number of modules however many times they swap. Addresses of entry
+stubs taken from the module itself rather than from the loader aren't valid
+after flo_quiesce. Exported data isn't redirected, and calls
+inside a module always go to its own functions. The functions of the current
+module keep the stubs already published, only the other exports of the new
+module go through put_symbol, so exported data needs a loader that accepts
+redefinitions.
+*/
+typedef struct flo_retired_t flo_retired_t;
+
+typedef struct
+{
+  void*          flo;        /* The current module, NULL before the first flo_swap. */
+  unsigned int   size;
+  flo_retired_t* retired;    /* The modules replaced, newest first. */
+  unsigned int   numretired; /* How many there are. */
+  int            published;  /* The current module published some of its entry stubs. */
+}
+flo_hotswap_t;
+
+/* Load a FLO_FLAG_HOTSWAP module with flo_load_compressed, relocate it with loader and make it the current module, */
+/* returns one of the errors above. The new module must export all the functions of the current one, which stays */
+/* in place if anything fails. Only one thread at a time can swap the same module. */
+int  flo_swap( const flo_loader_t* loader, flo_hotswap_t* hotswap, const char* name );
+/* Free the modules replaced by flo_swap, except for the entry stubs and slots of the ones that published stubs. */
+void flo_quiesce( flo_hotswap_t* hotswap );
+/* Free the current module and what's left of the replaced ones, no pointer to their functions can be used anymore. */
+void flo_hotswap_free( flo_hotswap_t* hotswap );
 
-/* User-defined functions. */
-void*     flo_load( const char* name, unsigned int* size );      /* Load a module into memory. */
-uintptr_t flo_get_symbol( const char* name );                    /* Return the address of a symbol. */
-int       flo_put_symbol( const char* name, uintptr_t address ); /* Define a symbol. */
+/* User-defined functions, flo_get_symbol and flo_put_symbol are only needed by floglobal.c. */
+void*     flo_load( const char* name, unsigned int* size );   /* Load a module into memory. */
+uintptr_t flo_get_symbol( flo_key_t key );                    /* Return the address of a symbol. */
+int       flo_put_symbol( flo_key_t key, uintptr_t address ); /* Define a symbol. */
 
 #endif /* FLOLOAD_H */
@@ -0,0 +1,132 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <floload.h>
+
+/*
+flo_perf_map_add and flo_perf_map_remove, which write the function table of
+modules to the perf map of the process, /tmp/perf-<pid>.map. Each line is the
+address and the size of a function in hex and its name. Both hold a mutex, a
+line appended while flo_perf_map_remove rewrites the map would be lost.
+*/
+static pthread_mutex_t flo_perf_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void flo_perf_map_name( char* name, size_t size, const char* suffix )
+{
+  snprintf( name, size, "/tmp/perf-%ld.map%s", (long)getpid(), suffix );
+}
+
+int flo_perf_map_add( void* flo, unsigned int size )
+{
+  flo_header_t* header = FLO_GET_HEADER( flo, size );
+  const flo_function_t* func = FLO_GET_FUNCTIONS( header );
+  uint32_t count = FLO_GET_NUMFUNCTIONS( header );
+  char name[ 64 ];
+  FILE* map;
+  int ok;
+  
+  if ( count == 0 )
+  {
+    return 1;
+  }
+  
+  flo_perf_map_name( name, sizeof( name ), "" );
+  pthread_mutex_lock( &flo_perf_mutex );
+  map = fopen( name, "a" );
+  
+  if ( map == NULL )
+  {
+    pthread_mutex_unlock( &flo_perf_mutex );
+    return 0;
+  }
+  
+  for ( ; count != 0; count--, func++ )
+  {
+    fprintf( map, "%" PRIxPTR " %" PRIx32 " %s\n", (uintptr_t)FLO_GET_FUNCTION_ADDRESS( func ), func->size, FLO_GET_FUNCTION_NAME( func ) );
+  }
+  
+  ok = !ferror( map );
+  ok = fclose( map ) == 0 && ok;
+  pthread_mutex_unlock( &flo_perf_mutex );
+  return ok;
+}
+
+int flo_perf_map_remove( void* flo, unsigned int size )
+{
+  flo_header_t* header = FLO_GET_HEADER( flo, size );
+  char name[ 64 ];
+  char temp[ 64 ];
+  char* line = NULL;
+  size_t length = 0;
+  FILE* map;
+  FILE* rewritten;
+  int fd;
+  int ok;
+  
+  if ( FLO_GET_NUMFUNCTIONS( header ) == 0 )
+  {
+    return 1;
+  }
+  
+  flo_perf_map_name( name, sizeof( name ), "" );
+  flo_perf_map_name( temp, sizeof( temp ), ".XXXXXX" );
+  pthread_mutex_lock( &flo_perf_mutex );
+  map = fopen( name, "r" );
+  
+  if ( map == NULL )
+  {
+    pthread_mutex_unlock( &flo_perf_mutex );
+    return 0;
+  }
+  
+  /* mkstemp creates a new file, anyone could leave a symlink at a predictable name in /tmp. */
+  fd = mkstemp( temp );
+  
+  if ( fd < 0 )
+  {
+    fclose( map );
+    pthread_mutex_unlock( &flo_perf_mutex );
+    return 0;
+  }
+  
+  /* mkstemp creates it with mode 0600, the map stays readable like the one fopen creates. */
+  rewritten = fchmod( fd, 0644 ) == 0 ? fdopen( fd, "w" ) : NULL;
+  
+  if ( rewritten == NULL )
+  {
+    close( fd );
+    remove( temp );
+    fclose( map );
+    pthread_mutex_unlock( &flo_perf_mutex );
+    return 0;
+  }
+  
+  /* Keep the lines of other modules and of other code generators. */
+  while ( getline( &line, &length, map ) != -1 )
+  {
+    uintptr_t address = (uintptr_t)strtoull( line, NULL, 16 );
+    
+    if ( address < (uintptr_t)flo || address >= (uintptr_t)flo + size )
+    {
+      fputs( line, rewritten );
+    }
+  }
+  
+  free( line );
+  ok = !ferror( map ) && !ferror( rewritten );
+  fclose( map );
+  
+  /* The rename replaces the map in one step, profilers never see half of it. */
+  if ( fclose( rewritten ) != 0 || !ok || rename( temp, name ) != 0 )
+  {
+    remove( temp );
+    ok = 0;
+  }
+  
+  pthread_mutex_unlock( &flo_perf_mutex );
+  return ok;
+}
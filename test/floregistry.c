@@ -0,0 +1,346 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <floregistry.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#define FLO_REGISTRY_YIELD() SwitchToThread()
+#else
+#include <sched.h>
+#define FLO_REGISTRY_YIELD() sched_yield()
+#endif
+
+#if defined( __x86_64__ ) || defined( __i386__ ) || defined( _M_X64 ) || defined( _M_IX86 )
+#include <immintrin.h>
+#define FLO_REGISTRY_PAUSE() _mm_pause()
+#else
+#define FLO_REGISTRY_PAUSE() do { } while ( 0 )
+#endif
+
+/* Spins on the writer lock before yielding the processor. */
+#define FLO_REGISTRY_SPINS 64
+
+/* The address of removed symbols, their entries stay so that probes for other keys go on past them. */
+#define FLO_REGISTRY_REMOVED ( (uintptr_t)1 )
+
+#ifdef FLO_HASHED_SYMBOLS
+#define FLO_KEY_HASH( key )         ( key )
+#define FLO_KEY_EQUAL( entry, key ) 1
+#else
+#define FLO_KEY_HASH( key )         flo_djb2( key )
+#define FLO_KEY_EQUAL( entry, key ) ( !strcmp( ( entry )->name, key ) )
+#endif
+
+/* An entry is empty while its address is zero. hash and name are written before the address is published and never change. */
+typedef struct
+{
+  uint32_t            hash;
+  const char*         name;    /* NULL in FLO_HASHED_SYMBOLS builds. */
+  _Atomic( uintptr_t ) address;
+}
+flo_entry_t;
+
+typedef struct flo_table_t
+{
+  struct flo_table_t* retired; /* The table this one replaced. */
+  uint32_t            mask;
+  uint32_t            used;    /* Entries that aren't empty, removed ones included. */
+  flo_entry_t         entries[ 1 ];
+}
+flo_table_t;
+
+/* Copies of the names, which are freed with the registry since readers can be looking at them at any time. */
+typedef struct flo_name_t
+{
+  struct flo_name_t* next;
+  char               name[ 1 ];
+}
+flo_name_t;
+
+struct flo_registry_t
+{
+  _Atomic( flo_table_t* ) table;
+  atomic_flag             lock;  /* Held by writers. */
+  flo_name_t*             names;
+};
+
+#ifndef FLO_HASHED_SYMBOLS
+static uint32_t flo_djb2( const char* str )
+{
+  /* Same as djb2.lua */
+  uint32_t hash = 5381;
+  
+  while ( *str )
+  {
+    hash = hash * 33 + (uint8_t)*str++;
+  }
+  
+  return hash;
+}
+#endif
+
+/* The smallest table that holds count entries without growing. */
+static uint32_t flo_table_size( uint32_t count )
+{
+  uint32_t size = 16;
+  
+  while ( count * 4 >= size * 3 )
+  {
+    size *= 2;
+  }
+  
+  return size;
+}
+
+static flo_table_t* flo_table_new( uint32_t size )
+{
+  flo_table_t* table = (flo_table_t*)calloc( 1, sizeof( flo_table_t ) + ( size - 1 ) * sizeof( flo_entry_t ) );
+  
+  if ( table != NULL )
+  {
+    table->mask = size - 1;
+  }
+  
+  return table;
+}
+
+/* Returns the entry of key, or the empty entry where it goes, and its address. Tables always have empty entries. */
+static flo_entry_t* flo_table_find( flo_table_t* table, uint32_t hash, flo_key_t key, uintptr_t* address )
+{
+  uint32_t i = hash & table->mask;
+  
+  /* FLO_KEY_EQUAL doesn't look at the key in FLO_HASHED_SYMBOLS builds. */
+  (void)key;
+  
+  for ( ;; )
+  {
+    flo_entry_t* entry = table->entries + i;
+    uintptr_t value = atomic_load_explicit( &entry->address, memory_order_acquire );
+    
+    if ( value == 0 || ( entry->hash == hash && FLO_KEY_EQUAL( entry, key ) ) )
+    {
+      *address = value;
+      return entry;
+    }
+    
+    i = ( i + 1 ) & table->mask;
+  }
+}
+
+/* Writers hold the lock while they put or remove one symbol, but that can mean copying its name and growing the table. */
+static void flo_registry_lock( flo_registry_t* registry )
+{
+  unsigned int spins = 0;
+  
+  while ( atomic_flag_test_and_set_explicit( &registry->lock, memory_order_acquire ) )
+  {
+    /* Give a writer that's growing the table or was preempted a chance to finish. */
+    if ( ++spins < FLO_REGISTRY_SPINS )
+    {
+      FLO_REGISTRY_PAUSE();
+    }
+    else
+    {
+      FLO_REGISTRY_YIELD();
+      spins = 0;
+    }
+  }
+}
+
+static void flo_registry_unlock( flo_registry_t* registry )
+{
+  atomic_flag_clear_explicit( &registry->lock, memory_order_release );
+}
+
+/* Copies the live entries into a table with room for as many again, and publishes it. Called with the lock held. */
+static flo_table_t* flo_registry_grow( flo_registry_t* registry, flo_table_t* table )
+{
+  flo_table_t* grown;
+  uint32_t live = 0;
+  uint32_t i;
+  
+  for ( i = 0; i <= table->mask; i++ )
+  {
+    uintptr_t value = atomic_load_explicit( &table->entries[ i ].address, memory_order_relaxed );
+    live += value != 0 && value != FLO_REGISTRY_REMOVED;
+  }
+  
+  grown = flo_table_new( flo_table_size( live * 2 ) );
+  
+  if ( grown == NULL )
+  {
+    return NULL;
+  }
+  
+  for ( i = 0; i <= table->mask; i++ )
+  {
+    flo_entry_t* entry = table->entries + i;
+    uintptr_t value = atomic_load_explicit( &entry->address, memory_order_relaxed );
+    uint32_t j = entry->hash & grown->mask;
+    
+    if ( value == 0 || value == FLO_REGISTRY_REMOVED )
+    {
+      continue;
+    }
+    
+    /* Keys are unique, the first empty entry is the one. */
+    while ( atomic_load_explicit( &grown->entries[ j ].address, memory_order_relaxed ) != 0 )
+    {
+      j = ( j + 1 ) & grown->mask;
+    }
+    
+    grown->entries[ j ].hash = entry->hash;
+    grown->entries[ j ].name = entry->name;
+    atomic_store_explicit( &grown->entries[ j ].address, value, memory_order_relaxed );
+    grown->used++;
+  }
+  
+  /* Readers still in the old table finish their lookups there. */
+  grown->retired = table;
+  atomic_store_explicit( &registry->table, grown, memory_order_release );
+  return grown;
+}
+
+flo_registry_t* flo_registry_new( unsigned int capacity )
+{
+  flo_registry_t* registry = (flo_registry_t*)malloc( sizeof( flo_registry_t ) );
+  flo_table_t* table = flo_table_new( flo_table_size( capacity ) );
+  
+  if ( registry == NULL || table == NULL )
+  {
+    free( registry );
+    free( table );
+    return NULL;
+  }
+  
+  atomic_init( &registry->table, table );
+  atomic_flag_clear( &registry->lock );
+  registry->names = NULL;
+  return registry;
+}
+
+void flo_registry_delete( flo_registry_t* registry )
+{
+  flo_table_t* table = atomic_load_explicit( &registry->table, memory_order_relaxed );
+  
+  while ( table != NULL )
+  {
+    flo_table_t* retired = table->retired;
+    free( table );
+    table = retired;
+  }
+  
+  while ( registry->names != NULL )
+  {
+    flo_name_t* next = registry->names->next;
+    free( registry->names );
+    registry->names = next;
+  }
+  
+  free( registry );
+}
+
+uintptr_t flo_registry_get( flo_registry_t* registry, flo_key_t key )
+{
+  flo_table_t* table = atomic_load_explicit( &registry->table, memory_order_acquire );
+  uintptr_t address;
+  
+  flo_table_find( table, FLO_KEY_HASH( key ), key, &address );
+  return address != FLO_REGISTRY_REMOVED ? address : 0;
+}
+
+int flo_registry_put( flo_registry_t* registry, flo_key_t key, uintptr_t address )
+{
+  uint32_t hash = FLO_KEY_HASH( key );
+  flo_table_t* table;
+  flo_entry_t* entry;
+  uintptr_t value;
+  
+  if ( address == 0 || address == FLO_REGISTRY_REMOVED )
+  {
+    return 0;
+  }
+  
+  flo_registry_lock( registry );
+  table = atomic_load_explicit( &registry->table, memory_order_relaxed );
+  entry = flo_table_find( table, hash, key, &value );
+  
+  if ( value == 0 )
+  {
+    if ( ( table->used + 1 ) * 4 > ( table->mask + 1 ) * 3 )
+    {
+      table = flo_registry_grow( registry, table );
+      
+      if ( table == NULL )
+      {
+        flo_registry_unlock( registry );
+        return 0;
+      }
+      
+      entry = flo_table_find( table, hash, key, &value );
+    }
+
+#ifndef FLO_HASHED_SYMBOLS
+    {
+      flo_name_t* name = (flo_name_t*)malloc( sizeof( flo_name_t ) + strlen( key ) );
+      
+      if ( name == NULL )
+      {
+        flo_registry_unlock( registry );
+        return 0;
+      }
+      
+      strcpy( name->name, key );
+      name->next = registry->names;
+      registry->names = name;
+      entry->name = name->name;
+    }
+#endif
+    
+    entry->hash = hash;
+    table->used++;
+  }
+  
+  /* Publishes the entry if it's new, readers see its hash and name along with the address. */
+  atomic_store_explicit( &entry->address, address, memory_order_release );
+  flo_registry_unlock( registry );
+  return 1;
+}
+
+int flo_registry_remove( flo_registry_t* registry, flo_key_t key )
+{
+  flo_table_t* table;
+  flo_entry_t* entry;
+  uintptr_t value;
+  
+  flo_registry_lock( registry );
+  table = atomic_load_explicit( &registry->table, memory_order_relaxed );
+  entry = flo_table_find( table, FLO_KEY_HASH( key ), key, &value );
+  
+  if ( value != 0 && value != FLO_REGISTRY_REMOVED )
+  {
+    atomic_store_explicit( &entry->address, FLO_REGISTRY_REMOVED, memory_order_release );
+  }
+  
+  flo_registry_unlock( registry );
+  return value != 0 && value != FLO_REGISTRY_REMOVED;
+}
+
+static uintptr_t flo_registry_get_symbol( void* ud, flo_key_t key )
+{
+  return flo_registry_get( (flo_registry_t*)ud, key );
+}
+
+static int flo_registry_put_symbol( void* ud, flo_key_t key, uintptr_t address )
+{
+  return flo_registry_put( (flo_registry_t*)ud, key, address );
+}
+
+void flo_registry_loader( flo_registry_t* registry, flo_loader_t* loader )
+{
+  loader->get_symbol = flo_registry_get_symbol;
+  loader->put_symbol = flo_registry_put_symbol;
+  loader->ud = registry;
+}
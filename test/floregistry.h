@@ -0,0 +1,33 @@
+#ifndef FLOREGISTRY_H
+#define FLOREGISTRY_H
+
+#include <floload.h>
+
+/*
+A concurrent symbol registry for hosts that load modules from several
+threads into one namespace. Lookups never take a lock: the registry is an
+open-addressing hash table keyed by the djb2 hash of the names (the same
+function as djb2.lua), or by the hash itself in FLO_HASHED_SYMBOLS builds,
+and entries are published with release stores. Writers are serialized by a
+spinlock, and a writer that needs more room builds a bigger table and
+publishes it with a single pointer store, RCU-style: readers that are still
+walking the old table see a consistent snapshot of it. Old tables and the
+copies of the names are only freed by flo_registry_delete, which must not
+run concurrently with anything else. Needs C11 atomics.
+*/
+typedef struct flo_registry_t flo_registry_t;
+
+/* Create a registry with room for capacity symbols before it grows, returns NULL if out of memory. */
+flo_registry_t* flo_registry_new( unsigned int capacity );
+/* Destroy a registry, nothing can use it anymore. */
+void            flo_registry_delete( flo_registry_t* registry );
+/* Return the address of a symbol, zero if not found. Lock-free. */
+uintptr_t       flo_registry_get( flo_registry_t* registry, flo_key_t key );
+/* Define a symbol or replace its address, the name is copied. Returns zero if out of memory or if address is zero. */
+int             flo_registry_put( flo_registry_t* registry, flo_key_t key, uintptr_t address );
+/* Forget a symbol, returns zero if it wasn't defined. */
+int             flo_registry_remove( flo_registry_t* registry, flo_key_t key );
+/* Fill a loader that looks imports up in the registry and defines the exports in it. */
+void            flo_registry_loader( flo_registry_t* registry, flo_loader_t* loader );
+
+#endif /* FLOREGISTRY_H */
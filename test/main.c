@@ -62,9 +62,16 @@ typedef void (*say_hello_func)( void );
 
 int main()
 {
-  // load .flo into memory
+  // load .flo into executable memory, .bss isn't in the file so it must be
+  // loaded with flo_load_compressed.
   unsigned size;
-  void* test = flo_load( "test.flo", &size );
+  void* test = flo_load_compressed( "test.flo", &size );
+  
+  if ( test == NULL )
+  {
+    printf( "error loading test.flo\n" );
+    return 1;
+  }
   
   printf( "test.flo loaded at 0x%08x\n", test );
   
@@ -72,18 +79,6 @@ int main()
   const char* extra;
   flo_relocate( test, size, &extra );
   
-  // enable execute. we shouldn't call VirtualProtect on memory returned by
-  // malloc, because the granularity of VP is pages, so the call below could
-  // include internal heap structures. since we're just setting the execute
-  // bit, all should be well.
-  DWORD old_protect;
-  
-  if ( !VirtualProtect( test, size, PAGE_EXECUTE_READWRITE, &old_protect ) )
-  {
-    printf( "error setting the execute bit: %u\n", GetLastError() );
-    return 1;
-  }
-  
   // flush the instruction cache, although i think it isn't necessary in this
   // contrived example.
   // this should work but isn't. sigh.
@@ -103,7 +98,7 @@ int main()
   printf( "------------------------------\n" );
   
   // cleanup
-  free( test );
+  flo_free_image( test, size );
   
   printf( "bye\n" );
   return 0;
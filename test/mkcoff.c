@@ -0,0 +1,408 @@
+// Generates synthetic x64 COFF objects to benchmark flolink and floload.
+//
+// Each object has one .text section with the given number of functions, one
+// .data section and optionally one .bss section. Every function does fan-out REL32 calls to functions
+// defined in other objects, and the undefined imports are spread across all
+// functions so that each one is called at least once. With -p, .data is a
+// table of ADDR64 pointers to the functions of the object, like a vtable.
+// With -s, every object also has a static function named helper, which
+// returns the index of the object and is called last by its first function,
+// so that f<n>_0 returns n when the objects are linked right.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <coff.h>
+
+typedef struct
+{
+  uint8_t*     data;
+  unsigned int size;
+  unsigned int reserved;
+}
+buffer_t;
+
+static void* xrealloc( void* ptr, size_t size )
+{
+  ptr = realloc( ptr, size );
+  
+  if ( ptr == NULL )
+  {
+    fprintf( stderr, "Error: Out of memory\n" );
+    exit( 1 );
+  }
+  
+  return ptr;
+}
+
+static void* append( buffer_t* buffer, const void* data, unsigned int size )
+{
+  if ( buffer->size + size > buffer->reserved )
+  {
+    buffer->reserved = ( buffer->size + size ) * 2;
+    buffer->data = (uint8_t*)xrealloc( buffer->data, buffer->reserved );
+  }
+  
+  uint8_t* dest = buffer->data + buffer->size;
+  
+  if ( data )
+  {
+    memcpy( dest, data, size );
+  }
+  else
+  {
+    memset( dest, 0, size );
+  }
+  
+  buffer->size += size;
+  return dest;
+}
+
+static void append8( buffer_t* buffer, uint8_t u8 )
+{
+  append( buffer, &u8, 1 );
+}
+
+typedef struct
+{
+  unsigned objects;
+  unsigned functions;
+  unsigned fanout;
+  unsigned imports;
+  unsigned bss;
+  unsigned pointers;
+  unsigned statics;
+  const char* prefix;
+}
+config_t;
+
+typedef struct
+{
+  buffer_t text;
+  buffer_t relocations;
+  buffer_t data_relocations;
+  buffer_t symbols;
+  buffer_t strings;
+  unsigned numrelocations;
+  unsigned numsymbols;
+}
+object_t;
+
+static void add_symbol( object_t* obj, const char* name, uint32_t value, int section, unsigned type )
+{
+  coff_symbol_t* symbol = (coff_symbol_t*)append( &obj->symbols, NULL, COFF_SYMBOL_SIZE );
+  size_t length = strlen( name );
+  
+  if ( length <= 8 )
+  {
+    memcpy( symbol->Name.ShortName, name, length );
+  }
+  else
+  {
+    // The string table offset includes its 4-byte size field.
+    COFF_SET_U32( *symbol, Name.LongName.Offset, obj->strings.size + 4 );
+    append( &obj->strings, name, length + 1 );
+  }
+  
+  COFF_SET_U32( *symbol, Value, value );
+  COFF_SET_U16( *symbol, SectionNumber, (uint16_t)section );
+  COFF_SET_U16( *symbol, Type, type );
+  COFF_SET_U8( *symbol, StorageClass, IMAGE_SYM_CLASS_EXTERNAL );
+  obj->numsymbols++;
+}
+
+static void add_call( object_t* obj, unsigned symbol_index )
+{
+  coff_relocation_t* relocation = (coff_relocation_t*)append( &obj->relocations, NULL, COFF_RELOCATION_SIZE );
+  
+  COFF_SET_U32( *relocation, VirtualAddress, obj->text.size + 1 );
+  COFF_SET_U32( *relocation, SymbolTableIndex, symbol_index );
+  COFF_SET_U16( *relocation, Type, IMAGE_REL_AMD64_REL32 );
+  obj->numrelocations++;
+  
+  append8( &obj->text, 0xe8 ); // call rel32
+  append( &obj->text, NULL, 4 );
+}
+
+static int write_object( const config_t* cfg, unsigned index, unsigned* stamp, unsigned* symidx )
+{
+  object_t obj;
+  char name[ 64 ];
+  unsigned j, c, k;
+  
+  memset( &obj, 0, sizeof( obj ) );
+  
+  // Defined symbols come first so their indices are known: f<index>_<j>
+  // are at [0, functions), d<index> is right after them, and then b<index>
+  // if there's .bss.
+  for ( j = 0; j < cfg->functions; j++ )
+  {
+    sprintf( name, "f%u_%u", index, j );
+    add_symbol( &obj, name, 0, 1, IMAGE_SYM_DTYPE_FUNCTION << 4 );
+  }
+  
+  sprintf( name, "d%u", index );
+  add_symbol( &obj, name, 0, 2, IMAGE_SYM_TYPE_NULL );
+  
+  if ( cfg->bss != 0 )
+  {
+    sprintf( name, "b%u", index );
+    add_symbol( &obj, name, 0, 3, IMAGE_SYM_TYPE_NULL );
+  }
+  
+  // The same name in every object, only its own object must see it.
+  unsigned helper = obj.numsymbols;
+  
+  if ( cfg->statics )
+  {
+    add_symbol( &obj, "helper", 0, 1, IMAGE_SYM_DTYPE_FUNCTION << 4 );
+    COFF_SET_U8( *(coff_symbol_t*)( obj.symbols.data + helper * COFF_SYMBOL_SIZE ), StorageClass, IMAGE_SYM_CLASS_STATIC );
+  }
+  
+  for ( j = 0; j < cfg->functions; j++ )
+  {
+    // Fix the value of the function symbol now that its offset is known.
+    coff_symbol_t* symbol = (coff_symbol_t*)( obj.symbols.data + j * COFF_SYMBOL_SIZE );
+    COFF_SET_U32( *symbol, Value, obj.text.size );
+    
+    // Cross-object calls.
+    for ( c = 0; c < cfg->fanout && cfg->objects > 1; c++ )
+    {
+      unsigned target = ( index + 1 + c % ( cfg->objects - 1 ) ) % cfg->objects;
+      unsigned func = ( j * 7 + c ) % cfg->functions;
+      unsigned key = target * cfg->functions + func;
+      
+      if ( stamp[ key ] != index + 1 )
+      {
+        stamp[ key ] = index + 1;
+        symidx[ key ] = obj.numsymbols;
+        
+        sprintf( name, "f%u_%u", target, func );
+        add_symbol( &obj, name, 0, IMAGE_SYM_UNDEFINED, IMAGE_SYM_DTYPE_FUNCTION << 4 );
+      }
+      
+      add_call( &obj, symidx[ key ] );
+    }
+    
+    // Imports: import k is called by object k % objects, in function
+    // ( k / objects ) % functions.
+    for ( k = index; k < cfg->imports; k += cfg->objects )
+    {
+      if ( ( k / cfg->objects ) % cfg->functions == j )
+      {
+        sprintf( name, "imp%u", k );
+        add_call( &obj, obj.numsymbols );
+        add_symbol( &obj, name, 0, IMAGE_SYM_UNDEFINED, IMAGE_SYM_DTYPE_FUNCTION << 4 );
+      }
+    }
+    
+    if ( cfg->statics && j == 0 )
+    {
+      add_call( &obj, helper );
+    }
+    
+    append8( &obj.text, 0xc3 ); // ret
+    
+    while ( obj.text.size & 15 )
+    {
+      append8( &obj.text, 0xcc ); // int3
+    }
+  }
+  
+  if ( cfg->statics )
+  {
+    coff_symbol_t* symbol = (coff_symbol_t*)( obj.symbols.data + helper * COFF_SYMBOL_SIZE );
+    COFF_SET_U32( *symbol, Value, obj.text.size );
+    
+    append8( &obj.text, 0xb8 ); // mov eax, imm32
+    append8( &obj.text, index );
+    append8( &obj.text, index >> 8 );
+    append8( &obj.text, index >> 16 );
+    append8( &obj.text, index >> 24 );
+    append8( &obj.text, 0xc3 ); // ret
+    
+    while ( obj.text.size & 15 )
+    {
+      append8( &obj.text, 0xcc ); // int3
+    }
+  }
+  
+  if ( obj.numrelocations > 65535 || ( cfg->pointers && cfg->functions > 65535 ) )
+  {
+    fprintf( stderr, "Error: Object %u needs more than 65535 relocations in a section\n", index );
+    return -1;
+  }
+  
+  // The function table, symbols [0, functions) are the functions.
+  if ( cfg->pointers )
+  {
+    for ( j = 0; j < cfg->functions; j++ )
+    {
+      coff_relocation_t* relocation = (coff_relocation_t*)append( &obj.data_relocations, NULL, COFF_RELOCATION_SIZE );
+      
+      COFF_SET_U32( *relocation, VirtualAddress, j * 8 );
+      COFF_SET_U32( *relocation, SymbolTableIndex, j );
+      COFF_SET_U16( *relocation, Type, IMAGE_REL_AMD64_ADDR64 );
+    }
+  }
+  
+  // Lay the object out: header, section table, .text, relocations, .data,
+  // its relocations, symbol table and string table. .bss has no raw data.
+  unsigned numsections = cfg->bss != 0 ? 3 : 2;
+  unsigned datasize = cfg->functions * 8;
+  unsigned text_ptr = COFF_HEADER_SIZE + numsections * COFF_SECTION_SIZE;
+  unsigned reloc_ptr = text_ptr + obj.text.size;
+  unsigned data_ptr = reloc_ptr + obj.relocations.size;
+  unsigned data_reloc_ptr = data_ptr + datasize;
+  unsigned symtab_ptr = data_reloc_ptr + obj.data_relocations.size;
+  
+  coff_header_t header;
+  memset( &header, 0, sizeof( header ) );
+  COFF_SET_U16( header, Machine, IMAGE_FILE_MACHINE_AMD64 );
+  COFF_SET_U16( header, NumberOfSections, numsections );
+  COFF_SET_U32( header, PointerToSymbolTable, symtab_ptr );
+  COFF_SET_U32( header, NumberOfSymbols, obj.numsymbols );
+  
+  coff_section_t sections[ 3 ];
+  memset( sections, 0, sizeof( sections ) );
+  
+  memcpy( sections[ 0 ].Name, ".text", 5 );
+  COFF_SET_U32( sections[ 0 ], SizeOfRawData, obj.text.size );
+  COFF_SET_U32( sections[ 0 ], PointerToRawData, text_ptr );
+  COFF_SET_U32( sections[ 0 ], PointerToRelocations, reloc_ptr );
+  COFF_SET_U16( sections[ 0 ], NumberOfRelocations, obj.numrelocations );
+  COFF_SET_U32( sections[ 0 ], Characteristics, IMAGE_SCN_CNT_CODE | IMAGE_SCN_ALIGN_16BYTES | IMAGE_SCN_MEM_EXECUTE | IMAGE_SCN_MEM_READ );
+  
+  memcpy( sections[ 1 ].Name, ".data", 5 );
+  COFF_SET_U32( sections[ 1 ], SizeOfRawData, datasize );
+  COFF_SET_U32( sections[ 1 ], PointerToRawData, data_ptr );
+  COFF_SET_U32( sections[ 1 ], PointerToRelocations, cfg->pointers ? data_reloc_ptr : 0 );
+  COFF_SET_U16( sections[ 1 ], NumberOfRelocations, cfg->pointers ? cfg->functions : 0 );
+  COFF_SET_U32( sections[ 1 ], Characteristics, IMAGE_SCN_CNT_INITIALIZED_DATA | IMAGE_SCN_ALIGN_16BYTES | IMAGE_SCN_MEM_READ | IMAGE_SCN_MEM_WRITE );
+  
+  memcpy( sections[ 2 ].Name, ".bss", 4 );
+  COFF_SET_U32( sections[ 2 ], SizeOfRawData, cfg->bss );
+  COFF_SET_U32( sections[ 2 ], Characteristics, IMAGE_SCN_CNT_UNINITIALIZED_DATA | IMAGE_SCN_ALIGN_16BYTES | IMAGE_SCN_MEM_READ | IMAGE_SCN_MEM_WRITE );
+  
+  // The .data section is all zeros, its pointers are in the relocations.
+  void* data = calloc( 1, datasize + 1 );
+  
+  if ( data == NULL )
+  {
+    fprintf( stderr, "Error: Out of memory\n" );
+    return -1;
+  }
+  
+  sprintf( name, "%s%u.o", cfg->prefix, index );
+  FILE* file = fopen( name, "wb" );
+  
+  if ( file == NULL )
+  {
+    fprintf( stderr, "Error: Could not create %s\n", name );
+    free( data );
+    return -1;
+  }
+  
+  uint8_t strsize[ 4 ];
+  uint32_t u32 = obj.strings.size + 4;
+  strsize[ 0 ] = u32; strsize[ 1 ] = u32 >> 8; strsize[ 2 ] = u32 >> 16; strsize[ 3 ] = u32 >> 24;
+  
+  fwrite( &header, 1, COFF_HEADER_SIZE, file );
+  fwrite( sections, 1, numsections * COFF_SECTION_SIZE, file );
+  fwrite( obj.text.data, 1, obj.text.size, file );
+  fwrite( obj.relocations.data, 1, obj.relocations.size, file );
+  fwrite( data, 1, datasize, file );
+  fwrite( obj.data_relocations.data, 1, obj.data_relocations.size, file );
+  fwrite( obj.symbols.data, 1, obj.symbols.size, file );
+  fwrite( strsize, 1, 4, file );
+  fwrite( obj.strings.data, 1, obj.strings.size, file );
+  fclose( file );
+  
+  free( data );
+  free( obj.text.data );
+  free( obj.relocations.data );
+  free( obj.data_relocations.data );
+  free( obj.symbols.data );
+  free( obj.strings.data );
+  return 0;
+}
+
+static void usage( FILE* out )
+{
+  fprintf( out,
+    "mkcoff [-n objects] [-m functions] [-f fanout] [-k imports] [-b bss] [-p 0|1] [-s 0|1] [-o prefix]\n"
+    "\n"
+    "-n Number of objects (default 1)\n"
+    "-m Number of functions per object (default 1)\n"
+    "-f Number of cross-object calls per function (default 0)\n"
+    "-k Number of undefined imports (default 0)\n"
+    "-b Size of .bss in bytes per object (default 0, no .bss)\n"
+    "-p Fill .data with ADDR64 pointers to the functions (default 0)\n"
+    "-s Add a static function named helper to every object (default 0)\n"
+    "-o Prefix of the generated files, <prefix><n>.o (default obj)\n"
+  );
+}
+
+int main( int argc, const char* argv[] )
+{
+  config_t cfg = { 1, 1, 0, 0, 0, 0, 0, "obj" };
+  int i;
+  
+  for ( i = 1; i < argc; i++ )
+  {
+    if ( !strcmp( argv[ i ], "-?" ) )
+    {
+      usage( stdout );
+      return 0;
+    }
+    
+    if ( argv[ i ][ 0 ] != '-' || i + 1 >= argc )
+    {
+      usage( stderr );
+      return 1;
+    }
+    
+    switch ( argv[ i ][ 1 ] )
+    {
+    case 'n': cfg.objects = strtoul( argv[ ++i ], NULL, 0 ); break;
+    case 'm': cfg.functions = strtoul( argv[ ++i ], NULL, 0 ); break;
+    case 'f': cfg.fanout = strtoul( argv[ ++i ], NULL, 0 ); break;
+    case 'k': cfg.imports = strtoul( argv[ ++i ], NULL, 0 ); break;
+    case 'b': cfg.bss = strtoul( argv[ ++i ], NULL, 0 ); break;
+    case 'p': cfg.pointers = strtoul( argv[ ++i ], NULL, 0 ); break;
+    case 's': cfg.statics = strtoul( argv[ ++i ], NULL, 0 ); break;
+    case 'o': cfg.prefix = argv[ ++i ]; break;
+    default: usage( stderr ); return 1;
+    }
+  }
+  
+  if ( cfg.objects == 0 || cfg.functions == 0 )
+  {
+    fprintf( stderr, "Error: There must be at least one object with one function\n" );
+    return 1;
+  }
+  
+  unsigned total = cfg.objects * cfg.functions;
+  unsigned* stamp = (unsigned*)calloc( total, sizeof( unsigned ) );
+  unsigned* symidx = (unsigned*)calloc( total, sizeof( unsigned ) );
+  unsigned index;
+  
+  if ( stamp == NULL || symidx == NULL )
+  {
+    fprintf( stderr, "Error: Out of memory\n" );
+    return 1;
+  }
+  
+  for ( index = 0; index < cfg.objects; index++ )
+  {
+    if ( write_object( &cfg, index, stamp, symidx ) != 0 )
+    {
+      return 1;
+    }
+  }
+  
+  free( stamp );
+  free( symidx );
+  return 0;
+}
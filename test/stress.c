@@ -0,0 +1,173 @@
+// Concurrent stress test of floregistry.c (Linux).
+//
+// Writer threads put symbols into a registry that starts small, so that it
+// grows many times while reader threads look up symbols that were already
+// published, symbols that never will be, and symbols that are put and removed
+// over and over. A lookup must return the exact address of a published
+// symbol, zero for a missing one, and either for a removed one, never
+// anything else. Build it with -DFLO_HASHED_SYMBOLS to test the hashed keys.
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <floregistry.h>
+
+#define WRITERS 2
+#define READERS 4
+
+static flo_registry_t* registry;
+static unsigned symbols;
+
+// How many symbols each writer has published, readers only look at those.
+static atomic_uint published[ WRITERS ];
+static atomic_int writing;
+static atomic_ulong lookups;
+static atomic_ulong errors;
+
+// The keys go in buffers of this type, kind is 0 for published symbols, 1
+// for removed ones and 2 for missing ones.
+#ifdef FLO_HASHED_SYMBOLS
+typedef uint32_t key_buffer_t;
+
+static flo_key_t make_key( key_buffer_t* key, unsigned kind, unsigned writer, unsigned index )
+{
+  // Scrambled like real hashes, a bijection so that keys stay unique and never zero.
+  *key = ( ( kind << 30 | writer << 24 | index ) + 1 ) * 2654435761U;
+  return *key;
+}
+#else
+typedef char key_buffer_t[ 32 ];
+
+static flo_key_t make_key( key_buffer_t* key, unsigned kind, unsigned writer, unsigned index )
+{
+  snprintf( *key, sizeof( *key ), "%c%u_%u", "prm"[ kind ], writer, index );
+  return *key;
+}
+#endif
+
+static uintptr_t address_of( unsigned writer, unsigned index )
+{
+  // Never 0 or 1, which the registry uses for empty and removed entries.
+  return ( (uintptr_t)index << 8 | writer << 1 ) + 16;
+}
+
+static void check( uintptr_t got, uintptr_t expected, int maybe_zero )
+{
+  if ( got != expected && !( maybe_zero && got == 0 ) )
+  {
+    atomic_fetch_add( &errors, 1 );
+  }
+}
+
+static void* writer( void* arg )
+{
+  unsigned w = (unsigned)(uintptr_t)arg;
+  unsigned i;
+  key_buffer_t key;
+  
+  for ( i = 0; i < symbols; i++ )
+  {
+    if ( !flo_registry_put( registry, make_key( &key, 0, w, i ), address_of( w, i ) ) )
+    {
+      atomic_fetch_add( &errors, 1 );
+    }
+    
+    atomic_store_explicit( &published[ w ], i + 1, memory_order_release );
+    
+    // Churn on a few symbols that come and go.
+    make_key( &key, 1, w, i % 16 );
+    
+    if ( !flo_registry_put( registry, key, address_of( w, i % 16 ) ) || !flo_registry_remove( registry, key ) )
+    {
+      atomic_fetch_add( &errors, 1 );
+    }
+  }
+  
+  atomic_fetch_sub( &writing, 1 );
+  return NULL;
+}
+
+static void* reader( void* arg )
+{
+  unsigned seed = (unsigned)(uintptr_t)arg;
+  unsigned long count = 0;
+  key_buffer_t key;
+  
+  while ( atomic_load( &writing ) != 0 )
+  {
+    unsigned w = rand_r( &seed ) % WRITERS;
+    unsigned n = atomic_load_explicit( &published[ w ], memory_order_acquire );
+    
+    if ( n != 0 )
+    {
+      unsigned i = rand_r( &seed ) % n;
+      check( flo_registry_get( registry, make_key( &key, 0, w, i ) ), address_of( w, i ), 0 );
+    }
+    
+    check( flo_registry_get( registry, make_key( &key, 1, w, seed % 16 ) ), address_of( w, seed % 16 ), 1 );
+    check( flo_registry_get( registry, make_key( &key, 2, w, seed % symbols ) ), 0, 0 );
+    count += 3;
+  }
+  
+  atomic_fetch_add( &lookups, count );
+  return NULL;
+}
+
+int main( int argc, const char* argv[] )
+{
+  pthread_t threads[ WRITERS + READERS ];
+  unsigned i, w;
+  key_buffer_t key;
+  
+  symbols = argc > 1 ? (unsigned)atoi( argv[ 1 ] ) : 100000;
+  
+  if ( symbols == 0 || symbols >= 1U << 24 )
+  {
+    fprintf( stderr, "Usage: stressflo [symbols per writer, less than 16777216]\n" );
+    return 1;
+  }
+  
+  registry = flo_registry_new( 0 );
+  atomic_store( &writing, WRITERS );
+  
+  if ( registry == NULL )
+  {
+    fprintf( stderr, "Error: Out of memory\n" );
+    return 1;
+  }
+  
+  for ( i = 0; i < READERS; i++ )
+  {
+    pthread_create( threads + WRITERS + i, NULL, reader, (void*)(uintptr_t)( i + 1 ) );
+  }
+  
+  for ( w = 0; w < WRITERS; w++ )
+  {
+    pthread_create( threads + w, NULL, writer, (void*)(uintptr_t)w );
+  }
+  
+  for ( i = 0; i < WRITERS + READERS; i++ )
+  {
+    pthread_join( threads[ i ], NULL );
+  }
+  
+  // Everything the writers published must be there once they're done.
+  for ( w = 0; w < WRITERS; w++ )
+  {
+    for ( i = 0; i < symbols; i++ )
+    {
+      check( flo_registry_get( registry, make_key( &key, 0, w, i ) ), address_of( w, i ), 0 );
+    }
+    
+    for ( i = 0; i < 16; i++ )
+    {
+      check( flo_registry_get( registry, make_key( &key, 1, w, i ) ), 0, 0 );
+    }
+  }
+  
+  flo_registry_delete( registry );
+  printf( "%lu lookups, %lu errors\n", atomic_load( &lookups ), atomic_load( &errors ) );
+  return atomic_load( &errors ) != 0;
+}
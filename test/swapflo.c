@@ -0,0 +1,166 @@
+// Swaps a module many times and checks that memory stays bounded (Linux).
+//
+// Loads a module linked with flolink --hotswap through flo_swap, takes the
+// addresses of the given exports from the loader, and swaps the same file in
+// again and again, calling flo_quiesce every few swaps. The modules that
+// published no entry stubs must be freed, so only the first one may stay on
+// the retired list once quiesced, and the first addresses must still call
+// the current module, returning the given values like in callflo.
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <floload.h>
+
+#define MAX_SYMBOLS 256
+
+typedef struct
+{
+  const char* name;
+  int         expected;
+  uintptr_t   address;
+}
+call_t;
+
+// What put_symbol got, redefinitions replace the address like a registry.
+static char* names[ MAX_SYMBOLS ];
+static uintptr_t addresses[ MAX_SYMBOLS ];
+static int numsymbols;
+
+static void stub( void )
+{
+}
+
+static uintptr_t get_symbol( void* ud, flo_key_t key )
+{
+  int i;
+  
+  (void)ud;
+  
+  for ( i = 0; i < numsymbols; i++ )
+  {
+    if ( !strcmp( names[ i ], key ) )
+    {
+      return addresses[ i ];
+    }
+  }
+  
+  return (uintptr_t)stub;
+}
+
+static int put_symbol( void* ud, flo_key_t key, uintptr_t address )
+{
+  int i;
+  
+  (void)ud;
+  
+  for ( i = 0; i < numsymbols; i++ )
+  {
+    if ( !strcmp( names[ i ], key ) )
+    {
+      addresses[ i ] = address;
+      return 1;
+    }
+  }
+  
+  if ( numsymbols == MAX_SYMBOLS || ( names[ numsymbols ] = strdup( key ) ) == NULL )
+  {
+    return 0;
+  }
+  
+  addresses[ numsymbols++ ] = address;
+  return 1;
+}
+
+int main( int argc, char* argv[] )
+{
+  if ( argc < 2 )
+  {
+    fprintf( stderr, "Usage: swapflo file.flo [swaps] [symbol=value...]\n" );
+    return 1;
+  }
+  
+  int swaps = argc > 2 ? atoi( argv[ 2 ] ) : 1000;
+  int numcalls = argc > 3 ? argc - 3 : 0;
+  call_t* calls = (call_t*)calloc( numcalls + 1, sizeof( call_t ) );
+  flo_loader_t loader = { get_symbol, put_symbol, NULL };
+  flo_hotswap_t hotswap = { 0 };
+  int i, j, errors = 0;
+  unsigned most = 0;
+  
+  if ( calls == NULL )
+  {
+    fprintf( stderr, "Error: Out of memory\n" );
+    return 1;
+  }
+  
+  if ( flo_swap( &loader, &hotswap, argv[ 1 ] ) != FLO_OK )
+  {
+    fprintf( stderr, "Error: Could not load %s\n", argv[ 1 ] );
+    return 1;
+  }
+  
+  for ( i = 0; i < numcalls; i++ )
+  {
+    char* equal = strchr( argv[ i + 3 ], '=' );
+    
+    if ( equal == NULL )
+    {
+      fprintf( stderr, "Error: Expected symbol=value, got %s\n", argv[ i + 3 ] );
+      return 1;
+    }
+    
+    *equal = 0;
+    calls[ i ].name = argv[ i + 3 ];
+    calls[ i ].expected = atoi( equal + 1 );
+    calls[ i ].address = get_symbol( NULL, calls[ i ].name );
+  }
+  
+  for ( i = 0; i < swaps; i++ )
+  {
+    int res = flo_swap( &loader, &hotswap, argv[ 1 ] );
+    
+    if ( res != FLO_OK )
+    {
+      fprintf( stderr, "Error: Swap %d failed with %d\n", i, res );
+      errors++;
+      break;
+    }
+    
+    most = hotswap.numretired > most ? hotswap.numretired : most;
+    
+    if ( i % 4 == 3 || i == swaps - 1 )
+    {
+      flo_quiesce( &hotswap );
+      
+      if ( hotswap.numretired > 1 )
+      {
+        fprintf( stderr, "Error: %u modules retired after swap %d\n", hotswap.numretired, i );
+        errors++;
+      }
+    }
+    
+    for ( j = 0; j < numcalls; j++ )
+    {
+      int got = ( (int ( * )( void ))calls[ j ].address )();
+      
+      if ( got != calls[ j ].expected )
+      {
+        fprintf( stderr, "Error: %s returned %d after swap %d, expected %d\n", calls[ j ].name, got, i, calls[ j ].expected );
+        errors++;
+      }
+    }
+  }
+  
+  printf( "%d swaps, at most %u retired, %u left, %d errors\n", swaps, most, hotswap.numretired, errors );
+  flo_hotswap_free( &hotswap );
+  
+  for ( i = 0; i < numsymbols; i++ )
+  {
+    free( names[ i ] );
+  }
+  
+  free( calls );
+  return errors != 0;
+}